@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdint.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include "compile.h"
+#include "stats.h"
+#include "cache.h"
+
+// Default number of compiled regexes retained, if the "ore.cacheSize" option is unset
+#define CACHE_DEFAULT_CAPACITY  256
+
+// Number of hash buckets; chains will be short for any sensible capacity
+#define CACHE_BUCKETS           1024
+
+typedef struct cache_entry {
+    char                  * pattern;
+    size_t                  pattern_len;
+    OnigOptionType          options;
+    OnigEncoding            onig_enc;
+    OnigSyntaxType        * syntax;
+    unsigned long           hash;
+    regex_t               * regex;
+    int                     refcount;
+    Rboolean                orphaned;
+    struct cache_entry    * prev;
+    struct cache_entry    * next;
+    struct cache_entry    * key_next;
+    struct cache_entry    * ptr_next;
+} cache_entry_t;
+
+// The LRU list runs from most (head) to least (tail) recently used; orphans are entries evicted while still in use
+static cache_entry_t *lru_head = NULL;
+static cache_entry_t *lru_tail = NULL;
+static cache_entry_t *key_buckets[CACHE_BUCKETS];
+static cache_entry_t *ptr_buckets[CACHE_BUCKETS];
+static int n_entries = 0;
+
+// FNV-1a hash over the pattern, combined with the other parts of the key
+static unsigned long ore_cache_hash (const char *pattern, const size_t len, const OnigOptionType options, const OnigEncoding onig_enc, const OnigSyntaxType *syntax)
+{
+    unsigned long hash = 2166136261UL;
+    for (size_t i=0; i<len; i++)
+        hash = (hash ^ (unsigned char) pattern[i]) * 16777619UL;
+    hash ^= (unsigned long) options;
+    hash ^= (unsigned long) ((uintptr_t) onig_enc >> 4) * 31UL;
+    hash ^= (unsigned long) ((uintptr_t) syntax >> 4) * 131UL;
+    return hash;
+}
+
+static size_t ore_cache_ptr_bucket (const regex_t *regex)
+{
+    return (size_t) (((uintptr_t) regex >> 4) % CACHE_BUCKETS);
+}
+
+// Read the current capacity from the "ore.cacheSize" option; zero or less disables the cache
+int ore_cache_capacity (void)
+{
+    SEXP capacity = GetOption1(install("ore.cacheSize"));
+    if (isNull(capacity))
+        return CACHE_DEFAULT_CAPACITY;
+    
+    const int value = asInteger(capacity);
+    return (value == NA_INTEGER || value < 0) ? 0 : value;
+}
+
+int ore_cache_size (void)
+{
+    return n_entries;
+}
+
+static void ore_cache_unlink_lru (cache_entry_t *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    
+    entry->prev = entry->next = NULL;
+}
+
+static void ore_cache_push_lru (cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL)
+        lru_tail = entry;
+}
+
+static void ore_cache_unlink_key (cache_entry_t *entry)
+{
+    cache_entry_t **link = &key_buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != NULL && *link != entry)
+        link = &(*link)->key_next;
+    if (*link != NULL)
+        *link = entry->key_next;
+}
+
+static void ore_cache_unlink_ptr (cache_entry_t *entry)
+{
+    cache_entry_t **link = &ptr_buckets[ore_cache_ptr_bucket(entry->regex)];
+    while (*link != NULL && *link != entry)
+        link = &(*link)->ptr_next;
+    if (*link != NULL)
+        *link = entry->ptr_next;
+}
+
+static void ore_cache_free_entry (cache_entry_t *entry)
+{
+    ore_cache_unlink_ptr(entry);
+    onig_free(entry->regex);
+    free(entry->pattern);
+    free(entry);
+}
+
+// Remove an entry from the cache; if it is still in use, freeing is deferred until it is released
+static void ore_cache_evict (cache_entry_t *entry)
+{
+    ore_cache_unlink_lru(entry);
+    ore_cache_unlink_key(entry);
+    n_entries--;
+    
+    if (entry->refcount > 0)
+        entry->orphaned = TRUE;
+    else
+        ore_cache_free_entry(entry);
+}
+
+// Evict least recently used entries until the cache holds no more than the specified number
+static void ore_cache_trim (const int capacity)
+{
+    while (n_entries > capacity && lru_tail != NULL)
+    {
+        ore_cache_evict(lru_tail);
+        ore_counters.cache_evictions++;
+    }
+}
+
+// Find a compiled regex in the cache, or compile it and add it, subject to the cache capacity
+// Every regex obtained this way must be passed back to ore_cache_release() (via ore_free()) when finished with
+regex_t * ore_cache_retrieve (const char *pattern, const char *options, encoding_t *encoding, const char *syntax_name)
+{
+    const int capacity = ore_cache_capacity();
+    ore_cache_trim(capacity);
+    
+    if (capacity == 0)
+        return ore_compile(pattern, options, encoding, syntax_name);
+    
+    const size_t pattern_len = strlen(pattern);
+    const OnigOptionType onig_options = ore_parse_options(options);
+    OnigSyntaxType *syntax = ore_parse_syntax(syntax_name);
+    const unsigned long hash = ore_cache_hash(pattern, pattern_len, onig_options, encoding->onig_enc, syntax);
+    
+    cache_entry_t *entry = key_buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL)
+    {
+        if (entry->hash == hash && entry->pattern_len == pattern_len && entry->options == onig_options && entry->onig_enc == encoding->onig_enc && entry->syntax == syntax && memcmp(entry->pattern, pattern, pattern_len) == 0)
+            break;
+        entry = entry->key_next;
+    }
+    
+    if (entry != NULL)
+    {
+        ore_counters.cache_hits++;
+        ore_cache_unlink_lru(entry);
+        ore_cache_push_lru(entry);
+        entry->refcount++;
+        return entry->regex;
+    }
+    
+    // A miss: compile first, so that nothing is added if there's an error
+    ore_counters.cache_misses++;
+    regex_t *regex = ore_compile(pattern, options, encoding, syntax_name);
+    
+    entry = (cache_entry_t *) malloc(sizeof(cache_entry_t));
+    char *pattern_copy = (char *) malloc(pattern_len + 1);
+    if (entry == NULL || pattern_copy == NULL)
+    {
+        // Fall back to an uncached regex, which will be freed normally
+        free(entry);
+        free(pattern_copy);
+        return regex;
+    }
+    
+    memcpy(pattern_copy, pattern, pattern_len + 1);
+    entry->pattern = pattern_copy;
+    entry->pattern_len = pattern_len;
+    entry->options = onig_options;
+    entry->onig_enc = encoding->onig_enc;
+    entry->syntax = syntax;
+    entry->hash = hash;
+    entry->regex = regex;
+    entry->refcount = 1;
+    entry->orphaned = FALSE;
+    
+    const size_t key_bucket = hash % CACHE_BUCKETS;
+    entry->key_next = key_buckets[key_bucket];
+    key_buckets[key_bucket] = entry;
+    const size_t ptr_bucket = ore_cache_ptr_bucket(regex);
+    entry->ptr_next = ptr_buckets[ptr_bucket];
+    ptr_buckets[ptr_bucket] = entry;
+    ore_cache_push_lru(entry);
+    n_entries++;
+    
+    ore_cache_trim(capacity);
+    
+    return regex;
+}
+
+// Release a regex obtained from ore_cache_retrieve(); returns FALSE if the cache doesn't own the regex
+Rboolean ore_cache_release (regex_t *regex)
+{
+    cache_entry_t *entry = ptr_buckets[ore_cache_ptr_bucket(regex)];
+    while (entry != NULL && entry->regex != regex)
+        entry = entry->ptr_next;
+    
+    if (entry == NULL)
+        return FALSE;
+    
+    if (entry->refcount > 0)
+        entry->refcount--;
+    if (entry->orphaned && entry->refcount == 0)
+        ore_cache_free_entry(entry);
+    
+    return TRUE;
+}
+
+// Free all cached regexes; called when the package is unloaded
+void ore_cache_clear (void)
+{
+    while (lru_tail != NULL)
+        ore_cache_evict(lru_tail);
+    
+    // Anything still referenced at this point is orphaned, and can't be used again
+    for (int i=0; i<CACHE_BUCKETS; i++)
+    {
+        while (ptr_buckets[i] != NULL)
+            ore_cache_free_entry(ptr_buckets[i]);
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "onigmo.h"
+#include "text.h"
+
+regex_t * ore_cache_retrieve (const char *pattern, const char *options, encoding_t *encoding, const char *syntax_name);
+
+Rboolean ore_cache_release (regex_t *regex);
+
+void ore_cache_clear (void);
+
+int ore_cache_size (void);
+
+int ore_cache_capacity (void);
+
+#endif
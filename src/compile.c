@@ -6,6 +6,10 @@
 #include <Rinternals.h>
 
 #include "text.h"
+#include "cache.h"
+#include "serialise.h"
+#include "stats.h"
+#include "fixed.h"
 #include "compile.h"
 
 OnigSyntaxType *modified_ruby_syntax;
@@ -28,14 +32,9 @@ static int ore_store_name (const UChar *name, const UChar *name_end, int n_group
     return 0;
 }
 
-// Interface to onig_new(), used to create compiled regex objects
-regex_t * ore_compile (const char *pattern, const char *options, encoding_t *encoding, const char *syntax_name)
+// Parse an options string and convert to onig option flags
+OnigOptionType ore_parse_options (const char *options)
 {
-    int return_value;
-    OnigErrorInfo einfo;
-    regex_t *regex;
-    
-    // Parse options and convert to onig option flags
     OnigOptionType onig_options = ONIG_OPTION_NONE;
     char *option_pointer = (char *) options;
     while (*option_pointer)
@@ -49,12 +48,29 @@ regex_t * ore_compile (const char *pattern, const char *options, encoding_t *enc
             case 'i':
             onig_options |= ONIG_OPTION_IGNORECASE;
             break;
+            
+            case 'b':
+            onig_options |= ONIG_OPTION_MATCH_CACHE;
+            break;
         }
         
         option_pointer++;
     }
     
-    OnigSyntaxType *syntax;
+    return onig_options;
+}
+
+// Check whether backtracking should be bounded for every regex, via the "ore.memoise" option (which is FALSE if unset)
+Rboolean ore_memoise_enabled (void)
+{
+    SEXP memoise = GetOption1(install("ore.memoise"));
+    return (!isNull(memoise) && asLogical(memoise) == TRUE);
+}
+
+// Convert a syntax name to the corresponding onig syntax
+OnigSyntaxType * ore_parse_syntax (const char *syntax_name)
+{
+    OnigSyntaxType *syntax = NULL;
     if (strncmp(syntax_name, "ruby", 4) == 0)
         syntax = modified_ruby_syntax;
     else if (strncmp(syntax_name, "fixed", 5) == 0)
@@ -62,6 +78,24 @@ regex_t * ore_compile (const char *pattern, const char *options, encoding_t *enc
     else
         error("Syntax name \"%s\" is invalid\n", syntax_name);
     
+    return syntax;
+}
+
+// Interface to onig_new(), used to create compiled regex objects
+regex_t * ore_compile (const char *pattern, const char *options, encoding_t *encoding, const char *syntax_name)
+{
+    int return_value;
+    OnigErrorInfo einfo;
+    regex_t *regex;
+    
+    OnigOptionType onig_options = ore_parse_options(options);
+    if (ore_memoise_enabled())
+        onig_options |= ONIG_OPTION_MATCH_CACHE;
+    
+    // Onigmo also builds a DFA program for any regex simple enough to have one, which is used in place of backtracking where possible
+    onig_options |= ONIG_OPTION_DFA;
+    OnigSyntaxType *syntax = ore_parse_syntax(syntax_name);
+    
     // Create the regex struct, and check for errors
     return_value = onig_new(&regex, (UChar *) pattern, (UChar *) pattern+strlen(pattern), onig_options, encoding->onig_enc, syntax, &einfo);
     if (return_value != ONIG_NORMAL)
@@ -71,6 +105,54 @@ regex_t * ore_compile (const char *pattern, const char *options, encoding_t *enc
         error("Oniguruma compile: %s\n", message);
     }
     
+    // Literal patterns are also kept as they are, so that they can be searched for without Onigmo
+    ore_fixed_init(regex, pattern, strlen(pattern));
+    
+    return regex;
+}
+
+// Work out the encoding for a new regex from its name, which may be "auto" to use the encoding of the pattern string
+encoding_t * ore_build_encoding (const char *encoding_name, SEXP pattern_string)
+{
+    if (ore_strnicmp(encoding_name, "auto", 4) == 0)
+    {
+        cetype_t r_enc = getCharCE(pattern_string);
+        return ore_encoding(NULL, NULL, &r_enc);
+    }
+    else
+        return ore_encoding(encoding_name, NULL, NULL);
+}
+
+// Obtain an attribute of an "ore" object as a C string, or the specified default if it's missing
+static const char * ore_string_attrib (SEXP regex_, const char *name, const char *default_value)
+{
+    SEXP value = getAttrib(regex_, install(name));
+    if (isString(value) && length(value) > 0 && STRING_ELT(value,0) != NA_STRING)
+        return CHAR(STRING_ELT(value, 0));
+    else
+        return default_value;
+}
+
+// Restore the compiled version of an "ore" object whose pointer has been lost, usually because the object has been serialised
+// The stored program is used if this process created it; otherwise the pattern is recompiled with its original options, syntax and encoding
+// Either way the result is kept in the object's pointer, so this only happens once per object
+static regex_t * ore_restore (SEXP regex_, SEXP regex_ptr)
+{
+    if (TYPEOF(regex_ptr) != EXTPTRSXP || !isString(regex_) || length(regex_) == 0)
+        return NULL;
+    
+    regex_t *regex = ore_unserialise(getAttrib(regex_, install(".program")));
+    if (regex != NULL)
+        ore_counters.programs_restored++;
+    else
+    {
+        encoding_t *encoding = ore_build_encoding(ore_string_attrib(regex_, "encoding", "auto"), STRING_ELT(regex_,0));
+        regex = ore_compile(CHAR(STRING_ELT(regex_,0)), ore_string_attrib(regex_, "options", ""), encoding, ore_string_attrib(regex_, "syntax", "ruby"));
+        ore_counters.programs_recompiled++;
+    }
+    
+    R_SetExternalPtrAddr(regex_ptr, regex);
+    R_RegisterCFinalizerEx(regex_ptr, &ore_regex_finaliser, FALSE);
     return regex;
 }
 
@@ -79,9 +161,14 @@ regex_t * ore_retrieve (SEXP regex_, encoding_t *encoding)
 {
     regex_t *regex = NULL;
     
-    // Check the class of the regex object; if it's "ore", look for a valid pointer
+    // Check the class of the regex object; if it's "ore", look for a valid pointer, restoring it if necessary
     if (inherits(regex_, "ore"))
-        regex = (regex_t *) R_ExternalPtrAddr(getAttrib(regex_, install(".compiled")));
+    {
+        SEXP regex_ptr = getAttrib(regex_, install(".compiled"));
+        regex = (regex_t *) R_ExternalPtrAddr(regex_ptr);
+        if (regex == NULL)
+            regex = ore_restore(regex_, regex_ptr);
+    }
     
     if (regex == NULL)
     {
@@ -90,24 +177,80 @@ regex_t * ore_retrieve (SEXP regex_, encoding_t *encoding)
         else if (length(regex_) > 1)
             warning("Only the first element of the specified regex vector will be used");
         
-        // Compile the regex and return
-        regex = ore_compile(CHAR(STRING_ELT(regex_,0)), "", encoding, "ruby");
+        // Compile the regex, or reuse a cached copy, and return
+        // Copies compiled with bounded backtracking are cached separately, in case the option changes
+        regex = ore_cache_retrieve(CHAR(STRING_ELT(regex_,0)), ore_memoise_enabled() ? "b" : "", encoding, "ruby");
     }
     
     return regex;
 }
 
+// Check whether a regex retrieved from the specified source belongs to the "ore" object's external pointer, and so must not be freed after use
+Rboolean ore_source_owns_regex (SEXP source)
+{
+    return (source != NULL && inherits(source, "ore") && R_ExternalPtrAddr(getAttrib(source, install(".compiled"))) != NULL);
+}
+
 // Free the specified regex object, unless it was retrieved from an external pointer that owns the memory
+// Regexes owned by the cache are released back to it rather than being freed
 void ore_free (regex_t *regex, SEXP source)
 {
     if (regex == NULL)
         return;
-    else if (source == NULL || !inherits(source, "ore"))
-        onig_free(regex);
-    else if (R_ExternalPtrAddr(getAttrib(source, install(".compiled"))) == NULL)
+    else if (ore_source_owns_regex(source))
+        return;
+    else if (!ore_cache_release(regex))
         onig_free(regex);
 }
 
+// Copy the elements of a character vector, without its attributes
+static SEXP ore_copy_strings (SEXP strings_)
+{
+    const int n = length(strings_);
+    SEXP copy = PROTECT(NEW_CHARACTER(n));
+    for (int i=0; i<n; i++)
+        SET_STRING_ELT(copy, i, STRING_ELT(strings_, i));
+    UNPROTECT(1);
+    return copy;
+}
+
+// Keep copies of the elements and names that a set was compiled from, as the protected value of its pointer
+void ore_keep_source (SEXP set_ptr, SEXP source_)
+{
+    SEXP names = getAttrib(source_, R_NamesSymbol);
+    SEXP kept = PROTECT(NEW_LIST(2));
+    SET_VECTOR_ELT(kept, 0, ore_copy_strings(source_));
+    SET_VECTOR_ELT(kept, 1, isNull(names) ? R_NilValue : ore_copy_strings(names));
+    R_SetExternalPtrProtected(set_ptr, kept);
+    UNPROTECT(1);
+}
+
+// Check whether the elements or names of a set have been changed since it was compiled, which the class and pointer survive
+// Strings are cached by R, so identical strings are the same object and can be compared by address
+Rboolean ore_source_changed (SEXP set_ptr, SEXP source_)
+{
+    SEXP kept = R_ExternalPtrProtected(set_ptr);
+    if (TYPEOF(kept) != VECSXP || length(kept) != 2)
+        return TRUE;
+    
+    SEXP elements = VECTOR_ELT(kept, 0);
+    SEXP kept_names = VECTOR_ELT(kept, 1);
+    SEXP names = getAttrib(source_, R_NamesSymbol);
+    const int n = length(source_);
+    if (length(elements) != n || isNull(names) != isNull(kept_names) || (!isNull(names) && length(names) != n))
+        return TRUE;
+    
+    for (int i=0; i<n; i++)
+    {
+        if (STRING_ELT(elements, i) != STRING_ELT(source_, i))
+            return TRUE;
+        else if (!isNull(names) && STRING_ELT(kept_names, i) != STRING_ELT(names, i))
+            return TRUE;
+    }
+    
+    return FALSE;
+}
+
 // Create a pattern string by concatenating the elements of the supplied vector, parenthesising named elements
 static char * ore_build_pattern (SEXP pattern_)
 {
@@ -179,14 +322,7 @@ SEXP ore_build (SEXP pattern_, SEXP options_, SEXP encoding_name_, SEXP syntax_n
     const char *encoding_name = CHAR(STRING_ELT(encoding_name_, 0));
     const char *syntax_name = CHAR(STRING_ELT(syntax_name_, 0));
     
-    encoding_t *encoding;
-    if (ore_strnicmp(encoding_name, "auto", 4) == 0)
-    {
-        cetype_t r_enc = getCharCE(STRING_ELT(pattern_, 0));
-        encoding = ore_encoding(NULL, NULL, &r_enc);
-    }
-    else
-        encoding = ore_encoding(encoding_name, NULL, NULL);
+    encoding_t *encoding = ore_build_encoding(encoding_name, STRING_ELT(pattern_, 0));
     
     // Compile the regex
     regex_t *regex = ore_compile(pattern, options, encoding, syntax_name);
@@ -201,6 +337,9 @@ SEXP ore_build (SEXP pattern_, SEXP options_, SEXP encoding_name_, SEXP syntax_n
     R_RegisterCFinalizerEx(regex_ptr, &ore_regex_finaliser, FALSE);
     setAttrib(result, install(".compiled"), regex_ptr);
     
+    // Keep a serialised copy of the compiled program too, since the pointer won't survive if the object is saved or sent to another process
+    setAttrib(result, install(".program"), ore_serialise(regex));
+    
     setAttrib(result, install("options"), PROTECT(ScalarString(STRING_ELT(options_, 0))));
     setAttrib(result, install("syntax"), PROTECT(ScalarString(STRING_ELT(syntax_name_, 0))));
     setAttrib(result, install("encoding"), PROTECT(ScalarString(STRING_ELT(encoding_name_, 0))));
@@ -215,6 +354,23 @@ SEXP ore_build (SEXP pattern_, SEXP options_, SEXP encoding_name_, SEXP syntax_n
         UNPROTECT(1);
     }
     
+    // Literals that every match must contain, which are used to rule out text quickly
+    int n_literals = 0;
+    const UChar *literal, *literal_end;
+    while (onig_get_required_literal(regex, n_literals, &literal, &literal_end))
+        n_literals++;
+    if (n_literals > 0)
+    {
+        SEXP literals = PROTECT(NEW_CHARACTER(n_literals));
+        for (int i=0; i<n_literals; i++)
+        {
+            onig_get_required_literal(regex, i, &literal, &literal_end);
+            SET_STRING_ELT(literals, i, ore_fragment_to_rchar((const char *) literal, (size_t) (literal_end - literal), encoding));
+        }
+        setAttrib(result, install("literals"), literals);
+        UNPROTECT(1);
+    }
+    
     setAttrib(result, R_ClassSymbol, mkString("ore"));
     
     UNPROTECT(6);
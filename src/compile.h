@@ -4,12 +4,26 @@
 #include "onigmo.h"
 #include "text.h"
 
+OnigOptionType ore_parse_options (const char *options);
+
+Rboolean ore_memoise_enabled (void);
+
+OnigSyntaxType * ore_parse_syntax (const char *syntax_name);
+
 regex_t * ore_compile (const char *pattern, const char *options, encoding_t *encoding, const char *syntax_name);
 
+encoding_t * ore_build_encoding (const char *encoding_name, SEXP pattern_string);
+
 regex_t * ore_retrieve (SEXP regex_, encoding_t *encoding);
 
+Rboolean ore_source_owns_regex (SEXP source);
+
 void ore_free (regex_t *regex, SEXP source);
 
+void ore_keep_source (SEXP set_ptr, SEXP source_);
+
+Rboolean ore_source_changed (SEXP set_ptr, SEXP source_);
+
 Rboolean ore_group_name_vector (SEXP vec, regex_t *regex);
 
 SEXP ore_build (SEXP pattern_, SEXP options_, SEXP encoding_name_, SEXP syntax_name_);
@@ -0,0 +1,310 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include "stats.h"
+#include "fixed.h"
+
+// Needles shorter than this are found by filtering on their first and last bytes; longer ones use the two-way algorithm
+#define FIXED_TWOWAY_MIN_LEN    16
+
+#define FIXED_MAX(a,b)          ((a) > (b) ? (a) : (b))
+
+// ASCII case folding, applied to the text when matching case-insensitively (the needle is folded already)
+#define FIXED_FOLD(c,fold)      ((fold) && (c) >= 'A' && (c) <= 'Z' ? (UChar) ((c) | 0x20) : (c))
+
+// Keep a copy of a literal pattern, if it can be searched for bytewise with the same results as Onigmo
+// A match can only be trusted to fall on character boundaries if the encoding is single-byte or UTF-8, and Onigmo's case-insensitive matching only agrees with ASCII case folding when the pattern and text are both ASCII
+void ore_fixed_init (regex_t *regex, const char *pattern, const size_t pattern_len)
+{
+    if (regex->syntax != ONIG_SYNTAX_ASIS || pattern_len == 0)
+        return;
+    else if (regex->enc->max_enc_len != 1 && regex->enc != ONIG_ENCODING_UTF8)
+        return;
+    
+    // Non-ASCII literals can match ASCII text case-insensitively (e.g. a German sharp s matches "ss"), so they're left to Onigmo
+    const Rboolean fold = (ONIG_IS_OPTION_ON(regex->options, ONIG_OPTION_IGNORECASE) != 0);
+    if (fold)
+    {
+        for (size_t i=0; i<pattern_len; i++)
+        {
+            if ((UChar) pattern[i] > 0x7f)
+                return;
+        }
+    }
+    
+    UChar *fixed = (UChar *) malloc(pattern_len);
+    if (fixed == NULL)
+        return;
+    
+    for (size_t i=0; i<pattern_len; i++)
+        fixed[i] = FIXED_FOLD((UChar) pattern[i], fold);
+    
+    regex->fixed = fixed;
+    regex->fixed_end = fixed + pattern_len;
+}
+
+// Find a short needle by looking for its first byte, then checking the last byte before comparing the rest
+static const UChar * ore_fixed_filter (const UChar *text, const UChar *end, const UChar *needle, const size_t len, const Rboolean fold)
+{
+    const UChar *last = end - len;
+    const UChar first_byte = needle[0], last_byte = needle[len-1];
+    
+    if (!fold)
+    {
+        // memchr() is usually vectorised, so this skips quickly through text without the first byte
+        for (const UChar *ptr = text; ptr <= last; ptr++)
+        {
+            ptr = (const UChar *) memchr(ptr, first_byte, (size_t) (last - ptr) + 1);
+            if (ptr == NULL)
+                return NULL;
+            else if (ptr[len-1] == last_byte && memcmp(ptr + 1, needle + 1, len - 1) == 0)
+                return ptr;
+        }
+    }
+    else
+    {
+        for (const UChar *ptr = text; ptr <= last; ptr++)
+        {
+            if (FIXED_FOLD(ptr[0],TRUE) != first_byte || FIXED_FOLD(ptr[len-1],TRUE) != last_byte)
+                continue;
+            
+            size_t i = 1;
+            while (i < len - 1 && FIXED_FOLD(ptr[i],TRUE) == needle[i])
+                i++;
+            if (i >= len - 1)
+                return ptr;
+        }
+    }
+    
+    return NULL;
+}
+
+// Find a long needle with the two-way algorithm of Crochemore and Perrin, which needs no preprocessing beyond the needle itself and never backtracks in the text
+// The last byte of each window is checked against a shift table first, as in Boyer-Moore-Horspool, so most text is skipped over
+// This is adapted from twoway_strstr() in musl's strstr.c, which is Copyright (c) 2005-2020 Rich Felker, et al., and distributed under the MIT licence; see inst/COPYRIGHTS
+static const UChar * ore_fixed_twoway (const UChar *text, const UChar *end, const UChar *needle, const size_t len, const Rboolean fold)
+{
+    size_t ip, jp, k, p, ms, p0, mem, mem0;
+    size_t byteset[32 / sizeof(size_t)] = { 0 };
+    size_t shift[256];
+    
+    // Record which bytes appear in the needle, and how far from the end each last appears
+    for (size_t i=0; i<len; i++)
+    {
+        byteset[needle[i] / (8 * sizeof(size_t))] |= (size_t) 1 << (needle[i] % (8 * sizeof(size_t)));
+        shift[needle[i]] = i + 1;
+    }
+    
+    // Find the maximal suffix of the needle, and its period, under each ordering of the alphabet
+    ip = (size_t) -1; jp = 0; k = p = 1;
+    while (jp + k < len)
+    {
+        if (needle[ip+k] == needle[jp+k])
+        {
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+                k++;
+        }
+        else if (needle[ip+k] > needle[jp+k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    ms = ip;
+    p0 = p;
+    
+    ip = (size_t) -1; jp = 0; k = p = 1;
+    while (jp + k < len)
+    {
+        if (needle[ip+k] == needle[jp+k])
+        {
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+                k++;
+        }
+        else if (needle[ip+k] < needle[jp+k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    if (ip + 1 > ms + 1)
+        ms = ip;
+    else
+        p = p0;
+    
+    // If the needle is periodic, a partial match of the left half can be remembered after a shift by the period
+    if (memcmp(needle, needle + p, ms + 1) != 0)
+    {
+        mem0 = 0;
+        p = FIXED_MAX(ms, len - ms - 1) + 1;
+    }
+    else
+        mem0 = len - p;
+    mem = 0;
+    
+    const UChar *ptr = text;
+    while ((size_t) (end - ptr) >= len)
+    {
+        const UChar last_byte = FIXED_FOLD(ptr[len-1], fold);
+        if (byteset[last_byte / (8 * sizeof(size_t))] & ((size_t) 1 << (last_byte % (8 * sizeof(size_t)))))
+        {
+            k = len - shift[last_byte];
+            if (k > 0)
+            {
+                ptr += FIXED_MAX(k, mem);
+                mem = 0;
+                continue;
+            }
+        }
+        else
+        {
+            ptr += len;
+            mem = 0;
+            continue;
+        }
+        
+        // Compare the right half, then the left half
+        for (k = FIXED_MAX(ms + 1, mem); k < len && needle[k] == FIXED_FOLD(ptr[k], fold); k++);
+        if (k < len)
+        {
+            ptr += k - ms;
+            mem = 0;
+            continue;
+        }
+        
+        for (k = ms + 1; k > mem && needle[k-1] == FIXED_FOLD(ptr[k-1], fold); k--);
+        if (k <= mem)
+            return ptr;
+        
+        ptr += p;
+        mem = mem0;
+    }
+    
+    return NULL;
+}
+
+// Search for a single match, using the regex's literal directly if possible, then its DFA, and Onigmo's backtracking matcher otherwise
+// Searches for regexes anchored to the end of the text or of a line start as near to that end as the regex allows
+// Literals are never empty, so there is no need to handle zero-length matches here
+// Onigmo uses the stack and DFA cache in the scratch space for backtracking, and leaves them for the next search
+// This function does not use the R API, so it is safe to call from worker threads
+OnigPosition ore_search_once (regex_t *regex, const UChar *text, const UChar *end_ptr, const UChar *start_ptr, OnigRegion *region, scratch_t *scratch, const Rboolean ascii)
+{
+    const Rboolean fold = (ONIG_IS_OPTION_ON(regex->options, ONIG_OPTION_IGNORECASE) != 0);
+    if (regex->fixed == NULL || (fold && !ascii))
+    {
+        OnigPosition result;
+        
+        // A regex anchored to the end of the text matches there or not at all, so its DFA can read backwards from the end, and stop as soon as no match can start any earlier
+        if (regex->dfa != NULL)
+        {
+            result = onig_dfa_search_backward(regex, text, end_ptr, start_ptr, region, scratch->dfa, scratch->stack);
+            if (result != ONIG_NO_SUPPORT_CONFIG)
+            {
+                ore_reverse_searched();
+                return result;
+            }
+        }
+        
+        // Otherwise, if matches are anchored to the end of the text or a line and bounded in length, there's no need to try any earlier than that length before the first such end
+        // The original start is still where \G matches, so the search may begin later without changing its results
+        const UChar *search_ptr = onig_search_end_start(regex, text, end_ptr, start_ptr);
+        if (search_ptr != start_ptr)
+        {
+            ore_end_anchor_skipped();
+            if (search_ptr == NULL)
+                return ONIG_MISMATCH;
+        }
+        
+        // The DFA gives up on text that isn't valid in the encoding, among other things, and then the search is repeated with backtracking
+        if (regex->dfa != NULL)
+        {
+            if (region == NULL)
+                result = onig_dfa_test(regex, text, end_ptr, search_ptr, scratch->dfa);
+            else
+                result = onig_dfa_search(regex, text, end_ptr, search_ptr, end_ptr, region, ONIG_OPTION_NONE, scratch->dfa, scratch->stack);
+            ore_dfa_searched(result == ONIG_NO_SUPPORT_CONFIG);
+            if (result != ONIG_NO_SUPPORT_CONFIG)
+                return result;
+        }
+        return onig_search_gpos_with_stack(regex, text, end_ptr, start_ptr, search_ptr, end_ptr, region, ONIG_OPTION_NONE, scratch->stack);
+    }
+    
+    const size_t len = (size_t) (regex->fixed_end - regex->fixed);
+    const UChar *match = NULL;
+    if ((size_t) (end_ptr - start_ptr) < len)
+        match = NULL;
+    else if (len < FIXED_TWOWAY_MIN_LEN)
+        match = ore_fixed_filter(start_ptr, end_ptr, regex->fixed, len, fold);
+    else
+        match = ore_fixed_twoway(start_ptr, end_ptr, regex->fixed, len, fold);
+    
+    if (match == NULL)
+        return ONIG_MISMATCH;
+    
+    if (region != NULL)
+    {
+        if (onig_region_resize(region, 1) != ONIG_NORMAL)
+            return ONIGERR_MEMORY;
+        region->beg[0] = match - text;
+        region->end[0] = match - text + (OnigPosition) len;
+    }
+    
+    return match - text;
+}
+
+// Check that the text contains every literal that a match must contain, so that searches which can't succeed are skipped without invoking Onigmo
+// Literal patterns are found as quickly by searching for them directly, so they aren't checked twice
+// This function does not use the R API, so it is safe to call from worker threads
+Rboolean ore_required_present (regex_t *regex, const UChar *start_ptr, const UChar *end_ptr)
+{
+    const UChar *literal, *literal_end;
+    if (regex->fixed != NULL && !ONIG_IS_OPTION_ON(regex->options, ONIG_OPTION_IGNORECASE))
+        return TRUE;
+    
+    // Literals are stored longest first, so the most selective are checked first
+    for (int i=0; onig_get_required_literal(regex, i, &literal, &literal_end); i++)
+    {
+        const size_t len = (size_t) (literal_end - literal);
+        const UChar *match = NULL;
+        if ((size_t) (end_ptr - start_ptr) < len)
+            match = NULL;
+        else if (len < FIXED_TWOWAY_MIN_LEN)
+            match = ore_fixed_filter(start_ptr, end_ptr, literal, len, FALSE);
+        else
+            match = ore_fixed_twoway(start_ptr, end_ptr, literal, len, FALSE);
+        
+        if (match == NULL)
+        {
+            ore_prefilter_skipped();
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
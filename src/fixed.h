@@ -0,0 +1,14 @@
+#ifndef _FIXED_H_
+#define _FIXED_H_
+
+#include <R.h>
+#include "onigmo.h"
+#include "scratch.h"
+
+void ore_fixed_init (regex_t *regex, const char *pattern, const size_t pattern_len);
+
+OnigPosition ore_search_once (regex_t *regex, const UChar *text, const UChar *end_ptr, const UChar *start_ptr, OnigRegion *region, scratch_t *scratch, const Rboolean ascii);
+
+Rboolean ore_required_present (regex_t *regex, const UChar *start_ptr, const UChar *end_ptr);
+
+#endif
@@ -0,0 +1,299 @@
+#include <string.h>
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#include "match.h"
+#include "lazy.h"
+
+// Check whether lazy match data is requested, via the "ore.lazy" option (which is TRUE if unset)
+Rboolean ore_lazy_enabled (void)
+{
+#ifdef ORE_HAVE_ALTREP
+    SEXP lazy = GetOption1(install("ore.lazy"));
+    return (isNull(lazy) || asLogical(lazy) == TRUE);
+#else
+    return FALSE;
+#endif
+}
+
+#ifdef ORE_HAVE_ALTREP
+
+#include <R_ext/Altrep.h>
+
+// Match data shared by the lazy vectors of one "orematch" object; the text belongs to the source string, which is kept alive by the external pointer
+typedef struct {
+    rawmatch_t    * match;
+    const char    * text;
+    cetype_t        r_enc;
+} lazystore_t;
+
+static R_altrep_class_t lazy_int_class;
+static R_altrep_class_t lazy_char_class;
+
+// Each lazy vector's first data slot is a list containing the store and an integer specification: the field, the increment and whether or not it is a matrix of groups
+// The second data slot holds the complete vector, once it has been needed
+#define LAZY_FIELD      0
+#define LAZY_INCREMENT  1
+#define LAZY_MATRIX     2
+
+// Finaliser to free the match data when no lazy vector refers to it any more
+static void ore_lazy_store_finaliser (SEXP store_ptr)
+{
+    lazystore_t *store = (lazystore_t *) R_ExternalPtrAddr(store_ptr);
+    if (store != NULL)
+    {
+        ore_rawmatch_free(store->match);
+        free(store);
+    }
+    R_ClearExternalPtr(store_ptr);
+}
+
+static const lazystore_t * ore_lazy_get_store (SEXP x)
+{
+    const lazystore_t *store = (const lazystore_t *) R_ExternalPtrAddr(VECTOR_ELT(R_altrep_data1(x), 0));
+    if (store == NULL)
+        error("Match data is no longer available");
+    return store;
+}
+
+static const int * ore_lazy_get_spec (SEXP x)
+{
+    return INTEGER(VECTOR_ELT(R_altrep_data1(x), 1));
+}
+
+// Find the location within the match data of an element of a lazy vector; matrices are in column-major order, and exclude the full match
+static size_t ore_lazy_loc (const rawmatch_t *match, const int matrix, const R_xlen_t i)
+{
+    if (matrix)
+        return (size_t) (i % match->n_matches) * match->n_regions + (i / match->n_matches) + 1;
+    else
+        return (size_t) i * match->n_regions;
+}
+
+static R_xlen_t ore_lazy_length (SEXP x)
+{
+    const lazystore_t *store = ore_lazy_get_store(x);
+    if (ore_lazy_get_spec(x)[LAZY_MATRIX])
+        return (R_xlen_t) store->match->n_matches * (store->match->n_regions - 1);
+    else
+        return (R_xlen_t) store->match->n_matches;
+}
+
+static int ore_lazy_int_elt (SEXP x, R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+    if (data != R_NilValue)
+        return INTEGER(data)[i];
+    
+    const lazystore_t *store = ore_lazy_get_store(x);
+    const int *spec = ore_lazy_get_spec(x);
+    const size_t loc = ore_lazy_loc(store->match, spec[LAZY_MATRIX], i);
+    
+    switch (spec[LAZY_FIELD])
+    {
+        case OFFSETS_FIELD:         return store->match->offsets[loc] + spec[LAZY_INCREMENT];
+        case BYTE_OFFSETS_FIELD:    return store->match->byte_offsets[loc] + spec[LAZY_INCREMENT];
+        case LENGTHS_FIELD:         return store->match->lengths[loc] + spec[LAZY_INCREMENT];
+        default:                    return store->match->byte_lengths[loc] + spec[LAZY_INCREMENT];
+    }
+}
+
+// Create the full vector when a pointer to its data is needed, and keep it
+static void * ore_lazy_int_dataptr (SEXP x, Rboolean writeable)
+{
+    SEXP data = R_altrep_data2(x);
+    if (data == R_NilValue)
+    {
+        const R_xlen_t len = ore_lazy_length(x);
+        PROTECT(data = allocVector(INTSXP, len));
+        int *ptr = INTEGER(data);
+        for (R_xlen_t i=0; i<len; i++)
+            ptr[i] = ore_lazy_int_elt(x, i);
+        R_set_altrep_data2(x, data);
+        UNPROTECT(1);
+    }
+    
+    return INTEGER(data);
+}
+
+static const void * ore_lazy_int_dataptr_or_null (SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+    return (data == R_NilValue ? NULL : INTEGER(data));
+}
+
+static SEXP ore_lazy_char_elt (SEXP x, R_xlen_t i)
+{
+    SEXP data = R_altrep_data2(x);
+    if (data != R_NilValue)
+        return STRING_ELT(data, i);
+    
+    const lazystore_t *store = ore_lazy_get_store(x);
+    const int matrix = ore_lazy_get_spec(x)[LAZY_MATRIX];
+    const size_t loc = ore_lazy_loc(store->match, matrix, i);
+    const int length = store->match->byte_lengths[loc];
+    
+    // Missing groups (which must be optional) are NA
+    if (matrix && length == 0)
+        return NA_STRING;
+    else
+        return mkCharLenCE(store->text + store->match->byte_offsets[loc], length, store->r_enc);
+}
+
+static void * ore_lazy_char_dataptr (SEXP x, Rboolean writeable)
+{
+    SEXP data = R_altrep_data2(x);
+    if (data == R_NilValue)
+    {
+        const R_xlen_t len = ore_lazy_length(x);
+        PROTECT(data = allocVector(STRSXP, len));
+        for (R_xlen_t i=0; i<len; i++)
+            SET_STRING_ELT(data, i, ore_lazy_char_elt(x, i));
+        R_set_altrep_data2(x, data);
+        UNPROTECT(1);
+    }
+    
+    return (void *) STRING_PTR_RO(data);
+}
+
+static const void * ore_lazy_char_dataptr_or_null (SEXP x)
+{
+    SEXP data = R_altrep_data2(x);
+    return (data == R_NilValue ? NULL : (const void *) STRING_PTR_RO(data));
+}
+
+static void ore_lazy_char_set_elt (SEXP x, R_xlen_t i, SEXP value)
+{
+    ore_lazy_char_dataptr(x, TRUE);
+    SET_STRING_ELT(R_altrep_data2(x), i, value);
+}
+
+// Register the ALTREP classes; called when the package is loaded
+void ore_lazy_init (DllInfo *info)
+{
+    lazy_int_class = R_make_altinteger_class("ore_lazy_int", "ore", info);
+    R_set_altrep_Length_method(lazy_int_class, ore_lazy_length);
+    R_set_altvec_Dataptr_method(lazy_int_class, ore_lazy_int_dataptr);
+    R_set_altvec_Dataptr_or_null_method(lazy_int_class, ore_lazy_int_dataptr_or_null);
+    R_set_altinteger_Elt_method(lazy_int_class, ore_lazy_int_elt);
+    
+    lazy_char_class = R_make_altstring_class("ore_lazy_char", "ore", info);
+    R_set_altrep_Length_method(lazy_char_class, ore_lazy_length);
+    R_set_altvec_Dataptr_method(lazy_char_class, ore_lazy_char_dataptr);
+    R_set_altvec_Dataptr_or_null_method(lazy_char_class, ore_lazy_char_dataptr_or_null);
+    R_set_altstring_Elt_method(lazy_char_class, ore_lazy_char_elt);
+    R_set_altstring_Set_elt_method(lazy_char_class, ore_lazy_char_set_elt);
+}
+
+// Wrap match data and the source string it came from in an external pointer, which takes ownership of the match data once this function returns
+// If it fails with an error, the match data still belongs to the caller
+SEXP ore_lazy_store (rawmatch_t *match, SEXP source)
+{
+    SEXP store_ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, source));
+    R_RegisterCFinalizerEx(store_ptr, &ore_lazy_store_finaliser, FALSE);
+    lazystore_t *store = (lazystore_t *) malloc(sizeof(lazystore_t));
+    if (store == NULL)
+        error("Cannot allocate memory for match data");
+    
+    store->match = match;
+    store->text = CHAR(source);
+    store->r_enc = getCharCE(source);
+    
+    R_SetExternalPtrAddr(store_ptr, store);
+    
+    UNPROTECT(1);
+    return store_ptr;
+}
+
+static SEXP ore_lazy_vector (R_altrep_class_t class, SEXP store, const int field, const int increment, const Rboolean matrix, const SEXP col_names)
+{
+    SEXP data1 = PROTECT(NEW_LIST(2));
+    SEXP spec = PROTECT(NEW_INTEGER(3));
+    INTEGER(spec)[LAZY_FIELD] = field;
+    INTEGER(spec)[LAZY_INCREMENT] = increment;
+    INTEGER(spec)[LAZY_MATRIX] = matrix;
+    SET_VECTOR_ELT(data1, 0, store);
+    SET_VECTOR_ELT(data1, 1, spec);
+    
+    SEXP result = PROTECT(R_new_altrep(class, data1, R_NilValue));
+    
+    // Set dimensions and column names for group matrices
+    if (matrix)
+    {
+        const rawmatch_t *match = ((const lazystore_t *) R_ExternalPtrAddr(store))->match;
+        SEXP dims = PROTECT(NEW_INTEGER(2));
+        INTEGER(dims)[0] = match->n_matches;
+        INTEGER(dims)[1] = match->n_regions - 1;
+        setAttrib(result, R_DimSymbol, dims);
+        UNPROTECT(1);
+        
+        if (!isNull(col_names))
+        {
+            SEXP my_col_names, dim_names;
+            PROTECT(my_col_names = duplicate(col_names));
+            PROTECT(dim_names = NEW_LIST(2));
+            SET_VECTOR_ELT(dim_names, 0, R_NilValue);
+            SET_VECTOR_ELT(dim_names, 1, my_col_names);
+            setAttrib(result, R_DimNamesSymbol, dim_names);
+            UNPROTECT(2);
+        }
+    }
+    
+    UNPROTECT(3);
+    return result;
+}
+
+SEXP ore_lazy_int_vector (SEXP store, const field_t field, const int increment)
+{
+    return ore_lazy_vector(lazy_int_class, store, field, increment, FALSE, R_NilValue);
+}
+
+SEXP ore_lazy_int_matrix (SEXP store, const field_t field, const int increment, const SEXP col_names)
+{
+    return ore_lazy_vector(lazy_int_class, store, field, increment, TRUE, col_names);
+}
+
+SEXP ore_lazy_char_vector (SEXP store)
+{
+    return ore_lazy_vector(lazy_char_class, store, 0, 0, FALSE, R_NilValue);
+}
+
+SEXP ore_lazy_char_matrix (SEXP store, const SEXP col_names)
+{
+    return ore_lazy_vector(lazy_char_class, store, 0, 0, TRUE, col_names);
+}
+
+#else
+
+// Without ALTREP support, ore_lazy_enabled() is always FALSE and the other functions are never called
+void ore_lazy_init (DllInfo *info) {}
+
+SEXP ore_lazy_store (rawmatch_t *match, SEXP source)
+{
+    error("Lazy match data is not supported by this version of R");
+}
+
+SEXP ore_lazy_int_vector (SEXP store, const field_t field, const int increment)
+{
+    error("Lazy match data is not supported by this version of R");
+}
+
+SEXP ore_lazy_int_matrix (SEXP store, const field_t field, const int increment, const SEXP col_names)
+{
+    error("Lazy match data is not supported by this version of R");
+}
+
+SEXP ore_lazy_char_vector (SEXP store)
+{
+    error("Lazy match data is not supported by this version of R");
+}
+
+SEXP ore_lazy_char_matrix (SEXP store, const SEXP col_names)
+{
+    error("Lazy match data is not supported by this version of R");
+}
+
+#endif
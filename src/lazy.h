@@ -0,0 +1,35 @@
+#ifndef _LAZY_H_
+#define _LAZY_H_
+
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+
+#include "match.h"
+
+// ALTREP classes are only available from R 3.6.0
+#if defined(R_VERSION) && R_VERSION >= R_Version(3,6,0)
+#define ORE_HAVE_ALTREP
+#endif
+
+typedef enum {
+    OFFSETS_FIELD,
+    BYTE_OFFSETS_FIELD,
+    LENGTHS_FIELD,
+    BYTE_LENGTHS_FIELD
+} field_t;
+
+void ore_lazy_init (DllInfo *info);
+
+Rboolean ore_lazy_enabled (void);
+
+SEXP ore_lazy_store (rawmatch_t *match, SEXP source);
+
+SEXP ore_lazy_int_vector (SEXP store, const field_t field, const int increment);
+
+SEXP ore_lazy_int_matrix (SEXP store, const field_t field, const int increment, const SEXP col_names);
+
+SEXP ore_lazy_char_vector (SEXP store);
+
+SEXP ore_lazy_char_matrix (SEXP store, const SEXP col_names);
+
+#endif
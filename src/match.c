@@ -1,4 +1,5 @@
 #include <string.h>
+#include <limits.h>
 
 #include <R.h>
 #include <Rdefines.h>
@@ -7,184 +8,500 @@
 #include "compile.h"
 #include "text.h"
 #include "match.h"
+#include "fixed.h"
+#include "stats.h"
+#include "lazy.h"
+#include "scratch.h"
 
 // Not strictly part of the API, but needed for implementing the "start" argument
 extern UChar * onigenc_step (OnigEncoding enc, const UChar *p, const UChar *end, int n);
 
-// Block size for match data; memory is allocated in chunks this big
-#define MATCH_BLOCK_SIZE    128
+// Initial capacity for match data when searching for all matches; buffers double in size when they fill up
+#define MATCH_INITIAL_CAPACITY  16
 
-// Allocate memory for a rawmatch_t object with capacity one block, and its contents
-rawmatch_t * ore_rawmatch_alloc (const int n_regions)
+// Number of text elements handed to a thread at a time during parallel search
+#define PARALLEL_CHUNK_SIZE     64
+
+// Bytes of storage needed per region of each match
+#define MATCH_REGION_SIZE       (4 * sizeof(int))
+
+// Number of text elements searched between checks for a user interrupt
+#define INTERRUPT_INTERVAL      1024
+
+// Change the capacity of a rawmatch_t object, reallocating its contents; returns FALSE if memory could not be allocated, in which case the existing contents are untouched
+static Rboolean ore_rawmatch_resize (rawmatch_t *match, const int capacity)
+{
+    const size_t len = (size_t) capacity * match->n_regions;
+    
+    int *offsets = (int *) realloc(match->offsets, len * sizeof(int));
+    if (offsets == NULL)
+        return FALSE;
+    match->offsets = offsets;
+    
+    int *byte_offsets = (int *) realloc(match->byte_offsets, len * sizeof(int));
+    if (byte_offsets == NULL)
+        return FALSE;
+    match->byte_offsets = byte_offsets;
+    
+    int *lengths = (int *) realloc(match->lengths, len * sizeof(int));
+    if (lengths == NULL)
+        return FALSE;
+    match->lengths = lengths;
+    
+    int *byte_lengths = (int *) realloc(match->byte_lengths, len * sizeof(int));
+    if (byte_lengths == NULL)
+        return FALSE;
+    match->byte_lengths = byte_lengths;
+    
+    const size_t old_size = (size_t) match->capacity * match->n_regions * MATCH_REGION_SIZE;
+    match->capacity = capacity;
+    match->size += len * MATCH_REGION_SIZE - old_size;
+    ore_memory_allocated(len * MATCH_REGION_SIZE - old_size);
+    
+    return TRUE;
+}
+
+// Allocate memory for a rawmatch_t object with the specified capacity, and its contents
+// Memory is allocated natively, rather than by R, so this function may be called from worker threads; it returns NULL if memory could not be allocated
+rawmatch_t * ore_rawmatch_alloc (const int n_regions, const int capacity)
 {
-    // Allocate memory for the struct itself, and set its initial capacity
-    rawmatch_t *match = (rawmatch_t *) R_alloc(1, sizeof(rawmatch_t));
-    match->capacity = MATCH_BLOCK_SIZE;
+    rawmatch_t *match = (rawmatch_t *) calloc(1, sizeof(rawmatch_t));
+    if (match == NULL)
+        return NULL;
+    
     match->n_regions = n_regions;
+    match->size = sizeof(rawmatch_t);
+    ore_memory_allocated(sizeof(rawmatch_t));
     
-    // Allocate memory for matrix variables
-    const size_t len = (size_t) match->capacity * match->n_regions;
-    match->offsets = (int *) R_alloc(len, sizeof(int));
-    match->byte_offsets = (int *) R_alloc(len, sizeof(int));
-    match->lengths = (int *) R_alloc(len, sizeof(int));
-    match->byte_lengths = (int *) R_alloc(len, sizeof(int));
-    match->matches = (char **) R_alloc(len, sizeof(char *));
+    if (!ore_rawmatch_resize(match, capacity))
+    {
+        ore_rawmatch_free(match);
+        return NULL;
+    }
     
     return match;
 }
 
-// Extend an existing rawmatch_t object, increasing its capacity by MATCH_BLOCK_SIZE and reallocating memory accordingly
-void ore_rawmatch_extend (rawmatch_t *match)
+// Double the capacity of a rawmatch_t object; returns FALSE if memory could not be allocated
+Rboolean ore_rawmatch_extend (rawmatch_t *match)
 {
-    const size_t old_len = (size_t) match->capacity * match->n_regions;
-    match->capacity += MATCH_BLOCK_SIZE;
-    const size_t new_len = (size_t) match->capacity * match->n_regions;
-    
-    match->offsets = (int *) ore_realloc(match->offsets, new_len, old_len, sizeof(int));
-    match->byte_offsets = (int *) ore_realloc(match->byte_offsets, new_len, old_len, sizeof(int));
-    match->lengths = (int *) ore_realloc(match->lengths, new_len, old_len, sizeof(int));
-    match->byte_lengths = (int *) ore_realloc(match->byte_lengths, new_len, old_len, sizeof(int));
-    match->matches = (char **) ore_realloc(match->matches, new_len, old_len, sizeof(char *));
+    return ore_rawmatch_resize(match, 2 * match->capacity);
 }
 
-// Insert a string into a rawmatch_t object, allocating space for it first
-void ore_rawmatch_store_string (rawmatch_t *match, const size_t loc, const char *string, const int length)
+// Free a rawmatch_t object
+void ore_rawmatch_free (rawmatch_t *match)
 {
-    match->matches[loc] = R_alloc(length+1, 1);
-    strncpy(match->matches[loc], string, length);
-    *(match->matches[loc] + length) = '\0';
+    if (match == NULL)
+        return;
+    
+    free(match->offsets);
+    free(match->byte_offsets);
+    free(match->lengths);
+    free(match->byte_lengths);
+    ore_memory_freed(match->size);
+    free(match);
 }
 
-// Search a single string for matches to a regex
-rawmatch_t * ore_search (regex_t *regex, const char *text, const char *text_end, const Rboolean all, const size_t start)
+// Free whatever an owner still holds; this is called early if the owner is released, and otherwise when it is garbage collected
+static void ore_owner_finaliser (SEXP owner_ptr)
 {
-    int return_value, length;
-    rawmatch_t *result = NULL;
-    
-    // Create region object to capture match data
-    OnigRegion *region = onig_region_new();
-    
-    // The number of matches found so far
-    int match_number = 0;
+    owner_t *owner = (owner_t *) R_ExternalPtrAddr(owner_ptr);
+    if (owner != NULL)
+    {
+        for (size_t i=0; i<owner->n_matches; i++)
+            ore_rawmatch_free(owner->matches[i]);
+        free(owner->matches);
+        ore_free(owner->regex, NULL);
+        free(owner);
+    }
+    R_ClearExternalPtr(owner_ptr);
+}
+
+// Create an owner for native memory used during a call, which takes over the regex retrieved from the specified source, and has a slot for the match data of each of the specified number of text elements
+// The regex is only held if it would otherwise be freed by ore_free(), since an "ore" object's own regex lives as long as that object
+// Match data is kept in its slot until it is freed or handed over to R, so that nothing leaks if R unwinds out of the call with an error in between
+// The owner must be protected by the caller, and released with ore_owner_release() when the call is finished with it
+SEXP ore_owner (regex_t *regex, SEXP regex_, const size_t n_matches)
+{
+    SEXP owner_ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(owner_ptr, &ore_owner_finaliser, FALSE);
+    owner_t *owner = (owner_t *) calloc(1, sizeof(owner_t));
+    if (owner == NULL)
+    {
+        ore_free(regex, regex_);
+        error("Failed to allocate memory for match data");
+    }
+    owner->regex = ore_source_owns_regex(regex_) ? NULL : regex;
+    R_SetExternalPtrAddr(owner_ptr, owner);
     
-    // Find the end-point of the text (for binary data it may include null bytes)
-    UChar *end_ptr;
-    if (text_end != NULL)
-        end_ptr = (UChar *) text_end;
-    else
-        end_ptr = (UChar *) text + strlen(text);
+    owner->matches = (rawmatch_t **) calloc(n_matches > 0 ? n_matches : 1, sizeof(rawmatch_t *));
+    if (owner->matches == NULL)
+        error("Failed to allocate memory for match data");
+    owner->n_matches = n_matches;
     
-    // If we're not starting at the beginning, step forward the required number of characters
-    UChar *start_ptr;
+    UNPROTECT(1);
+    return owner_ptr;
+}
+
+// The slots for match data held by an owner
+rawmatch_t ** ore_owner_matches (SEXP owner_)
+{
+    return ((owner_t *) R_ExternalPtrAddr(owner_))->matches;
+}
+
+// Free everything held by an owner straight away, rather than waiting for garbage collection
+void ore_owner_release (SEXP owner_)
+{
+    ore_owner_finaliser(owner_);
+}
+
+// Find the position in the text corresponding to the specified (character) starting offset
+static UChar * ore_start_pointer (regex_t *regex, const char *text, const UChar *end_ptr, const Rboolean ascii, const size_t start)
+{
     if (start == 0)
-        start_ptr = (UChar *) text;
-    else if (regex->enc->max_enc_len == 1)
-        start_ptr = (UChar *) text + start;
+        return (UChar *) text;
+    else if (ascii || regex->enc->max_enc_len == 1)
+        return (UChar *) text + start;
     else
-        start_ptr = onigenc_step(regex->enc, (UChar *) text, end_ptr, (int) start);
+        return onigenc_step(regex->enc, (UChar *) text, end_ptr, (int) start);
+}
+
+// Search a single string for matches to a regex, recording byte offsets and lengths only
+// The result is NULL if there are no matches; if result_ptr is NULL then matches are only counted, and nothing is allocated for them
+// The return value is the number of matches, or an error code if something went wrong
+// The region and stack in the scratch space are reused for each match, and left for the next search
+// This function does not use the R API, so it is safe to call from worker threads
+static OnigPosition ore_search_native (regex_t *regex, const UChar *text, const UChar *end_ptr, const UChar *start_ptr, const Rboolean ascii, const Rboolean all, scratch_t *scratch, rawmatch_t **result_ptr)
+{
+    OnigPosition return_value, status = 0, n_matches = 0;
+    rawmatch_t *result = NULL;
     
-    // Keep track of the location of the last zero-length match (if any) - to avoid infinite loops multiple zero-length matches must not start in the same place
-    OnigPosition zerolen_offset = -1;
+    // Skip texts that lack a literal which every match contains
+    if (!ore_required_present(regex, start_ptr, end_ptr))
+    {
+        if (result_ptr != NULL)
+            *result_ptr = NULL;
+        return 0;
+    }
     
-    // Store the option flags as we may temporarily modify them
-    const OnigOptionType options = regex->options;
+    // Borrow the region object that captures match data
+    OnigRegion *region = ore_scratch_take_region(scratch);
+    if (region == NULL)
+    {
+        if (result_ptr != NULL)
+            *result_ptr = NULL;
+        return ONIGERR_MEMORY;
+    }
     
-    // The offset (in chars) corresponding to start_ptr
-    int start_offset = (int) start;
+    // Keep track of the location of the last zero-length match (if any) - to avoid infinite loops multiple zero-length matches must not start in the same place
+    OnigPosition zerolen_offset = -1;
     
     // If "all" is true, loop until there are no more matches; otherwise run once
     do
     {
-        // Call the API to do the search
-        return_value = onig_search(regex, (UChar *) text, end_ptr, start_ptr, end_ptr, region, ONIG_OPTION_NONE);
+        // Do the search, bypassing Onigmo for literal patterns, and its backtracking matcher for simple regexes, where possible
+        return_value = ore_search_once(regex, text, end_ptr, start_ptr, region, scratch, ascii);
         
         // If the result is zero-length, and there was already a zero-length match in the same place, disallow it and try again
-        if (region->end[0] == region->beg[0] && zerolen_offset == region->beg[0])
+        if (return_value >= 0 && region->end[0] == region->beg[0] && zerolen_offset == region->beg[0])
         {
-            // Temporarily modify the regex options, because using the final argument to onig_search() doesn't override them
-            regex->options = options | ONIG_OPTION_FIND_NOT_EMPTY;
-            return_value = onig_search(regex, (UChar *) text, end_ptr, start_ptr, end_ptr, region, ONIG_OPTION_NONE);
-            regex->options = options;
+            return_value = onig_search_with_stack(regex, text, end_ptr, start_ptr, end_ptr, region, ONIG_OPTION_FIND_NOT_EMPTY, scratch->stack);
             
             // If there's no non-empty match, advance the starting point by one character and re-enable empty matches
             if (return_value == ONIG_MISMATCH)
             {
                 start_ptr += onigenc_mbclen_approximate(start_ptr, end_ptr, regex->enc);
-                return_value = onig_search(regex, (UChar *) text, end_ptr, start_ptr, end_ptr, region, ONIG_OPTION_NONE);
+                return_value = ore_search_once(regex, text, end_ptr, start_ptr, region, scratch, ascii);
             }
         }
         
         // If there are no more matches, stop
         if (return_value == ONIG_MISMATCH)
             break;
-        else if (return_value >= 0)
+        else if (return_value < 0)
         {
-            // Set up output data structures the first time
-            if (result == NULL)
-                result = ore_rawmatch_alloc(region->num_regs);
-            else if (match_number >= result->capacity)
-                ore_rawmatch_extend(result);
+            status = return_value;
+            break;
+        }
+        
+        if (region->end[0] == region->beg[0])
+            zerolen_offset = region->beg[0];
+        
+        // Advance the starting point beyond the current match
+        start_ptr = text + region->end[0];
+        n_matches++;
+        
+        if (result_ptr == NULL)
+            continue;
+        
+        // Set up output data structures the first time, and extend them as needed
+        if (result == NULL)
+            result = ore_rawmatch_alloc(region->num_regs, all ? MATCH_INITIAL_CAPACITY : 1);
+        if (result == NULL || (result->n_matches >= result->capacity && !ore_rawmatch_extend(result)))
+        {
+            status = ONIGERR_MEMORY;
+            break;
+        }
+        
+        // Regions are the whole match and then subgroups
+        for (int i=0; i<region->num_regs; i++)
+        {
+            const size_t loc = (size_t) result->n_matches * region->num_regs + i;
+            result->byte_offsets[loc] = (int) region->beg[i];
+            result->byte_lengths[loc] = (int) (region->end[i] - region->beg[i]);
+        }
+        
+        result->n_matches++;
+    }
+    while (all);
+    
+    ore_scratch_return_region(scratch, region);
+    
+    if (result_ptr != NULL)
+        *result_ptr = result;
+    return (status < 0 ? status : n_matches);
+}
+
+// Report an Oniguruma search error
+// Running out of steps is signalled as an error of class "ore_step_limit", so that callers can handle it separately
+void ore_search_error (const OnigPosition error_code)
+{
+    if (error_code == ONIGERR_RETRY_LIMIT_IN_SEARCH_OVER)
+    {
+        SEXP condition = PROTECT(NEW_LIST(2));
+        SEXP names = PROTECT(NEW_CHARACTER(2));
+        SET_ELEMENT(condition, 0, mkString("Search step limit exceeded (see the \"ore.stepLimit\" option)"));
+        SET_ELEMENT(condition, 1, R_NilValue);
+        SET_STRING_ELT(names, 0, mkChar("message"));
+        SET_STRING_ELT(names, 1, mkChar("call"));
+        setAttrib(condition, R_NamesSymbol, names);
+        
+        SEXP classes = PROTECT(NEW_CHARACTER(3));
+        SET_STRING_ELT(classes, 0, mkChar("ore_step_limit"));
+        SET_STRING_ELT(classes, 1, mkChar("error"));
+        SET_STRING_ELT(classes, 2, mkChar("condition"));
+        setAttrib(condition, R_ClassSymbol, classes);
+        
+        SEXP call = PROTECT(lang2(install("stop"), condition));
+        eval(call, R_BaseEnv);
+        UNPROTECT(4);
+    }
+    
+    char message[ONIG_MAX_ERROR_MESSAGE_LEN];
+    onig_error_code_to_str((UChar *) message, error_code);
+    error("Oniguruma search: %s\n", message);
+}
+
+// R_CheckUserInterrupt() jumps straight back to the top level if there is an interrupt, so it is called via R_ToplevelExec(), which returns FALSE instead
+static void ore_check_interrupt (void *data)
+{
+    R_CheckUserInterrupt();
+}
+
+// Check whether the user has asked to interrupt, without jumping out of the calling code, so that it can tidy up first
+Rboolean ore_interrupt_pending (void)
+{
+    return !R_ToplevelExec(ore_check_interrupt, NULL);
+}
+
+// Callback for Onigmo, which calls it periodically while a search is backtracking
+// It must only be used on the main thread, because it calls the R API
+static int ore_search_interrupt (void)
+{
+    return (int) ore_interrupt_pending();
+}
+
+// Cap the backtracking steps taken by each search, according to the "ore.stepLimit" option (which is unlimited if unset), and let long searches be interrupted
+void ore_search_limits (void)
+{
+    SEXP limit = GetOption1(install("ore.stepLimit"));
+    const double value = isNull(limit) ? 0.0 : asReal(limit);
+    if (ISNAN(value) || value < 1.0)
+        onig_set_retry_limit_in_search(0UL);
+    else if (value >= (double) (ULONG_MAX / 2))
+        onig_set_retry_limit_in_search(ULONG_MAX / 2);
+    else
+        onig_set_retry_limit_in_search((unsigned long) value);
+    
+    onig_set_search_interrupt_func(&ore_search_interrupt);
+}
+
+// Check for a user interrupt every so often while stepping through a vector, releasing the owner's memory (if there is an owner) and raising an error if there is one
+void ore_poll_interrupt (const size_t i, SEXP owner_)
+{
+    if (i % INTERRUPT_INTERVAL == INTERRUPT_INTERVAL - 1 && ore_interrupt_pending())
+    {
+        if (!isNull(owner_))
+            ore_owner_release(owner_);
+        ore_search_error(ONIGERR_SEARCH_INTERRUPTED);
+    }
+}
+
+// A position in a string, in both bytes and characters
+typedef struct {
+    const UChar   * ptr;
+    int             offset;
+} cursor_t;
+
+// Find the character offset of a position in the text, moving the cursor forward to it if it is ahead
+// Positions behind the cursor are counted back from it, leaving the cursor where it is
+static int ore_cursor_offset (OnigEncoding enc, cursor_t *cursor, const UChar *target)
+{
+    if (target >= cursor->ptr)
+    {
+        cursor->offset += onigenc_strlen(enc, cursor->ptr, target);
+        cursor->ptr = target;
+        return cursor->offset;
+    }
+    else
+        return cursor->offset - onigenc_strlen(enc, target, cursor->ptr);
+}
+
+// Complete a rawmatch_t object after a search, working out character offsets
+// The "start_ptr" and "start" arguments give the position that the search started from, in bytes and chars respectively
+static void ore_rawmatch_finish (regex_t *regex, const char *text, const Rboolean ascii, const UChar *start_ptr, const size_t start, rawmatch_t *result)
+{
+    if (result == NULL)
+        return;
+    
+    const size_t len = (size_t) result->n_matches * result->n_regions;
+    
+    // If the text is ASCII or the encoding is single-byte, the offsets and byte offsets will be the same
+    if (ascii || regex->enc->max_enc_len == 1)
+    {
+        memcpy(result->offsets, result->byte_offsets, len * sizeof(int));
+        memcpy(result->lengths, result->byte_lengths, len * sizeof(int));
+    }
+    else
+    {
+        // The text cursor only ever moves forward, so the text between matches is only scanned once
+        cursor_t text_cursor = { start_ptr, (int) start };
+        
+        for (int j=0; j<result->n_matches; j++)
+        {
+            const size_t match_loc = (size_t) j * result->n_regions;
+            const UChar *match_ptr = (const UChar *) text + result->byte_offsets[match_loc];
+            ore_cursor_offset(regex->enc, &text_cursor, match_ptr);
+            
+            // Groups are usually in order, so a second cursor moves through the match; it goes back to the start of the match if not
+            const cursor_t match_cursor = text_cursor;
+            cursor_t group_cursor = match_cursor;
             
-            // Regions are the whole match and then subgroups
-            for (int i=0; i<region->num_regs; i++)
+            for (int i=0; i<result->n_regions; i++)
             {
-                // Work out the offset and length of the region, in bytes and chars
-                length = region->end[i] - region->beg[i];
-                const size_t loc = match_number * region->num_regs + i;
+                const size_t loc = match_loc + i;
                 
-                result->byte_offsets[loc] = region->beg[i];
-                result->byte_lengths[loc] = length;
-                
-                // If we're using a single-byte encoding the offsets and byte offsets will be the same
-                if (regex->enc->max_enc_len == 1)
+                // Missing groups have negative byte offsets, which are kept as they are
+                if (result->byte_offsets[loc] < 0)
                 {
                     result->offsets[loc] = result->byte_offsets[loc];
-                    result->lengths[loc] = result->byte_lengths[loc];
-                }
-                else
-                {
-                    result->offsets[loc] = start_offset + onigenc_strlen(regex->enc, start_ptr, (UChar *) text+region->beg[i]);
-                    result->lengths[loc] = onigenc_strlen(regex->enc, (UChar *) text+region->beg[i], (UChar *) text+region->end[i]);
+                    result->lengths[loc] = 0;
+                    continue;
                 }
                 
-                // Set missing groups (which must be optional) to NULL; otherwise store match text
-                if (length == 0 && i > 0)
-                    result->matches[loc] = NULL;
-                else
-                {
-                    ore_rawmatch_store_string(result, loc, text+region->beg[i], length);
-                    if (length == 0)
-                        zerolen_offset = region->beg[0];
-                }
+                const UChar *region_ptr = (const UChar *) text + result->byte_offsets[loc];
+                if (region_ptr < group_cursor.ptr)
+                    group_cursor = match_cursor;
+                result->offsets[loc] = ore_cursor_offset(regex->enc, &group_cursor, region_ptr);
+                result->lengths[loc] = onigenc_strlen(regex->enc, region_ptr, region_ptr + result->byte_lengths[loc]);
             }
             
-            // Advance the starting point beyond the current match
-            start_ptr = (UChar *) text + region->end[0];
-            const size_t loc = match_number * region->num_regs;
-            start_offset = result->offsets[loc] + result->lengths[loc];
-            match_number++;
+            // Move past the match, whose length is already known
+            text_cursor.ptr = match_ptr + result->byte_lengths[match_loc];
+            text_cursor.offset += result->lengths[match_loc];
         }
+    }
+}
+
+// Search a single string from a point whose character offset is already known
+// Search errors are raised directly, so the regex must be held by an owner to be released afterwards
+static rawmatch_t * ore_search_from (regex_t *regex, const char *text, const UChar *end_ptr, const Rboolean ascii, const Rboolean all, const UChar *start_ptr, const size_t start)
+{
+    rawmatch_t *result;
+    scratch_t *scratch = ore_scratch();
+    const OnigPosition status = ore_search_native(regex, (const UChar *) text, end_ptr, start_ptr, ascii, all, scratch, &result);
+    ore_scratch_update(scratch);
+    if (status < 0)
+    {
+        ore_rawmatch_free(result);
+        ore_search_error(status);
+    }
+    
+    ore_rawmatch_finish(regex, text, ascii, start_ptr, start, result);
+    return result;
+}
+
+// Search a single string for matches to a regex; matched text is not copied, and must be taken from the source by the caller
+// The result, if not NULL, must be freed with ore_rawmatch_free() when no longer needed
+rawmatch_t * ore_search (regex_t *regex, const char *text, const char *text_end, const Rboolean ascii, const Rboolean all, const size_t start)
+{
+    // Find the end-point of the text (for binary data it may include null bytes)
+    UChar *end_ptr;
+    if (text_end != NULL)
+        end_ptr = (UChar *) text_end;
+    else
+        end_ptr = (UChar *) text + strlen(text);
+    
+    // If we're not starting at the beginning, step forward the required number of characters
+    UChar *start_ptr = ore_start_pointer(regex, text, end_ptr, ascii, start);
+    
+    return ore_search_from(regex, text, end_ptr, ascii, all, start_ptr, start);
+}
+
+// Search every element of a character vector, dividing the elements between threads
+// Text pointers are gathered on the main thread first, because the R API is not thread-safe; NA elements and those with incompatible encodings are skipped here, and reported later
+// The raw matches are left in the slots given, one per element; they are not yet complete, and must be finished off by the caller
+static void ore_search_parallel (regex_t *regex, text_t *text, const Rboolean all, const int *start, const int start_len, const int n_threads, rawmatch_t **raw_matches, OnigPosition *status)
+{
+    const R_xlen_t n = (R_xlen_t) text->length;
+    const UChar **start_ptrs = (const UChar **) R_alloc(n, sizeof(UChar *));
+    const UChar **text_ptrs = (const UChar **) R_alloc(n, sizeof(UChar *));
+    const UChar **end_ptrs = (const UChar **) R_alloc(n, sizeof(UChar *));
+    Rboolean *ascii = (Rboolean *) R_alloc(n, sizeof(Rboolean));
+    
+    for (R_xlen_t i=0; i<n; i++)
+    {
+        raw_matches[i] = NULL;
+        status[i] = 0;
+        
+        const SEXP element = STRING_ELT(text->object, i);
+        if (element == NA_STRING || !ore_consistent_encodings(ore_r_to_onig_enc(getCharCE(element)), regex->enc))
+            text_ptrs[i] = NULL;
         else
         {
-            // Report the error message if there was one
-            char message[ONIG_MAX_ERROR_MESSAGE_LEN];
-            onig_error_code_to_str((UChar *) message, return_value);
-            error("Oniguruma search: %s\n", message);
+            text_ptrs[i] = (const UChar *) CHAR(element);
+            end_ptrs[i] = text_ptrs[i] + LENGTH(element);
+            ascii[i] = ore_string_ascii(element);
+            start_ptrs[i] = ore_start_pointer(regex, (const char *) text_ptrs[i], end_ptrs[i], ascii[i], (size_t) start[i % start_len] - 1);
         }
-        
-        // Tidy up
-        onig_region_free(region, 0);
     }
-    while (all);
     
-    // Store the number of matches
-    if (result != NULL)
-        result->n_matches = match_number;
+    // Worker threads can't check for interrupts, since that uses the R API, but step limits still apply
+    onig_set_search_interrupt_func(NULL);
     
-    // Tidy up completely
-    onig_region_free(region, 1);
+    // Each thread has its own scratch space, which is reused for all the elements that it searches
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+#else
+    (void) n_threads;
+#endif
+    {
+        scratch_t scratch;
+        const Rboolean ready = ore_scratch_init(&scratch);
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, PARALLEL_CHUNK_SIZE)
+#endif
+        for (R_xlen_t i=0; i<n; i++)
+        {
+            if (text_ptrs[i] != NULL)
+                status[i] = ready ? ore_search_native(regex, text_ptrs[i], end_ptrs[i], start_ptrs[i], ascii[i], all, &scratch, &raw_matches[i]) : ONIGERR_MEMORY;
+        }
+        
+        ore_scratch_done(&scratch);
+    }
     
-    return result;
+    onig_set_search_interrupt_func(&ore_search_interrupt);
 }
 
 // Copy integer data from a rawmatch_t to an R vector
@@ -195,20 +512,11 @@ void ore_int_vector (SEXP vec, const int *data, const int n_regions, const int n
         ptr[i] = data[i*n_regions] + increment;
 }
 
-// Copy string data from a rawmatch_t to an R vector
-void ore_char_vector (SEXP vec, const char **data, const int n_regions, const int n_matches, encoding_t *encoding)
+// Create an R vector of matched strings, taken directly from the text at the byte offsets in a rawmatch_t
+void ore_char_vector (SEXP vec, const char *text, const int *byte_offsets, const int *byte_lengths, const int n_regions, const int n_matches, encoding_t *encoding)
 {
-    void *iconv_handle = ore_iconv_handle(encoding);
-    
     for (int i=0; i<n_matches; i++)
-    {
-        if (data[i*n_regions] == NULL)
-            SET_STRING_ELT(vec, i, mkCharCE("",encoding->r_enc));
-        else
-            SET_STRING_ELT(vec, i, mkCharCE(ore_iconv(iconv_handle,data[i*n_regions]), encoding->r_enc));
-    }
-    
-    ore_iconv_done(iconv_handle);
+        SET_STRING_ELT(vec, i, ore_fragment_to_rchar(text + byte_offsets[i*n_regions], byte_lengths[i*n_regions], encoding));
 }
 
 // Copy integer data for groups into an R matrix
@@ -234,11 +542,9 @@ void ore_int_matrix (SEXP mat, const int *data, const int n_regions, const int n
     }
 }
 
-// Copy string data from groups into an R matrix
-void ore_char_matrix (SEXP mat, const char **data, const int n_regions, const int n_matches, const int index, const SEXP col_names, encoding_t *encoding)
+// Create an R matrix of strings matched by groups, taken directly from the text
+void ore_char_matrix (SEXP mat, const char *text, const int *byte_offsets, const int *byte_lengths, const int n_regions, const int n_matches, const int index, const SEXP col_names, encoding_t *encoding)
 {
-    void *iconv_handle = ore_iconv_handle(encoding);
-    
     for (int i=0; i<n_matches; i++)
     {
         if (index >= 0 && i != index)
@@ -247,17 +553,15 @@ void ore_char_matrix (SEXP mat, const char **data, const int n_regions, const in
         for (int j=1; j<n_regions; j++)
         {
             // Missing groups are assigned NA
-            const char *element = data[i*n_regions + j];
+            const size_t loc = (size_t) i * n_regions + j;
             const int ii = index < 0 ? i : 0;
-            if (element == NULL)
+            if (byte_lengths[loc] == 0)
                 SET_STRING_ELT(mat, (j-1)*n_matches + ii, NA_STRING);
             else
-                SET_STRING_ELT(mat, (j-1)*n_matches + ii, mkCharCE(ore_iconv(iconv_handle,element), encoding->r_enc));
+                SET_STRING_ELT(mat, (j-1)*n_matches + ii, ore_fragment_to_rchar(text + byte_offsets[loc], byte_lengths[loc], encoding));
         }
     }
     
-    ore_iconv_done(iconv_handle);
-    
     // Set column names if supplied
     if (!isNull(col_names))
     {
@@ -271,14 +575,204 @@ void ore_char_matrix (SEXP mat, const char **data, const int n_regions, const in
     }
 }
 
+// Obtain the raw match for one element of the text, searching it unless that has already been done in parallel, in which case the match is already in its slot
+// The match is left in its slot, and the text element is returned through the last argument; the latter is NULL if the element is missing or its encoding is incompatible with the regex
+static rawmatch_t * ore_search_element (regex_t *regex, text_t *text, const size_t i, const Rboolean all, const int *start, const int start_len, const Rboolean incremental, rawmatch_t **raw_matches, const Rboolean searched, text_element_t **element_ptr)
+{
+    rawmatch_t *raw_match;
+    *element_ptr = NULL;
+    
+    // Retrieve the text element and check its encoding is compatible with the regex
+    text_element_t *text_element = ore_text_element(text, i, incremental, NULL);
+    if (text_element == NULL)
+        return NULL;
+    else if (!ore_consistent_encodings(text_element->encoding->onig_enc, regex->enc))
+    {
+        warning("Encoding of text element %lu does not match the regex", (unsigned long) i+1);
+        return NULL;
+    }
+    
+    // Do the match, or collect the results if it's already been done
+    const size_t element_start = (size_t) start[i % start_len] - 1;
+    const UChar *start_ptr = ore_start_pointer(regex, text_element->start, (const UChar *) text_element->end, text_element->ascii, element_start);
+    if (searched)
+    {
+        raw_match = raw_matches[i];
+        ore_rawmatch_finish(regex, text_element->start, text_element->ascii, start_ptr, element_start, raw_match);
+    }
+    else
+        raw_match = raw_matches[i] = ore_search_from(regex, text_element->start, (const UChar *) text_element->end, text_element->ascii, all, start_ptr, element_start);
+    
+    // If there is more text to come from the source, and there is no match so far, or the match may be incomplete, extract more and continue
+    // The buffer moves as it grows, so the point to resume searching from is kept as an offset, in bytes and characters
+    size_t resume_byte = (size_t) (start_ptr - (const UChar *) text_element->start);
+    size_t resume_char = element_start;
+    while (text_element->incomplete)
+    {
+        const size_t text_len = (size_t) (text_element->end - text_element->start);
+        
+        // If the regex never looks further than a certain distance from where a match starts, then starting points further than that from the end of the text are unaffected by more text
+        const Rboolean bounded = (regex->max_scan_len != ONIG_INFINITE_DISTANCE && regex->max_scan_len < text_len);
+        
+        if (raw_match != NULL)
+        {
+            const size_t last_loc = (size_t) (raw_match->n_matches - 1) * raw_match->n_regions;
+            if (bounded)
+            {
+                // The match is final if neither it, nor any failed search from an earlier point, could have looked beyond the end of the text
+                if ((size_t) raw_match->byte_offsets[last_loc] + regex->max_scan_len <= text_len)
+                    break;
+            }
+            else
+            {
+                // If we've seen a match but it runs right up to the end of the text, continue in case we've missed some
+                // NB: This is an imperfect heuristic - it isn't hard to design text/regex pairs that mislead it - but the user can always disable incremental search
+                const size_t end_of_last_match = (size_t) raw_match->byte_offsets[last_loc] + raw_match->byte_lengths[last_loc];
+                if (end_of_last_match < text_len)
+                    break;
+            }
+        }
+        
+        // Ask again for the element, to get more of it
+        ore_rawmatch_free(raw_match);
+        raw_matches[i] = NULL;
+        text_element = ore_text_element(text, i, incremental, text_element);
+        const UChar *text_start = (const UChar *) text_element->start;
+        const UChar *end_ptr = (const UChar *) text_element->end;
+        
+        // Only rescan from the earliest starting point that the new text could affect, moved back to a character boundary
+        if (bounded)
+        {
+            const UChar *resume_ptr = onigenc_get_left_adjust_char_head(regex->enc, text_start, text_start + (text_len - regex->max_scan_len), end_ptr);
+            if (resume_ptr > text_start + resume_byte)
+            {
+                resume_char += onigenc_strlen(regex->enc, text_start + resume_byte, resume_ptr);
+                resume_byte = (size_t) (resume_ptr - text_start);
+            }
+        }
+        
+        raw_match = raw_matches[i] = ore_search_from(regex, text_element->start, end_ptr, text_element->ascii, all, text_start + resume_byte, resume_char);
+    }
+    
+    *element_ptr = text_element;
+    return raw_match;
+}
+
+// Search every element of the text and collect all matches into a single data frame, with one row per match
+// Every element's match data stays in its slot until it has been copied into the table
+static SEXP ore_search_table (regex_t *regex, text_t *text, const Rboolean all, const int *start, const int start_len, const Rboolean incremental, rawmatch_t **raw_matches, const Rboolean searched, SEXP group_names)
+{
+    const int n_regions = onig_number_of_captures(regex) + 1;
+    
+    // Search everything first, so that the size of the table is known
+    text_element_t **text_elements = (text_element_t **) R_alloc(text->length, sizeof(text_element_t *));
+    size_t n_rows = 0;
+    for (size_t i=0; i<text->length; i++)
+    {
+        const rawmatch_t *raw_match = ore_search_element(regex, text, i, all, start, start_len, incremental, raw_matches, searched, &text_elements[i]);
+        if (raw_match != NULL)
+            n_rows += raw_match->n_matches;
+    }
+    
+    if (n_rows > INT_MAX)
+        error("Too many matches to fit in a table");
+    
+    // Allocate all the columns up front
+    const int n_cols = 7 + n_regions - 1;
+    SEXP result, col_names, row_names;
+    PROTECT(result = NEW_LIST(n_cols));
+    PROTECT(col_names = NEW_CHARACTER(n_cols));
+    for (int k=0; k<6; k++)
+        SET_VECTOR_ELT(result, k, NEW_INTEGER(n_rows));
+    for (int k=6; k<n_cols; k++)
+        SET_VECTOR_ELT(result, k, NEW_CHARACTER(n_rows));
+    
+    SET_STRING_ELT(col_names, 0, mkChar("element"));
+    SET_STRING_ELT(col_names, 1, mkChar("match"));
+    SET_STRING_ELT(col_names, 2, mkChar("offset"));
+    SET_STRING_ELT(col_names, 3, mkChar("byteOffset"));
+    SET_STRING_ELT(col_names, 4, mkChar("length"));
+    SET_STRING_ELT(col_names, 5, mkChar("byteLength"));
+    SET_STRING_ELT(col_names, 6, mkChar("text"));
+    for (int k=1; k<n_regions; k++)
+    {
+        if (!isNull(group_names) && STRING_ELT(group_names,k-1) != NA_STRING)
+            SET_STRING_ELT(col_names, 6+k, STRING_ELT(group_names,k-1));
+        else
+        {
+            char name[24];
+            snprintf(name, 24, "group%d", k);
+            SET_STRING_ELT(col_names, 6+k, mkChar(name));
+        }
+    }
+    
+    int *element = INTEGER(VECTOR_ELT(result, 0));
+    int *match = INTEGER(VECTOR_ELT(result, 1));
+    int *offset = INTEGER(VECTOR_ELT(result, 2));
+    int *byte_offset = INTEGER(VECTOR_ELT(result, 3));
+    int *length = INTEGER(VECTOR_ELT(result, 4));
+    int *byte_length = INTEGER(VECTOR_ELT(result, 5));
+    SEXP text_col = VECTOR_ELT(result, 6);
+    
+    // Fill the table, freeing each element's match data once it has been used
+    size_t row = 0;
+    for (size_t i=0; i<text->length; i++)
+    {
+        rawmatch_t *raw_match = raw_matches[i];
+        if (raw_match == NULL)
+            continue;
+        
+        const text_element_t *text_element = text_elements[i];
+        for (int j=0; j<raw_match->n_matches; j++, row++)
+        {
+            const size_t loc = (size_t) j * n_regions;
+            element[row] = (int) i + 1;
+            match[row] = j + 1;
+            offset[row] = raw_match->offsets[loc] + 1;
+            byte_offset[row] = raw_match->byte_offsets[loc] + 1;
+            length[row] = raw_match->lengths[loc];
+            byte_length[row] = raw_match->byte_lengths[loc];
+            SET_STRING_ELT(text_col, row, ore_fragment_to_rchar(text_element->start + raw_match->byte_offsets[loc], raw_match->byte_lengths[loc], text_element->encoding));
+            
+            // Missing groups (which must be optional) are NA
+            for (int k=1; k<n_regions; k++)
+            {
+                if (raw_match->byte_lengths[loc+k] == 0)
+                    SET_STRING_ELT(VECTOR_ELT(result, 6+k), row, NA_STRING);
+                else
+                    SET_STRING_ELT(VECTOR_ELT(result, 6+k), row, ore_fragment_to_rchar(text_element->start + raw_match->byte_offsets[loc+k], raw_match->byte_lengths[loc+k], text_element->encoding));
+            }
+        }
+        
+        ore_rawmatch_free(raw_match);
+        raw_matches[i] = NULL;
+    }
+    
+    // Compact row names, as R itself uses
+    PROTECT(row_names = NEW_INTEGER(2));
+    INTEGER(row_names)[0] = NA_INTEGER;
+    INTEGER(row_names)[1] = -((int) n_rows);
+    
+    setAttrib(result, R_NamesSymbol, col_names);
+    setAttrib(result, R_RowNamesSymbol, row_names);
+    setAttrib(result, R_ClassSymbol, mkString("data.frame"));
+    
+    UNPROTECT(3);
+    return result;
+}
+
 // Vectorised wrapper around ore_search(), which handles the R API stuff
-SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simplify_, SEXP incremental_)
+SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simplify_, SEXP incremental_, SEXP threads_, SEXP table_)
 {
     // Convert R objects to C types
     const Rboolean all = asLogical(all_) == TRUE;
     const Rboolean simplify = asLogical(simplify_) == TRUE;
     const Rboolean incremental = (asLogical(incremental_) == TRUE) && !all;
+    const Rboolean table = asLogical(table_) == TRUE;
     int *start = INTEGER(start_);
+    int n_threads = asInteger(threads_);
+    if (n_threads == NA_INTEGER || n_threads < 1)
+        n_threads = 1;
     
     // Check whether the text argument is actually a file path
     const Rboolean using_file = inherits(text_, "orefile") || inherits(text_, "connection");
@@ -289,9 +783,11 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
     SEXP binary_attr = getAttrib(text_, install("binary"));
     const Rboolean binary = inherits(text_, "orefile") && !isNull(binary_attr) && asLogical(binary_attr) == TRUE;
     
-    // Retrieve the text and the regex
-    text_t *text = ore_text(text_);
+    // Retrieve the text and the regex, which is then held by an owner along with the match data, until the latter is converted to R objects or handed to a lazy store
+    text_t *text = ore_text(text_, TRUE);
     regex_t *regex = ore_retrieve(regex_, text->encoding);
+    SEXP owner = PROTECT(ore_owner(regex, regex_, text->length));
+    rawmatch_t **raw_matches = ore_owner_matches(owner);
     
     SEXP group_names = R_NilValue;
     Rboolean group_names_protected = FALSE;
@@ -319,52 +815,54 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
     // Check for sensible input
     if (start_len < 1)
     {
-        ore_free(regex, regex_);
+        ore_owner_release(owner);
         error("The vector of starting positions is empty");
     }
     
-    SEXP results;
-    PROTECT(results = NEW_LIST(text->length));
+    ore_memory_reset_peak();
+    ore_search_limits();
     
-    // Step through each string to be searched
-    for (size_t i=0; i<text->length; i++)
+    // Results for character vectors can refer to the match data and source strings directly, and create R vectors from them only when needed
+    const Rboolean lazy = !table && (text->source == VECTOR_SOURCE) && ore_lazy_enabled();
+    
+    // Searching a character vector with several threads is done up front, and the results are then converted to R objects below
+    Rboolean searched = FALSE;
+    if (n_threads > 1 && text->source == VECTOR_SOURCE && text->length > 1)
     {
-        text_element_t *text_element = NULL;
-        rawmatch_t *raw_match;
-        
-        // Retrieve the text element and check its encoding is compatible with the regex
-        text_element = ore_text_element(text, i, incremental, text_element);
-        if (text_element == NULL)
-        {
-            SET_ELEMENT(results, i, R_NilValue);
-            continue;
-        }
-        else if (!ore_consistent_encodings(text_element->encoding->onig_enc, regex->enc))
-        {
-            warning("Encoding of text element %lu does not match the regex", (unsigned long) i+1);
-            SET_ELEMENT(results, i, R_NilValue);
-            continue;
-        }
-        
-        // Do the match
-        raw_match = ore_search(regex, text_element->start, text_element->end, all, (size_t) start[i % start_len] - 1);
+        OnigPosition *status = (OnigPosition *) R_alloc(text->length, sizeof(OnigPosition));
+        ore_search_parallel(regex, text, all, start, start_len, n_threads, raw_matches, status);
+        searched = TRUE;
         
-        // If there is more text to come from the source, and there is no match so far, or the match may be incomplete, extract more and continue
-        while (text_element->incomplete)
+        for (size_t i=0; i<text->length; i++)
         {
-            if (raw_match != NULL)
+            if (status[i] < 0)
             {
-                // If we've seen a match but it runs right up to the end of the text, continue in case we've missed some
-                // NB: This is an imperfect heuristic - it isn't hard to design text/regex pairs that mislead it - but the user can always disable incremental search
-                const size_t end_of_last_match = (size_t) raw_match->byte_offsets[raw_match->n_matches - 1] + raw_match->byte_lengths[raw_match->n_matches - 1];
-                if (end_of_last_match < (text_element->end - text_element->start))
-                    break;
+                ore_owner_release(owner);
+                ore_search_error(status[i]);
             }
-            
-            // Ask again for the element, to get more of it, and rerun the match
-            text_element = ore_text_element(text, i, incremental, text_element);
-            raw_match = ore_search(regex, text_element->start, text_element->end, all, (size_t) start[i % start_len] - 1);
         }
+    }
+    
+    // Tables cover all elements at once, and are built separately
+    if (table)
+    {
+        SEXP result = PROTECT(ore_search_table(regex, text, all, start, start_len, incremental, raw_matches, searched, group_names));
+        ore_owner_release(owner);
+        ore_text_done(text);
+        UNPROTECT(3 + group_names_protected - using_file);
+        return result;
+    }
+    
+    SEXP results;
+    PROTECT(results = NEW_LIST(text->length));
+    
+    // Step through each string to be searched
+    for (size_t i=0; i<text->length; i++)
+    {
+        ore_poll_interrupt(i, owner);
+        
+        text_element_t *text_element;
+        rawmatch_t *raw_match = ore_search_element(regex, text, i, all, start, start_len, incremental, raw_matches, searched, &text_element);
         
         // Assign NULL if there's no match, otherwise build up an "orematch" object
         if (raw_match == NULL)
@@ -374,6 +872,14 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
             SEXP result, result_names, result_text, n_matches, offsets, byte_offsets, lengths, byte_lengths, matches;
             const Rboolean have_groups = (raw_match->n_regions >= 2);
             
+            // The store takes ownership of the raw match from the owner, and it is then freed when the result is garbage collected
+            SEXP store = R_NilValue;
+            if (lazy)
+            {
+                PROTECT(store = ore_lazy_store(raw_match, STRING_ELT(text_,i)));
+                raw_matches[i] = NULL;
+            }
+            
             // Allocate memory for data structures
             PROTECT(result = NEW_LIST(have_groups ? 9 : 8));
             PROTECT(result_names = NEW_CHARACTER(have_groups ? 9 : 8));
@@ -399,16 +905,27 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
             else
                 PROTECT(result_text = ScalarString(STRING_ELT(text_,i)));
             PROTECT(n_matches = ScalarInteger(raw_match->n_matches));
-            PROTECT(offsets = NEW_INTEGER(raw_match->n_matches));
-            ore_int_vector(offsets, raw_match->offsets, raw_match->n_regions, raw_match->n_matches, 1);
-            PROTECT(byte_offsets = NEW_INTEGER(raw_match->n_matches));
-            ore_int_vector(byte_offsets, raw_match->byte_offsets, raw_match->n_regions, raw_match->n_matches, 1);
-            PROTECT(lengths = NEW_INTEGER(raw_match->n_matches));
-            ore_int_vector(lengths, raw_match->lengths, raw_match->n_regions, raw_match->n_matches, 0);
-            PROTECT(byte_lengths = NEW_INTEGER(raw_match->n_matches));
-            ore_int_vector(byte_lengths, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, 0);
-            PROTECT(matches = NEW_CHARACTER(raw_match->n_matches));
-            ore_char_vector(matches, (const char **) raw_match->matches, raw_match->n_regions, raw_match->n_matches, text_element->encoding);
+            if (lazy)
+            {
+                PROTECT(offsets = ore_lazy_int_vector(store, OFFSETS_FIELD, 1));
+                PROTECT(byte_offsets = ore_lazy_int_vector(store, BYTE_OFFSETS_FIELD, 1));
+                PROTECT(lengths = ore_lazy_int_vector(store, LENGTHS_FIELD, 0));
+                PROTECT(byte_lengths = ore_lazy_int_vector(store, BYTE_LENGTHS_FIELD, 0));
+                PROTECT(matches = ore_lazy_char_vector(store));
+            }
+            else
+            {
+                PROTECT(offsets = NEW_INTEGER(raw_match->n_matches));
+                ore_int_vector(offsets, raw_match->offsets, raw_match->n_regions, raw_match->n_matches, 1);
+                PROTECT(byte_offsets = NEW_INTEGER(raw_match->n_matches));
+                ore_int_vector(byte_offsets, raw_match->byte_offsets, raw_match->n_regions, raw_match->n_matches, 1);
+                PROTECT(lengths = NEW_INTEGER(raw_match->n_matches));
+                ore_int_vector(lengths, raw_match->lengths, raw_match->n_regions, raw_match->n_matches, 0);
+                PROTECT(byte_lengths = NEW_INTEGER(raw_match->n_matches));
+                ore_int_vector(byte_lengths, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, 0);
+                PROTECT(matches = NEW_CHARACTER(raw_match->n_matches));
+                ore_char_vector(matches, text_element->start, raw_match->byte_offsets, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, text_element->encoding);
+            }
             
             // Put everything in place
             SET_ELEMENT(result, 0, result_text);
@@ -437,16 +954,27 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
                 SET_STRING_ELT(groups_element_names, 4, mkChar("matches"));
                 
                 // Convert elements of the raw match data to R matrices (one row per match)
-                PROTECT(offsets = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
-                ore_int_matrix(offsets, raw_match->offsets, raw_match->n_regions, raw_match->n_matches, group_names, 1);
-                PROTECT(byte_offsets = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
-                ore_int_matrix(byte_offsets, raw_match->byte_offsets, raw_match->n_regions, raw_match->n_matches, group_names, 1);
-                PROTECT(lengths = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
-                ore_int_matrix(lengths, raw_match->lengths, raw_match->n_regions, raw_match->n_matches, group_names, 0);
-                PROTECT(byte_lengths = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
-                ore_int_matrix(byte_lengths, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, group_names, 0);
-                PROTECT(matches = allocMatrix(STRSXP, raw_match->n_matches, raw_match->n_regions-1));
-                ore_char_matrix(matches, (const char **) raw_match->matches, raw_match->n_regions, raw_match->n_matches, -1, group_names, text_element->encoding);
+                if (lazy)
+                {
+                    PROTECT(offsets = ore_lazy_int_matrix(store, OFFSETS_FIELD, 1, group_names));
+                    PROTECT(byte_offsets = ore_lazy_int_matrix(store, BYTE_OFFSETS_FIELD, 1, group_names));
+                    PROTECT(lengths = ore_lazy_int_matrix(store, LENGTHS_FIELD, 0, group_names));
+                    PROTECT(byte_lengths = ore_lazy_int_matrix(store, BYTE_LENGTHS_FIELD, 0, group_names));
+                    PROTECT(matches = ore_lazy_char_matrix(store, group_names));
+                }
+                else
+                {
+                    PROTECT(offsets = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
+                    ore_int_matrix(offsets, raw_match->offsets, raw_match->n_regions, raw_match->n_matches, group_names, 1);
+                    PROTECT(byte_offsets = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
+                    ore_int_matrix(byte_offsets, raw_match->byte_offsets, raw_match->n_regions, raw_match->n_matches, group_names, 1);
+                    PROTECT(lengths = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
+                    ore_int_matrix(lengths, raw_match->lengths, raw_match->n_regions, raw_match->n_matches, group_names, 0);
+                    PROTECT(byte_lengths = allocMatrix(INTSXP, raw_match->n_matches, raw_match->n_regions-1));
+                    ore_int_matrix(byte_lengths, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, group_names, 0);
+                    PROTECT(matches = allocMatrix(STRSXP, raw_match->n_matches, raw_match->n_regions-1));
+                    ore_char_matrix(matches, text_element->start, raw_match->byte_offsets, raw_match->byte_lengths, raw_match->n_regions, raw_match->n_matches, -1, group_names, text_element->encoding);
+                }
                 
                 // Put everything in place
                 SET_ELEMENT(groups, 0, offsets);
@@ -472,17 +1000,23 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
             setAttrib(result, R_NamesSymbol, result_names);
             setAttrib(result, R_ClassSymbol, mkString("orematch"));
             SET_ELEMENT(results, i, result);
-            UNPROTECT(3);
+            UNPROTECT(lazy ? 4 : 3);
+            
+            if (!lazy)
+            {
+                ore_rawmatch_free(raw_match);
+                raw_matches[i] = NULL;
+            }
         }
     }
     
     if (text->source == VECTOR_SOURCE)
         setAttrib(results, R_NamesSymbol, getAttrib(text->object,R_NamesSymbol));
     
-    ore_free(regex, regex_);
+    ore_owner_release(owner);
     ore_text_done(text);
     
-    UNPROTECT(2 + group_names_protected - using_file);
+    UNPROTECT(3 + group_names_protected - using_file);
     
     // Return just the first (and only) element of the full list, if requested
     if (simplify && text->length == 1)
@@ -493,3 +1027,143 @@ SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simpl
         return results;
     }
 }
+
+// Test each element of a character vector for a match to a regex, returning a logical vector
+// This avoids creating a region or any match data, and stops at the first match in each element
+SEXP ore_ismatch_all (SEXP regex_, SEXP text_, SEXP start_, SEXP keep_na_)
+{
+    const Rboolean keep_na = asLogical(keep_na_) == TRUE;
+    int *start = INTEGER(start_);
+    const int start_len = length(start_);
+    
+    PROTECT(text_ = AS_CHARACTER(text_));
+    text_t *text = ore_text(text_, FALSE);
+    regex_t *regex = ore_retrieve(regex_, text->encoding);
+    SEXP owner = PROTECT(ore_owner(regex, regex_, 0));
+    
+    if (start_len < 1)
+    {
+        ore_owner_release(owner);
+        error("The vector of starting positions is empty");
+    }
+    
+    ore_search_limits();
+    scratch_t *scratch = ore_scratch();
+    
+    SEXP results = PROTECT(NEW_LOGICAL(text->length));
+    int *results_ptr = LOGICAL(results);
+    
+    for (size_t i=0; i<text->length; i++)
+    {
+        ore_poll_interrupt(i, owner);
+        
+        // Text elements are accessed directly, since there's no need to keep them beyond this iteration
+        const SEXP element = STRING_ELT(text_, i);
+        if (element == NA_STRING)
+        {
+            results_ptr[i] = keep_na ? NA_LOGICAL : FALSE;
+            continue;
+        }
+        else if (!ore_consistent_encodings(ore_r_to_onig_enc(getCharCE(element)), regex->enc))
+        {
+            warning("Encoding of text element %lu does not match the regex", (unsigned long) i+1);
+            results_ptr[i] = FALSE;
+            continue;
+        }
+        
+        const char *string = CHAR(element);
+        const UChar *end_ptr = (const UChar *) string + LENGTH(element);
+        const Rboolean ascii = ore_string_ascii(element);
+        const UChar *start_ptr = ore_start_pointer(regex, string, end_ptr, ascii, (size_t) start[i % start_len] - 1);
+        
+        // A NULL region means that Onigmo doesn't record group positions
+        OnigPosition return_value = ONIG_MISMATCH;
+        if (ore_required_present(regex, start_ptr, end_ptr))
+        {
+            return_value = ore_search_once(regex, (const UChar *) string, end_ptr, start_ptr, NULL, scratch, ascii);
+            ore_scratch_update(scratch);
+        }
+        
+        if (return_value >= 0)
+            results_ptr[i] = TRUE;
+        else if (return_value == ONIG_MISMATCH)
+            results_ptr[i] = FALSE;
+        else
+        {
+            ore_owner_release(owner);
+            ore_search_error(return_value);
+        }
+    }
+    
+    setAttrib(results, R_NamesSymbol, getAttrib(text_, R_NamesSymbol));
+    
+    ore_owner_release(owner);
+    
+    UNPROTECT(3);
+    return results;
+}
+
+// Count the matches in each element of a character vector, without storing any match data
+SEXP ore_count_all (SEXP regex_, SEXP text_, SEXP start_, SEXP keep_na_)
+{
+    const Rboolean keep_na = asLogical(keep_na_) == TRUE;
+    int *start = INTEGER(start_);
+    const int start_len = length(start_);
+    
+    PROTECT(text_ = AS_CHARACTER(text_));
+    text_t *text = ore_text(text_, FALSE);
+    regex_t *regex = ore_retrieve(regex_, text->encoding);
+    SEXP owner = PROTECT(ore_owner(regex, regex_, 0));
+    
+    if (start_len < 1)
+    {
+        ore_owner_release(owner);
+        error("The vector of starting positions is empty");
+    }
+    
+    ore_search_limits();
+    scratch_t *scratch = ore_scratch();
+    
+    SEXP results = PROTECT(NEW_INTEGER(text->length));
+    int *results_ptr = INTEGER(results);
+    
+    for (size_t i=0; i<text->length; i++)
+    {
+        ore_poll_interrupt(i, owner);
+        
+        const SEXP element = STRING_ELT(text_, i);
+        if (element == NA_STRING)
+        {
+            results_ptr[i] = keep_na ? NA_INTEGER : 0;
+            continue;
+        }
+        else if (!ore_consistent_encodings(ore_r_to_onig_enc(getCharCE(element)), regex->enc))
+        {
+            warning("Encoding of text element %lu does not match the regex", (unsigned long) i+1);
+            results_ptr[i] = 0;
+            continue;
+        }
+        
+        const char *string = CHAR(element);
+        const UChar *end_ptr = (const UChar *) string + LENGTH(element);
+        const Rboolean ascii = ore_string_ascii(element);
+        const UChar *start_ptr = ore_start_pointer(regex, string, end_ptr, ascii, (size_t) start[i % start_len] - 1);
+        
+        // No result pointer is passed, so matches are only counted
+        const OnigPosition n_matches = ore_search_native(regex, (const UChar *) string, end_ptr, start_ptr, ascii, TRUE, scratch, NULL);
+        ore_scratch_update(scratch);
+        if (n_matches < 0)
+        {
+            ore_owner_release(owner);
+            ore_search_error(n_matches);
+        }
+        results_ptr[i] = (int) n_matches;
+    }
+    
+    setAttrib(results, R_NamesSymbol, getAttrib(text_, R_NamesSymbol));
+    
+    ore_owner_release(owner);
+    
+    UNPROTECT(3);
+    return results;
+}
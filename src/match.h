@@ -12,25 +12,49 @@ typedef struct {
     int   * byte_offsets;
     int   * lengths;
     int   * byte_lengths;
-    char ** matches;
+    size_t  size;
 } rawmatch_t;
 
-rawmatch_t * ore_rawmatch_alloc (const int n_regions);
+typedef struct {
+    regex_t       * regex;
+    rawmatch_t   ** matches;
+    size_t          n_matches;
+} owner_t;
+
+rawmatch_t * ore_rawmatch_alloc (const int n_regions, const int capacity);
+
+Rboolean ore_rawmatch_extend (rawmatch_t *match);
 
-void ore_rawmatch_extend (rawmatch_t *match);
+void ore_rawmatch_free (rawmatch_t *match);
 
-void ore_rawmatch_store_string (rawmatch_t *match, const size_t loc, const char *string, const int length);
+SEXP ore_owner (regex_t *regex, SEXP regex_, const size_t n_matches);
 
-rawmatch_t * ore_search (regex_t *regex, const char *text, const char *text_end, const Rboolean all, const size_t start);
+rawmatch_t ** ore_owner_matches (SEXP owner_);
+
+void ore_owner_release (SEXP owner_);
+
+rawmatch_t * ore_search (regex_t *regex, const char *text, const char *text_end, const Rboolean ascii, const Rboolean all, const size_t start);
 
 void ore_int_vector (SEXP vec, const int *data, const int n_regions, const int n_matches, const int increment);
 
-void ore_char_vector (SEXP vec, const char **data, const int n_regions, const int n_matches, encoding_t *encoding);
+void ore_char_vector (SEXP vec, const char *text, const int *byte_offsets, const int *byte_lengths, const int n_regions, const int n_matches, encoding_t *encoding);
 
 void ore_int_matrix (SEXP mat, const int *data, const int n_regions, const int n_matches, const SEXP col_names, const int increment);
 
-void ore_char_matrix (SEXP mat, const char **data, const int n_regions, const int n_matches, const int index, const SEXP col_names, encoding_t *encoding);
+void ore_char_matrix (SEXP mat, const char *text, const int *byte_offsets, const int *byte_lengths, const int n_regions, const int n_matches, const int index, const SEXP col_names, encoding_t *encoding);
+
+void ore_search_error (const OnigPosition error_code);
+
+Rboolean ore_interrupt_pending (void);
+
+void ore_search_limits (void);
+
+void ore_poll_interrupt (const size_t i, SEXP owner_);
+
+SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simplify_, SEXP incremental_, SEXP threads_, SEXP table_);
+
+SEXP ore_ismatch_all (SEXP regex_, SEXP text_, SEXP start_, SEXP keep_na_);
 
-SEXP ore_search_all (SEXP regex_, SEXP text_, SEXP all_, SEXP start_, SEXP simplify_, SEXP incremental_);
+SEXP ore_count_all (SEXP regex_, SEXP text_, SEXP start_, SEXP keep_na_);
 
 #endif
@@ -178,6 +178,38 @@ code3_equal(const OnigCodePoint *x, const OnigCodePoint *y)
 
 #define CODE_RANGES_NUM numberof(CodeRanges)
 
+#ifdef USE_CODE_RANGE_TABLES
+/* bitmap tables for the standard ctypes, built by onig_init(), so that
+   testing \w, word boundaries and the like needs no binary search */
+static UChar* CtypeTables[ONIGENC_MAX_STD_CTYPE + 1];
+
+static void
+ctype_table_end(void)
+{
+  int ctype;
+
+  for (ctype = 0; ctype <= ONIGENC_MAX_STD_CTYPE; ctype++) {
+    if (IS_NOT_NULL(CtypeTables[ctype])) {
+      xfree(CtypeTables[ctype]);
+      CtypeTables[ctype] = (UChar* )NULL;
+    }
+  }
+}
+
+/* a ctype whose table can't be allocated falls back to its ranges */
+extern void
+onigenc_unicode_ctype_table_init(void)
+{
+  int ctype, size;
+
+  for (ctype = 0; ctype <= ONIGENC_MAX_STD_CTYPE; ctype++) {
+    if (IS_NULL(CtypeTables[ctype]))
+      onig_code_range_table_new(CodeRanges[ctype], &CtypeTables[ctype], &size);
+  }
+  onig_add_end_call(ctype_table_end);
+}
+#endif
+
 extern int
 onigenc_unicode_is_code_ctype(OnigCodePoint code, unsigned int ctype, OnigEncoding enc ARG_UNUSED)
 {
@@ -193,6 +225,11 @@ onigenc_unicode_is_code_ctype(OnigCodePoint code, unsigned int ctype, OnigEncodi
     return ONIGERR_TYPE_BUG;
   }
 
+#ifdef USE_CODE_RANGE_TABLES
+  if (ctype <= ONIGENC_MAX_STD_CTYPE && IS_NOT_NULL(CtypeTables[ctype]))
+    return onig_is_in_code_range_table(CtypeTables[ctype], code);
+#endif
+
   return onig_is_in_code_range((UChar* )CodeRanges[ctype], code);
 }
 
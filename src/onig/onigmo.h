@@ -469,7 +469,11 @@ typedef unsigned int        OnigOptionType;
 #define ONIG_OPTION_WORD_BOUND_ALL_RANGE    (ONIG_OPTION_POSIX_BRACKET_ALL_RANGE << 1)
 /* options (newline) */
 #define ONIG_OPTION_NEWLINE_CRLF         (ONIG_OPTION_WORD_BOUND_ALL_RANGE << 1)
-#define ONIG_OPTION_MAXBIT               ONIG_OPTION_NEWLINE_CRLF  /* limit */
+/* options (backtracking) */
+#define ONIG_OPTION_MATCH_CACHE          (ONIG_OPTION_NEWLINE_CRLF << 1)
+/* options (engine) */
+#define ONIG_OPTION_DFA                  (ONIG_OPTION_MATCH_CACHE << 1)
+#define ONIG_OPTION_MAXBIT               ONIG_OPTION_DFA  /* limit */
 
 #define ONIG_OPTION_ON(options,regopt)      ((options) |= (regopt))
 #define ONIG_OPTION_OFF(options,regopt)     ((options) &= ~(regopt))
@@ -634,6 +638,8 @@ ONIG_EXTERN const OnigSyntaxType*   OnigDefaultSyntax;
 #define ONIGERR_UNEXPECTED_BYTECODE                           -14
 #define ONIGERR_MATCH_STACK_LIMIT_OVER                        -15
 #define ONIGERR_PARSE_DEPTH_LIMIT_OVER                        -16
+#define ONIGERR_RETRY_LIMIT_IN_SEARCH_OVER                    -17
+#define ONIGERR_SEARCH_INTERRUPTED                            -18
 #define ONIGERR_DEFAULT_ENCODING_IS_NOT_SET                   -21
 #define ONIGERR_SPECIFIED_ENCODING_CANT_CONVERT_TO_WIDE_CHAR  -22
 /* general error */
@@ -731,6 +737,12 @@ struct re_registers {
 
 typedef struct re_registers   OnigRegion;
 
+/* backtrack stack kept between searches (see onig_search_with_stack) */
+typedef struct OnigMatchStackStruct  OnigMatchStack;
+
+/* lazy DFA states kept between searches (see onig_dfa_search) */
+typedef struct OnigDfaCacheStruct  OnigDfaCache;
+
 typedef struct {
   OnigEncoding enc;
   OnigUChar* par;
@@ -784,11 +796,33 @@ typedef struct re_pattern_buffer {
   unsigned char *exact;
   unsigned char *exact_end;
   unsigned char  map[ONIG_CHAR_TABLE_SIZE]; /* used as BM skip or char-map */
+  unsigned char  map_lo[16];   /* char-map buckets by low and high nibble, */
+  unsigned char  map_hi[16];   /* for scanning a block of text at once */
+  int            map_nibbles;  /* whether the buckets may be used */
   int           *reserved1;
   int           *reserved2;
   OnigDistance   dmin;                      /* min-distance of exact or map */
   OnigDistance   dmax;                      /* max-distance of exact or map */
 
+  /* how far from the start of a match the subject may be examined;
+     infinite if unbounded, or if the result depends on the search start */
+  OnigDistance   max_scan_len;
+
+  /* the pattern itself, if it can be searched for as a plain byte string;
+     set by the caller after compilation, and freed with the regex */
+  unsigned char *fixed;
+  unsigned char *fixed_end;
+
+  /* byte strings which every match contains, each preceded by its length */
+  unsigned char *required;
+  unsigned char *required_end;
+
+  /* a lazy DFA program, if the pattern has one (see ONIG_OPTION_DFA), and
+     the states made from it by searches that don't bring their own */
+  unsigned char *dfa;
+  unsigned char *dfa_end;
+  struct OnigDfaCacheStruct *dfa_cache;
+
   /* regex_t link chain */
   struct re_pattern_buffer* chain;  /* escape compile-conflict */
 } OnigRegexType;
@@ -839,8 +873,22 @@ OnigPosition onig_search(OnigRegex, const OnigUChar* str, const OnigUChar* end,
 ONIG_EXTERN
 OnigPosition onig_search_gpos(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* global_pos, const OnigUChar* start, const OnigUChar* range, OnigRegion* region, OnigOptionType option);
 ONIG_EXTERN
+OnigPosition onig_search_with_stack(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* start, const OnigUChar* range, OnigRegion* region, OnigOptionType option, OnigMatchStack* stack);
+ONIG_EXTERN
+OnigPosition onig_search_gpos_with_stack(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* global_pos, const OnigUChar* start, const OnigUChar* range, OnigRegion* region, OnigOptionType option, OnigMatchStack* stack);
+ONIG_EXTERN
+const OnigUChar* onig_search_end_start(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* start);
+ONIG_EXTERN
+OnigPosition onig_dfa_search(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* start, const OnigUChar* range, OnigRegion* region, OnigOptionType option, OnigDfaCache* cache, OnigMatchStack* stack);
+ONIG_EXTERN
+OnigPosition onig_dfa_search_backward(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* start, OnigRegion* region, OnigDfaCache* cache, OnigMatchStack* stack);
+ONIG_EXTERN
+OnigPosition onig_dfa_test(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* start, OnigDfaCache* cache);
+ONIG_EXTERN
 OnigPosition onig_match(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* at, OnigRegion* region, OnigOptionType option);
 ONIG_EXTERN
+OnigPosition onig_match_with_stack(OnigRegex, const OnigUChar* str, const OnigUChar* end, const OnigUChar* at, OnigRegion* region, OnigOptionType option, OnigMatchStack* stack);
+ONIG_EXTERN
 OnigRegion* onig_region_new(void);
 ONIG_EXTERN
 void onig_region_init(OnigRegion* region);
@@ -855,6 +903,18 @@ int onig_region_resize(OnigRegion* region, int n);
 ONIG_EXTERN
 int onig_region_set(OnigRegion* region, int at, int beg, int end);
 ONIG_EXTERN
+OnigMatchStack* onig_match_stack_new(void);
+ONIG_EXTERN
+void onig_match_stack_free(OnigMatchStack* stack);
+ONIG_EXTERN
+void onig_match_stack_clear(OnigMatchStack* stack);
+ONIG_EXTERN
+size_t onig_match_stack_size(const OnigMatchStack* stack);
+ONIG_EXTERN
+OnigDfaCache* onig_dfa_cache_new(void);
+ONIG_EXTERN
+void onig_dfa_cache_free(OnigDfaCache* cache);
+ONIG_EXTERN
 int onig_name_to_group_numbers(OnigRegex reg, const OnigUChar* name, const OnigUChar* name_end, int** nums);
 ONIG_EXTERN
 int onig_name_to_backref_number(OnigRegex reg, const OnigUChar* name, const OnigUChar* name_end, const OnigRegion *region);
@@ -863,6 +923,8 @@ int onig_foreach_name(OnigRegex reg, int (*func)(const OnigUChar*, const OnigUCh
 ONIG_EXTERN
 int onig_number_of_names(const OnigRegexType *reg);
 ONIG_EXTERN
+int onig_add_name(OnigRegex reg, const OnigUChar* name, const OnigUChar* name_end, int group_number);
+ONIG_EXTERN
 int onig_number_of_captures(const OnigRegexType *reg);
 ONIG_EXTERN
 int onig_number_of_capture_histories(const OnigRegexType *reg);
@@ -881,6 +943,10 @@ OnigCaseFoldType onig_get_case_fold_flag(const OnigRegexType *reg);
 ONIG_EXTERN
 const OnigSyntaxType* onig_get_syntax(const OnigRegexType *reg);
 ONIG_EXTERN
+int onig_get_exact_literal(OnigRegex reg, const OnigUChar** start, const OnigUChar** end);
+ONIG_EXTERN
+int onig_get_required_literal(OnigRegex reg, int n, const OnigUChar** start, const OnigUChar** end);
+ONIG_EXTERN
 int onig_set_default_syntax(const OnigSyntaxType* syntax);
 ONIG_EXTERN
 void onig_copy_syntax(OnigSyntaxType* to, const OnigSyntaxType* from);
@@ -913,6 +979,12 @@ unsigned int onig_get_match_stack_limit_size(void);
 ONIG_EXTERN
 int onig_set_match_stack_limit_size(unsigned int size);
 ONIG_EXTERN
+unsigned long onig_get_retry_limit_in_search(void);
+ONIG_EXTERN
+int onig_set_retry_limit_in_search(unsigned long n);
+ONIG_EXTERN
+int onig_set_search_interrupt_func(int (*func)(void));
+ONIG_EXTERN
 unsigned int onig_get_parse_depth_limit(void);
 ONIG_EXTERN
 int onig_set_parse_depth_limit(unsigned int depth);
@@ -155,7 +155,6 @@ onig_bbuf_init(BBuf* buf, OnigDistance size)
   return 0;
 }
 
-
 #ifdef USE_SUBEXP_CALL
 
 static int
@@ -556,27 +555,90 @@ compile_string_raw_node(StrNode* sn, regex_t* reg)
   return add_compile_string(sn->s, 1 /* sb */, sn->end - sn->s, reg, 0);
 }
 
+#ifdef USE_CODE_RANGE_TABLES
+/* classes with this many ranges carry a bitmap table after them */
+# define CODE_RANGE_TABLE_MIN_RANGES  8
+
+/* the table is built the first time it is needed, usually for the length
+   of the class, and kept in the node for when the class is emitted */
+static int
+cclass_code_range_table(CClassNode* cc, UChar** table, int* size)
+{
+  OnigCodePoint n;
+  int r;
+
+  if (cc->table_size < 0) {
+    GET_CODE_POINT(n, cc->mbuf->p);
+    if (n < CODE_RANGE_TABLE_MIN_RANGES)
+      cc->table_size = 0;
+    else {
+      r = onig_code_range_table_new((OnigCodePoint* )cc->mbuf->p,
+				    &cc->table, &cc->table_size);
+      if (r) {
+	cc->table_size = -1;
+	return r;
+      }
+    }
+  }
+
+  *table = cc->table;
+  *size = cc->table_size;
+  return 0;
+}
+#endif
+
 static int
-add_multi_byte_cclass(BBuf* mbuf, regex_t* reg)
+add_code_ranges(BBuf* mbuf, UChar* table, int table_size, regex_t* reg)
 {
+  int r;
+  OnigCodePoint n;
+
+  if (IS_NULL(table))
+    return add_bytes(reg, mbuf->p, mbuf->used);
+
+  GET_CODE_POINT(n, mbuf->p);
+  n |= CODE_RANGE_TABLE_FLAG;
+  r = add_bytes(reg, (UChar* )&n, SIZE_CODE_POINT);
+  if (r) return r;
+  r = add_bytes(reg, mbuf->p + SIZE_CODE_POINT, mbuf->used - SIZE_CODE_POINT);
+  if (r) return r;
+  return add_bytes(reg, table, table_size);
+}
+
+static int
+add_multi_byte_cclass(CClassNode* cc, regex_t* reg)
+{
+  BBuf* mbuf = cc->mbuf;
+  int r, table_size = 0;
+  UChar* table = (UChar* )NULL;
+#ifndef PLATFORM_UNALIGNED_WORD_ACCESS
+  int pad_size;
+  UChar* p;
+#endif
+
+#ifdef USE_CODE_RANGE_TABLES
+  r = cclass_code_range_table(cc, &table, &table_size);
+  if (r) return r;
+#endif
+
 #ifdef PLATFORM_UNALIGNED_WORD_ACCESS
-  add_length(reg, mbuf->used);
-  return add_bytes(reg, mbuf->p, mbuf->used);
+  add_length(reg, mbuf->used + table_size);
+  r = add_code_ranges(mbuf, table, table_size, reg);
 #else
-  int r, pad_size;
-  UChar* p = BBUF_GET_ADD_ADDRESS(reg) + SIZE_LENGTH;
+  p = BBUF_GET_ADD_ADDRESS(reg) + SIZE_LENGTH;
 
   GET_ALIGNMENT_PAD_SIZE(p, pad_size);
-  add_length(reg, mbuf->used + (WORD_ALIGNMENT_SIZE - 1));
+  add_length(reg, mbuf->used + table_size + (WORD_ALIGNMENT_SIZE - 1));
   if (pad_size != 0) add_bytes(reg, PadBuf, pad_size);
 
-  r = add_bytes(reg, mbuf->p, mbuf->used);
+  r = add_code_ranges(mbuf, table, table_size, reg);
 
   /* padding for return value from compile_length_cclass_node() to be fix. */
   pad_size = (WORD_ALIGNMENT_SIZE - 1) - pad_size;
   if (pad_size != 0) add_bytes(reg, PadBuf, pad_size);
-  return r;
 #endif
+
+  return r;
 }
 
 static int
@@ -588,6 +650,11 @@ compile_length_cclass_node(CClassNode* cc, regex_t* reg)
     len = SIZE_OPCODE + SIZE_BITSET;
   }
   else {
+#ifdef USE_CODE_RANGE_TABLES
+    int r, table_size;
+    UChar* table;
+#endif
+
     if (ONIGENC_MBC_MINLEN(reg->enc) > 1 || bitset_is_empty(cc->bs)) {
       len = SIZE_OPCODE;
     }
@@ -599,6 +666,12 @@ compile_length_cclass_node(CClassNode* cc, regex_t* reg)
 #else
     len += SIZE_LENGTH + cc->mbuf->used + (WORD_ALIGNMENT_SIZE - 1);
 #endif
+
+#ifdef USE_CODE_RANGE_TABLES
+    r = cclass_code_range_table(cc, &table, &table_size);
+    if (r) return r;
+    len += table_size;
+#endif
   }
 
   return len;
@@ -624,7 +697,7 @@ compile_cclass_node(CClassNode* cc, regex_t* reg)
       else
 	add_opcode(reg, OP_CCLASS_MB);
 
-      r = add_multi_byte_cclass(cc->mbuf, reg);
+      r = add_multi_byte_cclass(cc, reg);
     }
     else {
       if (IS_NCCLASS_NOT(cc))
@@ -634,7 +707,7 @@ compile_cclass_node(CClassNode* cc, regex_t* reg)
 
       r = add_bitset(reg, cc->bs);
       if (r) return r;
-      r = add_multi_byte_cclass(cc->mbuf, reg);
+      r = add_multi_byte_cclass(cc, reg);
     }
   }
 
@@ -2878,6 +2951,243 @@ check_type_tree(Node* node, int type_mask, int enclose_mask, int anchor_mask)
   return r;
 }
 
+/* Look-ahead and absent operators may examine text beyond the match, and
+   \G depends on the search start, so the scan length is unknown with them */
+#define ALLOWED_ENCLOSE_IN_SCAN \
+  ( ENCLOSE_MEMORY | ENCLOSE_OPTION | ENCLOSE_STOP_BACKTRACK | ENCLOSE_CONDITION )
+#define ALLOWED_ANCHOR_IN_SCAN \
+  ~( ANCHOR_PREC_READ | ANCHOR_PREC_READ_NOT | ANCHOR_BEGIN_POSITION )
+
+static int
+set_max_scan_len(regex_t* reg, Node* root, ScanEnv* env)
+{
+  OnigDistance max;
+  int r;
+
+  reg->max_scan_len = ONIG_INFINITE_DISTANCE;
+  r = check_type_tree(root, ~0, ALLOWED_ENCLOSE_IN_SCAN,
+		      ALLOWED_ANCHOR_IN_SCAN);
+  if (r < 0) return r;
+  if (r > 0) return 0;
+
+  /* leave the length unknown if it can't be worked out */
+  if (get_max_match_length(root, &max, env) != 0) return 0;
+
+  /* anchors such as \b, $ and \Z may look up to two characters past the
+     match, or check where the subject ends */
+  reg->max_scan_len = distance_add(max,
+		distance_multiply(ONIGENC_MBC_MAXLEN_DIST(reg->enc), 2));
+  return 0;
+}
+
+/* Required literals are byte strings which appear, case-sensitively, in the
+   text of every match. They are found by walking the tree in match order,
+   building up a run of fixed text which is cut wherever the text matched
+   may vary. Each run cut off is required. */
+#define REQ_LITERAL_MAX_NUM     8
+#define REQ_LITERAL_MAX_LEN     255   /* lengths are stored in one byte */
+#define REQ_LITERAL_MAX_REPEAT  8
+#define REQ_LITERAL_MAX_VISITS  10000
+
+typedef struct {
+  OnigEncoding enc;
+  UChar run[REQ_LITERAL_MAX_LEN];
+  int   run_len;
+  int   run_full;
+  UChar lits[REQ_LITERAL_MAX_NUM][REQ_LITERAL_MAX_LEN];
+  int   lit_lens[REQ_LITERAL_MAX_NUM];
+  int   num;
+  int   visits;
+} ReqLiteralEnv;
+
+static int
+req_literal_contains(const UChar* s, int len, const UChar* t, int tlen)
+{
+  int i;
+
+  for (i = 0; i + tlen <= len; i++) {
+    if (memcmp(s + i, t, tlen) == 0) return 1;
+  }
+  return 0;
+}
+
+static void
+req_literal_cut(ReqLiteralEnv* env)
+{
+  int i, len = env->run_len;
+
+  env->run_len  = 0;
+  env->run_full = 0;
+  if (len == 0) return;
+
+  /* a literal contained in another one is redundant */
+  for (i = 0; i < env->num; i++) {
+    if (req_literal_contains(env->lits[i], env->lit_lens[i], env->run, len))
+      return;
+  }
+  for (i = 0; i < env->num; ) {
+    if (req_literal_contains(env->run, len, env->lits[i], env->lit_lens[i])) {
+      env->num--;
+      xmemcpy(env->lits[i], env->lits[env->num], env->lit_lens[env->num]);
+      env->lit_lens[i] = env->lit_lens[env->num];
+    }
+    else
+      i++;
+  }
+
+  /* keep the longest literals, which should be the most selective */
+  i = env->num;
+  if (env->num == REQ_LITERAL_MAX_NUM) {
+    int j;
+    for (i = 0, j = 1; j < env->num; j++) {
+      if (env->lit_lens[j] < env->lit_lens[i]) i = j;
+    }
+    if (env->lit_lens[i] >= len) return;
+  }
+  else
+    env->num++;
+
+  xmemcpy(env->lits[i], env->run, len);
+  env->lit_lens[i] = len;
+}
+
+static void
+req_literal_append(ReqLiteralEnv* env, UChar* s, UChar* end)
+{
+  int len;
+
+  /* a run which is full is still required, but can't be extended */
+  while (s < end && ! env->run_full) {
+    len = enclen(env->enc, s, end);
+    if (len > end - s) len = (int )(end - s);
+    if (env->run_len + len > REQ_LITERAL_MAX_LEN) {
+      env->run_full = 1;
+      break;
+    }
+    xmemcpy(env->run + env->run_len, s, len);
+    env->run_len += len;
+    s += len;
+  }
+}
+
+static void
+req_literal_walk(Node* node, OnigOptionType options, ReqLiteralEnv* env)
+{
+  if (++env->visits > REQ_LITERAL_MAX_VISITS) {
+    req_literal_cut(env);
+    return;
+  }
+
+  switch (NTYPE(node)) {
+  case NT_LIST:
+    do {
+      req_literal_walk(NCAR(node), options, env);
+    } while (IS_NOT_NULL(node = NCDR(node)));
+    break;
+
+  case NT_STR:
+    if (IS_IGNORECASE(options) || NSTRING_IS_AMBIG(node))
+      req_literal_cut(env);
+    else
+      req_literal_append(env, NSTR(node)->s, NSTR(node)->end);
+    break;
+
+  case NT_QTFR:
+    {
+      QtfrNode* qn = NQTFR(node);
+      int i;
+
+      /* each required repetition is matched in turn */
+      for (i = 0; i < qn->lower && i < REQ_LITERAL_MAX_REPEAT; i++)
+	req_literal_walk(qn->target, options, env);
+      if (qn->lower != qn->upper || qn->lower > REQ_LITERAL_MAX_REPEAT)
+	req_literal_cut(env);
+    }
+    break;
+
+  case NT_ENCLOSE:
+    {
+      EncloseNode* en = NENCLOSE(node);
+
+      switch (en->type) {
+      case ENCLOSE_OPTION:
+	req_literal_walk(en->target, en->option, env);
+	break;
+      case ENCLOSE_MEMORY:
+      case ENCLOSE_STOP_BACKTRACK:
+	req_literal_walk(en->target, options, env);
+	break;
+      default:
+	req_literal_cut(env);
+	break;
+      }
+    }
+    break;
+
+  case NT_ANCHOR:
+    /* anchors and look-around match no text, so don't break up a run */
+    break;
+
+  default:
+    req_literal_cut(env);
+    break;
+  }
+}
+
+static int
+set_required_literals(regex_t* reg, Node* root)
+{
+  ReqLiteralEnv* env;
+  UChar* p;
+  int i, j, size;
+
+  env = (ReqLiteralEnv* )xmalloc(sizeof(ReqLiteralEnv));
+  CHECK_NULL_RETURN_MEMERR(env);
+  env->enc      = reg->enc;
+  env->run_len  = 0;
+  env->run_full = 0;
+  env->num      = 0;
+  env->visits   = 0;
+
+  req_literal_walk(root, reg->options, env);
+  req_literal_cut(env);
+
+  if (env->num == 0) {
+    xfree(env);
+    return 0;
+  }
+
+  size = 0;
+  for (i = 0; i < env->num; i++)
+    size += env->lit_lens[i] + 1;
+
+  reg->required = (UChar* )xmalloc(size);
+  if (IS_NULL(reg->required)) {
+    xfree(env);
+    return ONIGERR_MEMORY;
+  }
+
+  /* store the literals longest first, each preceded by its length */
+  p = reg->required;
+  while (env->num > 0) {
+    for (i = 0, j = 1; j < env->num; j++) {
+      if (env->lit_lens[j] > env->lit_lens[i]) i = j;
+    }
+    *p++ = (UChar )env->lit_lens[i];
+    xmemcpy(p, env->lits[i], env->lit_lens[i]);
+    p += env->lit_lens[i];
+
+    env->num--;
+    xmemcpy(env->lits[i], env->lits[env->num], env->lit_lens[env->num]);
+    env->lit_lens[i] = env->lit_lens[env->num];
+  }
+  reg->required_end = p;
+
+  xfree(env);
+  return 0;
+}
+
+
 #ifdef USE_SUBEXP_CALL
 
 # define RECURSION_EXIST       1
@@ -5269,6 +5579,63 @@ set_optimize_exact_info(regex_t* reg, OptExactInfo* e)
   return 0;
 }
 
+/* Split the char-map into up to eight buckets of bytes, by the set of low
+   nibbles that go with each high nibble, so that a byte may be in the map
+   only if the buckets of its low and high nibbles overlap. Any extra sets
+   share the last bucket, which then lets through some bytes not in the map,
+   so a byte found this way must still be checked against the map itself. */
+static void
+set_map_nibbles(regex_t* reg)
+{
+  unsigned int los[16], buckets[8];
+  int i, j, n;
+
+  xmemset(reg->map_lo, 0, sizeof(reg->map_lo));
+  xmemset(reg->map_hi, 0, sizeof(reg->map_hi));
+  reg->map_nibbles = 0;
+
+  /* a byte found by a scan must begin a character, so in UTF-8 the map
+     can't hold continuation bytes, and other multibyte encodings are out */
+  if (! ONIGENC_IS_SINGLEBYTE(reg->enc)) {
+    if (reg->enc != ONIG_ENCODING_UTF8) return;
+    for (i = 0x80; i < 0xc0; i++) {
+      if (reg->map[i] != 0) return;
+    }
+  }
+
+  for (i = 0; i < 16; i++) {
+    los[i] = 0;
+    for (j = 0; j < 16; j++) {
+      if (reg->map[i * 16 + j] != 0) los[i] |= 1U << j;
+    }
+  }
+
+  n = 0;
+  for (i = 0; i < 16; i++) {
+    if (los[i] == 0) continue;
+    for (j = 0; j < n; j++) {
+      if (buckets[j] == los[i]) break;
+    }
+    if (j == n) {
+      if (n < 8)
+	buckets[n++] = los[i];
+      else {
+	j = 7;
+	buckets[j] |= los[i];
+      }
+    }
+    reg->map_hi[i] |= (UChar )(1U << j);
+  }
+
+  for (j = 0; j < n; j++) {
+    for (i = 0; i < 16; i++) {
+      if ((buckets[j] & (1U << i)) != 0)
+	reg->map_lo[i] |= (UChar )(1U << j);
+    }
+  }
+  reg->map_nibbles = 1;
+}
+
 static void
 set_optimize_map_info(regex_t* reg, OptMapInfo* m)
 {
@@ -5276,6 +5643,7 @@ set_optimize_map_info(regex_t* reg, OptMapInfo* m)
 
   for (i = 0; i < ONIG_CHAR_TABLE_SIZE; i++)
     reg->map[i] = m->map[i];
+  set_map_nibbles(reg);
 
   reg->optimize   = ONIG_OPTIMIZE_MAP;
   reg->dmin       = m->mmd.min;
@@ -5322,9 +5690,11 @@ set_optimize_info_from_tree(Node* node, regex_t* reg, ScanEnv* scan_env)
     reg->anchor &= ~ANCHOR_ANYCHAR_STAR_ML;
 
   reg->anchor |= opt.anc.right_anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF |
-	ANCHOR_PREC_READ_NOT);
+	ANCHOR_END_LINE | ANCHOR_PREC_READ_NOT);
 
-  if (reg->anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF)) {
+  /* the search itself only uses the lengths for the end of the text, but
+     onig_search_end_start() also uses them for the end of a line */
+  if (reg->anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF | ANCHOR_END_LINE)) {
     reg->anchor_dmin = opt.len.min;
     reg->anchor_dmax = opt.len.max;
   }
@@ -5483,7 +5853,7 @@ print_optimize_info(FILE* f, regex_t* reg)
 
   fprintf(f, "optimize: %s\n", on[reg->optimize]);
   fprintf(f, "  anchor: "); print_anchor(f, reg->anchor);
-  if ((reg->anchor & ANCHOR_END_BUF_MASK) != 0)
+  if ((reg->anchor & (ANCHOR_END_BUF_MASK | ANCHOR_END_LINE)) != 0)
     print_distance_range(f, reg->anchor_dmin, reg->anchor_dmax);
   fprintf(f, "\n");
 
@@ -5536,6 +5906,10 @@ onig_free_body(regex_t* reg)
     if (IS_NOT_NULL(reg->p))                xfree(reg->p);
     if (IS_NOT_NULL(reg->exact))            xfree(reg->exact);
     if (IS_NOT_NULL(reg->repeat_range))     xfree(reg->repeat_range);
+    if (IS_NOT_NULL(reg->fixed))            xfree(reg->fixed);
+    if (IS_NOT_NULL(reg->required))         xfree(reg->required);
+    if (IS_NOT_NULL(reg->dfa))              xfree(reg->dfa);
+    if (IS_NOT_NULL(reg->dfa_cache))        onig_dfa_cache_free(reg->dfa_cache);
     if (IS_NOT_NULL(reg->chain))            onig_free(reg->chain);
 
 #ifdef USE_NAMED_GROUP
@@ -5553,6 +5927,47 @@ onig_free(regex_t* reg)
   }
 }
 
+/* Report the literal that the optimizer has found every match to contain.
+   Case-folded literals are not reported, since a plain byte comparison
+   can't find them. */
+extern int
+onig_get_exact_literal(regex_t* reg, const UChar** start, const UChar** end)
+{
+  switch (reg->optimize) {
+  case ONIG_OPTIMIZE_EXACT:
+  case ONIG_OPTIMIZE_EXACT_BM:
+  case ONIG_OPTIMIZE_EXACT_BM_NOT_REV:
+    if (IS_NOT_NULL(reg->exact) && reg->exact_end > reg->exact) {
+      *start = reg->exact;
+      *end   = reg->exact_end;
+      return 1;
+    }
+    break;
+  }
+  return 0;
+}
+
+/* The n-th (from zero) of the literals which every match must contain,
+   longest first. Returns zero once there are no more. */
+extern int
+onig_get_required_literal(regex_t* reg, int n, const UChar** start,
+			  const UChar** end)
+{
+  UChar* p = reg->required;
+
+  if (IS_NULL(p)) return 0;
+  while (p < reg->required_end) {
+    if (p + 1 + *p > reg->required_end) return 0;
+    if (n-- == 0) {
+      *start = p + 1;
+      *end   = p + 1 + *p;
+      return 1;
+    }
+    p += *p + 1;
+  }
+  return 0;
+}
+
 #ifdef RUBY
 size_t
 onig_memsize(const regex_t *reg)
@@ -5698,9 +6113,24 @@ onig_compile(regex_t* reg, const UChar* pattern, const UChar* pattern_end,
     reg->num_call = 0;
 #endif
 
+  /* the DFA is built from the tree as parsed, since setup_tree() adds
+     atomic groups that it can't handle */
+#ifdef USE_DFA
+  if (ONIG_IS_OPTION_ON(reg->options, ONIG_OPTION_DFA)) {
+    r = onig_dfa_compile(reg, root);
+    if (r != 0) goto err_unset;
+  }
+#endif
+
   r = setup_tree(root, reg, 0, &scan_env);
   if (r != 0) goto err_unset;
 
+  r = set_max_scan_len(reg, root, &scan_env);
+  if (r != 0) goto err_unset;
+
+  r = set_required_literals(reg, root);
+  if (r != 0) goto err_unset;
+
 #ifdef ONIG_DEBUG_PARSE_TREE
   print_tree(stderr, root);
 #endif
@@ -5844,6 +6274,15 @@ onig_reg_init(regex_t* reg, OnigOptionType option,
   (reg)->syntax           = syntax;
   (reg)->optimize         = 0;
   (reg)->exact            = (UChar* )NULL;
+  (reg)->map_nibbles      = 0;
+  (reg)->max_scan_len     = ONIG_INFINITE_DISTANCE;
+  (reg)->fixed            = (UChar* )NULL;
+  (reg)->fixed_end        = (UChar* )NULL;
+  (reg)->required         = (UChar* )NULL;
+  (reg)->required_end     = (UChar* )NULL;
+  (reg)->dfa              = (UChar* )NULL;
+  (reg)->dfa_end          = (UChar* )NULL;
+  (reg)->dfa_cache        = (OnigDfaCache* )NULL;
   (reg)->chain            = (regex_t* )NULL;
 
   (reg)->p                = (UChar* )NULL;
@@ -5912,6 +6351,13 @@ onig_init(void)
   onigenc_init();
   /* onigenc_set_default_caseconv_table((UChar* )0); */
 
+#ifdef USE_VECTOR_SEARCH
+  onig_vector_search_init();
+#endif
+#ifdef USE_CODE_RANGE_TABLES
+  onigenc_unicode_ctype_table_init();
+#endif
+
 #ifdef ONIG_DEBUG_STATISTICS
   onig_statistics_init();
 #endif
@@ -5969,6 +6415,116 @@ onig_end(void)
   return 0;
 }
 
+/* A code range table is a two-level bitmap: the number of blocks of 256
+   code points up to the last range, the index of a 256-bit leaf for each
+   block (as an unsigned short, padded to a whole number of code points),
+   and then the leaves themselves, each stored once however many blocks
+   share it. Lookup takes constant time, whatever the number of ranges. */
+#define CODE_RANGE_TABLE_MAX_CODE    0x10ffff
+#define CODE_RANGE_LEAF_WORDS        (256 / 32)
+#define CODE_RANGE_LEAF_SIZE         (CODE_RANGE_LEAF_WORDS * SIZE_CODE_POINT)
+
+/* The table is left NULL if the ranges reach beyond Unicode. */
+extern int
+onig_code_range_table_new(const OnigCodePoint* ranges, UChar** table,
+			  int* size)
+{
+  OnigCodePoint n, from, to, c, max, n_blocks, i;
+  OnigCodePoint *bits, *t;
+  unsigned short *leaves;
+  int *hash, n_hash, n_leaves, leaf, h, j;
+
+  *table = (UChar* )NULL;
+  *size = 0;
+  n = ranges[0] & ~CODE_RANGE_TABLE_FLAG;
+  if (n == 0) return 0;
+  max = ranges[n * 2];
+  if (max > CODE_RANGE_TABLE_MAX_CODE) return 0;
+
+  n_blocks = (max >> 8) + 1;
+  bits = (OnigCodePoint* )xcalloc(n_blocks * CODE_RANGE_LEAF_WORDS,
+				  SIZE_CODE_POINT);
+  leaves = (unsigned short* )xmalloc(n_blocks * sizeof(unsigned short));
+  for (n_hash = 16; (OnigCodePoint )n_hash < n_blocks * 2; n_hash *= 2);
+  hash = (int* )xmalloc(n_hash * sizeof(int));
+  if (IS_NULL(bits) || IS_NULL(leaves) || IS_NULL(hash)) {
+    if (IS_NOT_NULL(bits))  xfree(bits);
+    if (IS_NOT_NULL(leaves)) xfree(leaves);
+    if (IS_NOT_NULL(hash))  xfree(hash);
+    return ONIGERR_MEMORY;
+  }
+
+  for (i = 0; i < n; i++) {
+    from = ranges[i * 2 + 1];
+    to   = ranges[i * 2 + 2];
+    for (c = from; c <= to; ) {
+      if ((c & 31) == 0 && to - c >= 31) {
+	bits[c >> 5] = ~(OnigCodePoint )0;
+	c += 32;
+      }
+      else {
+	bits[c >> 5] |= (OnigCodePoint )1 << (c & 31);
+	c++;
+      }
+    }
+  }
+
+  /* share leaves between blocks with the same bits, compacting them in
+     place, since no leaf moves forwards */
+  for (j = 0; j < n_hash; j++) hash[j] = -1;
+  n_leaves = 0;
+  for (i = 0; i < n_blocks; i++) {
+    OnigCodePoint* b = bits + i * CODE_RANGE_LEAF_WORDS;
+    unsigned int x = 2166136261U;
+    for (j = 0; j < CODE_RANGE_LEAF_WORDS; j++)
+      x = (x ^ b[j]) * 16777619U;
+
+    for (h = x & (n_hash - 1); (leaf = hash[h]) >= 0; h = (h + 1) & (n_hash - 1)) {
+      if (memcmp(bits + leaf * CODE_RANGE_LEAF_WORDS, b,
+		  CODE_RANGE_LEAF_SIZE) == 0)
+	break;
+    }
+    if (leaf < 0) {
+      leaf = n_leaves++;
+      if ((OnigCodePoint )leaf != i)
+	xmemcpy(bits + leaf * CODE_RANGE_LEAF_WORDS, b, CODE_RANGE_LEAF_SIZE);
+      hash[h] = leaf;
+    }
+    leaves[i] = (unsigned short )leaf;
+  }
+
+  t = (OnigCodePoint* )xmalloc(SIZE_CODE_POINT
+			+ ((n_blocks + 1) / 2) * SIZE_CODE_POINT
+			+ n_leaves * CODE_RANGE_LEAF_SIZE);
+  if (IS_NOT_NULL(t)) {
+    t[0] = n_blocks;
+    t[(n_blocks + 1) / 2] = 0;   /* padding */
+    xmemcpy(t + 1, leaves, n_blocks * sizeof(unsigned short));
+    xmemcpy(t + 1 + (n_blocks + 1) / 2, bits, n_leaves * CODE_RANGE_LEAF_SIZE);
+    *table = (UChar* )t;
+    *size = SIZE_CODE_POINT + ((n_blocks + 1) / 2) * SIZE_CODE_POINT
+	  + n_leaves * CODE_RANGE_LEAF_SIZE;
+  }
+
+  xfree(bits);
+  xfree(leaves);
+  xfree(hash);
+  return IS_NULL(t) ? ONIGERR_MEMORY : 0;
+}
+
+extern int
+onig_is_in_code_range_table(const UChar* table, OnigCodePoint code)
+{
+  const OnigCodePoint* t = (const OnigCodePoint* )table;
+  const OnigCodePoint* leaf;
+  OnigCodePoint block = code >> 8;
+
+  if (block >= t[0]) return 0;
+  leaf = t + 1 + (t[0] + 1) / 2
+       + ((const unsigned short* )(t + 1))[block] * CODE_RANGE_LEAF_WORDS;
+  return (int )((leaf[(code >> 5) & 7] >> (code & 31)) & 1);
+}
+
 extern int
 onig_is_in_code_range(const UChar* p, OnigCodePoint code)
 {
@@ -5979,6 +6535,11 @@ onig_is_in_code_range(const UChar* p, OnigCodePoint code)
   data = (OnigCodePoint* )p;
   data++;
 
+  if ((n & CODE_RANGE_TABLE_FLAG) != 0) {
+    n &= ~CODE_RANGE_TABLE_FLAG;
+    return onig_is_in_code_range_table((const UChar* )(data + n * 2), code);
+  }
+
   for (low = 0, high = n; low < high; ) {
     x = (low + high) >> 1;
     if (code > data[x * 2 + 1])
@@ -6323,7 +6884,7 @@ onig_print_compiled_byte_code(FILE* f, UChar* bp, UChar* bpend, UChar** nextp,
 # endif
       GET_CODE_POINT(code, q);
       bp += len;
-      fprintf(f, ":%d:%d", (int )code, len);
+      fprintf(f, ":%d:%d", (int )(code & ~CODE_RANGE_TABLE_FLAG), len);
       break;
 
     case OP_CCLASS_MIX:
@@ -6337,7 +6898,7 @@ onig_print_compiled_byte_code(FILE* f, UChar* bp, UChar* bpend, UChar** nextp,
 # endif
       GET_CODE_POINT(code, q);
       bp += len;
-      fprintf(f, ":%d:%d:%d", n, (int )code, len);
+      fprintf(f, ":%d:%d:%d", n, (int )(code & ~CODE_RANGE_TABLE_FLAG), len);
       break;
 
     case OP_BACKREFN_IC:
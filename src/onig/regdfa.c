@@ -0,0 +1,1545 @@
+/**********************************************************************
+  regdfa.c -  Onigmo (Oniguruma-mod) (regular expression library)
+**********************************************************************/
+/*-
+ * Copyright (c) 2002-2008  K.Kosako  <sndgk393 AT ybb DOT ne DOT jp>
+ * Copyright (c) 2011-2016  K.Takata  <kentkt AT csc DOT jp>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A lazily built DFA, which finds the same matches as the backtracking
+   VM for patterns without backreferences, subexpression calls,
+   lookaround, atomic groups or absent operators.
+
+   The parse tree is compiled to a small NFA program twice: once as it
+   is, and once with every concatenation reversed. A DFA state is an
+   ordered list of program counters, and states are made from each other
+   one transition at a time as the text is scanned, then kept in a cache
+   of bounded size. A forward scan finds where the leftmost match ends,
+   keeping the VM's priorities between alternatives and quantifiers; a
+   reverse scan from there finds where it starts. Captures are left to
+   the VM, which only has to match at the start found.
+
+   Characters are mapped to classes, within which every character set
+   in the program and every assertion give the same answer, so that
+   each state needs one transition per class. Anything the DFA can't
+   handle (invalid text, characters with multi-character case folds,
+   or a cache that fills up too often) makes the search return
+   ONIG_NO_SUPPORT_CONFIG, and the caller uses the VM instead. */
+
+#include "regparse.h"
+
+#define DFA_MAX_INSTS           4096
+#define DFA_MAX_SETS             250
+#define DFA_MAX_CLASSES          250
+#define DFA_MAX_CODE        0x10ffff
+
+#define DFA_CACHE_LIMIT   (1024 * 1024)
+#define DFA_HASH_SIZE           1024
+
+/* while no match is under way, the VM's optimizer is used to skip ahead,
+   unless it has failed to skip this far this many times in a scan */
+#define DFA_MIN_SKIP               4
+#define DFA_MAX_SHORT_SKIPS       16
+
+/* after the cache has been filled, at least this many bytes of text must
+   have been scanned for each state made, or the search is given up */
+#define DFA_MIN_BYTES_PER_STATE   10
+
+#define DFA_INELIGIBLE            -1
+
+/* instructions */
+enum {
+  DOP_CHAR,    /* consume a character in set arg, then continue at next */
+  DOP_SPLIT,   /* continue at next, then (with lower priority) at alt */
+  DOP_JUMP,
+  DOP_ASSERT,  /* continue at next if anchor arg holds */
+  DOP_MATCH
+};
+
+typedef struct {
+  int op;
+  int arg;
+  int next;
+  int alt;
+} DfaInst;
+
+/* context of a position, as seen by assertions: the character on one
+   side of it, or the edge of the text */
+#define DFA_CTX_EDGE       (1<<0)
+#define DFA_CTX_NEWLINE    (1<<1)
+#define DFA_CTX_WORD       (1<<2)
+#define DFA_CTX_LAST       (1<<3)  /* a newline which ends the text */
+#define DFA_CTX_MASK       (DFA_CTX_EDGE | DFA_CTX_NEWLINE | DFA_CTX_WORD | DFA_CTX_LAST)
+
+/* a character the DFA can't match like the VM; only in class contexts */
+#define DFA_CTX_BAD        (1<<4)
+
+/* state flags, besides the context */
+#define DFA_STATE_STARTS   (1<<5)  /* a match may start at each position */
+#define DFA_STATE_REVERSE  (1<<6)
+
+typedef struct {
+  int size;            /* of the whole program, in bytes */
+  int utf8;
+  int n_insts;
+  int fwd_start;
+  int rev_start;
+  int n_sets;
+  int n_classes;
+  int n_bounds;        /* intervals of code points from 256 up */
+  int newline_class;
+  int last_newline;    /* whether a final newline is a symbol of its own */
+  int before_mask;     /* context which assertions look at behind a position */
+  int after_mask;      /* ... and ahead of it */
+  int insts_at;        /* offsets of the arrays that follow */
+  int bounds_at;
+  int bound_class_at;
+  int member_at;
+  int class_ctx_at;
+  UChar byte_class[256];
+} DfaProgram;
+
+#define DFA_INSTS(prog)       ((const DfaInst* )((const UChar* )(prog) + (prog)->insts_at))
+#define DFA_BOUNDS(prog)      ((const OnigCodePoint* )((const UChar* )(prog) + (prog)->bounds_at))
+#define DFA_BOUND_CLASS(prog) ((const UChar* )(prog) + (prog)->bound_class_at)
+#define DFA_MEMBER(prog)      ((const UChar* )(prog) + (prog)->member_at)
+#define DFA_CLASS_CTX(prog)   ((const UChar* )(prog) + (prog)->class_ctx_at)
+
+/* symbols are the classes, then these two */
+#define DFA_SYM_END(prog)     ((prog)->n_classes)
+#define DFA_SYM_LAST(prog)    ((prog)->n_classes + 1)
+#define DFA_N_SYMS(prog)      ((prog)->n_classes + 2)
+
+#define DFA_GIVE_UP           ONIG_NO_SUPPORT_CONFIG
+
+
+/* compilation */
+
+typedef struct {
+  OnigCodePoint* r;    /* from, to pairs, in order and not adjacent */
+  int n;
+  int alloc;
+} DfaRanges;
+
+typedef struct {
+  regex_t*       reg;
+  OnigEncoding   enc;
+  OnigOptionType options;
+  OnigCodePoint  max_code;
+  DfaInst*       insts;
+  int            n_insts;
+  int            alloc_insts;
+  DfaRanges      sets[DFA_MAX_SETS];
+  int            n_sets;
+  int            anchors;     /* ANCHOR_* types used */
+  int            word_ascii;  /* whether word boundaries are ASCII-only */
+  int            fold;        /* whether any string ignores case */
+} DfaBuilder;
+
+static int
+ranges_add(DfaRanges* rs, OnigCodePoint from, OnigCodePoint to)
+{
+  if (rs->n > 0 && from <= rs->r[rs->n * 2 - 1] + 1) {
+    if (to > rs->r[rs->n * 2 - 1]) rs->r[rs->n * 2 - 1] = to;
+    return 0;
+  }
+
+  if (rs->n >= rs->alloc) {
+    int alloc = (rs->alloc == 0 ? 8 : rs->alloc * 2);
+    OnigCodePoint* r = (OnigCodePoint* )xrealloc(rs->r, sizeof(OnigCodePoint) * 2 * alloc);
+    if (IS_NULL(r)) return ONIGERR_MEMORY;
+    rs->r = r;
+    rs->alloc = alloc;
+  }
+  rs->r[rs->n * 2]     = from;
+  rs->r[rs->n * 2 + 1] = to;
+  rs->n++;
+  return 0;
+}
+
+static int
+ranges_contain(const DfaRanges* rs, OnigCodePoint code)
+{
+  int low, high, x;
+
+  for (low = 0, high = rs->n; low < high; ) {
+    x = (low + high) >> 1;
+    if (code > rs->r[x * 2 + 1])
+      low = x + 1;
+    else
+      high = x;
+  }
+  return (low < rs->n && code >= rs->r[low * 2]);
+}
+
+/* add code points from 256 up, given as a list of ranges in Onigmo's
+   format, or the ones not in the list if "not" is set */
+static int
+ranges_add_high(DfaRanges* rs, const OnigCodePoint* list, int not,
+		OnigCodePoint max_code)
+{
+  OnigCodePoint n, i, from, to, next;
+  int r;
+
+  if (max_code < SINGLE_BYTE_SIZE) return 0;
+
+  n = (IS_NULL(list) ? 0 : list[0] & ~CODE_RANGE_TABLE_FLAG);
+  next = SINGLE_BYTE_SIZE;
+  for (i = 0; i < n; i++) {
+    from = list[i * 2 + 1];
+    to   = list[i * 2 + 2];
+    if (to < SINGLE_BYTE_SIZE) continue;
+    if (from < SINGLE_BYTE_SIZE) from = SINGLE_BYTE_SIZE;
+    if (to > max_code) to = max_code;
+    if (from > to) continue;
+
+    if (not) {
+      if (from > next) {
+	r = ranges_add(rs, next, from - 1);
+	if (r != 0) return r;
+      }
+    }
+    else {
+      r = ranges_add(rs, from, to);
+      if (r != 0) return r;
+    }
+    if (to + 1 > next) next = to + 1;
+  }
+
+  if (not && next <= max_code)
+    return ranges_add(rs, next, max_code);
+  return 0;
+}
+
+static void
+ranges_free(DfaRanges* rs)
+{
+  if (IS_NOT_NULL(rs->r)) xfree(rs->r);
+  rs->r = (OnigCodePoint* )NULL;
+  rs->n = rs->alloc = 0;
+}
+
+/* the word characters, as \w or \b sees them */
+static int
+word_ranges(DfaBuilder* b, DfaRanges* rs, int ascii, int not)
+{
+  OnigCodePoint c, sb_out;
+  const OnigCodePoint* list = (const OnigCodePoint* )NULL;
+  int r;
+
+  for (c = 0; c < SINGLE_BYTE_SIZE && c <= b->max_code; c++) {
+    int in = (ascii ? ONIGENC_IS_CODE_ASCII(c) && ONIGENC_IS_CODE_WORD(b->enc, c)
+		    : ONIGENC_IS_CODE_WORD(b->enc, c));
+    if ((in != 0) != (not != 0)) {
+      r = ranges_add(rs, c, c);
+      if (r != 0) return r;
+    }
+  }
+
+  if (b->max_code >= SINGLE_BYTE_SIZE && !ascii) {
+    r = ONIGENC_GET_CTYPE_CODE_RANGE(b->enc, ONIGENC_CTYPE_WORD, &sb_out, &list);
+    if (r != 0) return DFA_INELIGIBLE;
+  }
+  return ranges_add_high(rs, list, not, b->max_code);
+}
+
+/* find or add a set, taking ownership of its ranges */
+static int
+add_set(DfaBuilder* b, DfaRanges* rs)
+{
+  int i;
+
+  for (i = 0; i < b->n_sets; i++) {
+    if (b->sets[i].n == rs->n &&
+	(rs->n == 0 ||
+	 memcmp(b->sets[i].r, rs->r, sizeof(OnigCodePoint) * 2 * rs->n) == 0)) {
+      ranges_free(rs);
+      return i;
+    }
+  }
+
+  if (b->n_sets >= DFA_MAX_SETS) {
+    ranges_free(rs);
+    return DFA_INELIGIBLE;
+  }
+  b->sets[b->n_sets] = *rs;
+  return b->n_sets++;
+}
+
+static int
+add_inst(DfaBuilder* b, int op, int arg, int next, int alt)
+{
+  if (b->n_insts >= b->alloc_insts) {
+    int alloc = (b->alloc_insts == 0 ? 64 : b->alloc_insts * 2);
+    DfaInst* insts;
+
+    if (b->alloc_insts >= DFA_MAX_INSTS) return DFA_INELIGIBLE;
+    if (alloc > DFA_MAX_INSTS) alloc = DFA_MAX_INSTS;
+    insts = (DfaInst* )xrealloc(b->insts, sizeof(DfaInst) * alloc);
+    if (IS_NULL(insts)) return ONIGERR_MEMORY;
+    b->insts = insts;
+    b->alloc_insts = alloc;
+  }
+
+  b->insts[b->n_insts].op   = op;
+  b->insts[b->n_insts].arg  = arg;
+  b->insts[b->n_insts].next = next;
+  b->insts[b->n_insts].alt  = alt;
+  return b->n_insts++;
+}
+
+static int
+compare_codes(const void* a, const void* b)
+{
+  OnigCodePoint x = *(const OnigCodePoint* )a;
+  OnigCodePoint y = *(const OnigCodePoint* )b;
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/* the set matching one character of a string, with the characters it is
+   equal to when case is ignored; folds which change the length of the
+   text are left to the VM */
+static int
+char_set(DfaBuilder* b, const UChar* p, const UChar* end, int len, int fold)
+{
+  OnigCaseFoldCodeItem items[ONIGENC_GET_CASE_FOLD_CODES_MAX_NUM];
+  OnigCodePoint codes[ONIGENC_GET_CASE_FOLD_CODES_MAX_NUM + 1];
+  DfaRanges rs = { (OnigCodePoint* )NULL, 0, 0 };
+  int i, n, n_codes, r;
+
+  codes[0] = ONIGENC_MBC_TO_CODE(b->enc, p, end);
+  n_codes = 1;
+  if (fold) {
+    n = ONIGENC_GET_CASE_FOLD_CODES_BY_STR(b->enc, b->reg->case_fold_flag,
+					   p, end, items);
+    if (n < 0) return n;
+    for (i = 0; i < n; i++) {
+      if (items[i].byte_len != len || items[i].code_len != 1)
+	return DFA_INELIGIBLE;
+      codes[n_codes++] = items[i].code[0];
+    }
+    b->fold = 1;
+  }
+
+  qsort(codes, n_codes, sizeof(OnigCodePoint), compare_codes);
+  for (i = 0; i < n_codes; i++) {
+    r = ranges_add(&rs, codes[i], codes[i]);
+    if (r != 0) {
+      ranges_free(&rs);
+      return r;
+    }
+  }
+  return add_set(b, &rs);
+}
+
+static int
+cclass_set(DfaBuilder* b, CClassNode* cc)
+{
+  DfaRanges rs = { (OnigCodePoint* )NULL, 0, 0 };
+  const OnigCodePoint* list = (const OnigCodePoint* )NULL;
+  OnigCodePoint c;
+  int r = 0;
+
+  for (c = 0; c < SINGLE_BYTE_SIZE && c <= b->max_code && r == 0; c++) {
+    if (onig_is_code_in_cc(b->enc, c, cc))
+      r = ranges_add(&rs, c, c);
+  }
+
+  if (r == 0) {
+    if (IS_NOT_NULL(cc->mbuf))
+      list = (const OnigCodePoint* )cc->mbuf->p;
+    r = ranges_add_high(&rs, list, IS_NCCLASS_NOT(cc), b->max_code);
+  }
+  if (r != 0) {
+    ranges_free(&rs);
+    return r;
+  }
+  return add_set(b, &rs);
+}
+
+static int
+ctype_set(DfaBuilder* b, CtypeNode* ct)
+{
+  DfaRanges rs = { (OnigCodePoint* )NULL, 0, 0 };
+  int r;
+
+  if (ct->ctype != ONIGENC_CTYPE_WORD) return DFA_INELIGIBLE;
+
+  r = word_ranges(b, &rs, ct->ascii_range, ct->not);
+  if (r != 0) {
+    ranges_free(&rs);
+    return r;
+  }
+  return add_set(b, &rs);
+}
+
+static int
+any_set(DfaBuilder* b)
+{
+  DfaRanges rs = { (OnigCodePoint* )NULL, 0, 0 };
+  int r;
+
+  if (IS_MULTILINE(b->options))
+    r = ranges_add(&rs, 0, b->max_code);
+  else {
+    r = ranges_add(&rs, 0, 0x09);
+    if (r == 0) r = ranges_add(&rs, 0x0b, b->max_code);
+  }
+  if (r != 0) {
+    ranges_free(&rs);
+    return r;
+  }
+  return add_set(b, &rs);
+}
+
+static int
+is_nullable(Node* node)
+{
+  switch (NTYPE(node)) {
+  case NT_STR:
+    return NSTR(node)->end == NSTR(node)->s;
+
+  case NT_CCLASS:
+  case NT_CTYPE:
+  case NT_CANY:
+    return 0;
+
+  case NT_QTFR:
+    return NQTFR(node)->lower == 0 || is_nullable(NQTFR(node)->target);
+
+  case NT_ENCLOSE:
+    return IS_NULL(NENCLOSE(node)->target) || is_nullable(NENCLOSE(node)->target);
+
+  case NT_LIST:
+    do {
+      if (!is_nullable(NCAR(node))) return 0;
+    } while (IS_NOT_NULL(node = NCDR(node)));
+    return 1;
+
+  case NT_ALT:
+    do {
+      if (is_nullable(NCAR(node))) return 1;
+    } while (IS_NOT_NULL(node = NCDR(node)));
+    return 0;
+
+  default:
+    return 1;
+  }
+}
+
+static int compile_node(DfaBuilder* b, Node* node, int next, int reverse);
+
+/* characters are compiled last first, so that each continues at the
+   one after it (or before it, in reverse) */
+static int
+compile_string(DfaBuilder* b, Node* node, int next, int reverse)
+{
+  StrNode* sn = NSTR(node);
+  const UChar* p;
+  int fold, len, set, n, i;
+  int* offsets;
+
+  if (NSTRING_IS_AMBIG(node)) return DFA_INELIGIBLE;
+  fold = IS_IGNORECASE(b->options) && !NSTRING_IS_RAW(node);
+
+  n = 0;
+  for (p = sn->s; p < sn->end; p += enclen(b->enc, p, sn->end)) n++;
+  if (n == 0) return next;
+  if (n > DFA_MAX_INSTS) return DFA_INELIGIBLE;
+
+  offsets = (int* )xmalloc(sizeof(int) * n);
+  if (IS_NULL(offsets)) return ONIGERR_MEMORY;
+  for (i = 0, p = sn->s; p < sn->end; p += enclen(b->enc, p, sn->end))
+    offsets[i++] = (int )(p - sn->s);
+
+  for (i = 0; i < n && next >= 0; i++) {
+    int k = (reverse ? i : n - 1 - i);
+    p = sn->s + offsets[k];
+    len = (k + 1 < n ? offsets[k + 1] : (int )(sn->end - sn->s)) - offsets[k];
+    set = char_set(b, p, sn->end, len, fold);
+    next = (set < 0 ? set : add_inst(b, DOP_CHAR, set, next, 0));
+  }
+
+  xfree(offsets);
+  return next;
+}
+
+static int
+compile_quantifier(DfaBuilder* b, QtfrNode* qn, int next, int reverse)
+{
+  int i, entry, body, loop;
+
+  if (qn->upper == 0) return next;
+  if ((IS_REPEAT_INFINITE(qn->upper) || qn->upper > 1) && is_nullable(qn->target))
+    return DFA_INELIGIBLE;
+
+  if (IS_REPEAT_INFINITE(qn->upper)) {
+    /* the split is filled in once the body is compiled */
+    loop = add_inst(b, DOP_SPLIT, 0, next, next);
+    if (loop < 0) return loop;
+    body = compile_node(b, qn->target, loop, reverse);
+    if (body < 0) return body;
+    if (qn->greedy)
+      b->insts[loop].next = body;
+    else
+      b->insts[loop].alt = body;
+
+    /* one copy of the body comes before the loop, if it's required */
+    entry = (qn->lower > 0 ? body : loop);
+    for (i = 1; i < qn->lower && entry >= 0; i++)
+      entry = compile_node(b, qn->target, entry, reverse);
+    return entry;
+  }
+
+  entry = next;
+  for (i = qn->lower; i < qn->upper && entry >= 0; i++) {
+    body = compile_node(b, qn->target, entry, reverse);
+    if (body < 0) return body;
+    entry = (qn->greedy ? add_inst(b, DOP_SPLIT, 0, body, next)
+			: add_inst(b, DOP_SPLIT, 0, next, body));
+  }
+  for (i = 0; i < qn->lower && entry >= 0; i++)
+    entry = compile_node(b, qn->target, entry, reverse);
+  return entry;
+}
+
+static int
+compile_anchor(DfaBuilder* b, AnchorNode* an, int next)
+{
+  switch (an->type) {
+  case ANCHOR_WORD_BOUND:
+  case ANCHOR_NOT_WORD_BOUND:
+    /* context has room for one kind of word character */
+    if ((b->anchors & (ANCHOR_WORD_BOUND | ANCHOR_NOT_WORD_BOUND)) != 0 &&
+	b->word_ascii != (an->ascii_range != 0))
+      return DFA_INELIGIBLE;
+    b->word_ascii = (an->ascii_range != 0);
+    /* fall through */
+  case ANCHOR_BEGIN_BUF:
+  case ANCHOR_BEGIN_LINE:
+  case ANCHOR_END_BUF:
+  case ANCHOR_SEMI_END_BUF:
+  case ANCHOR_END_LINE:
+    b->anchors |= an->type;
+    return add_inst(b, DOP_ASSERT, an->type, next, 0);
+
+  default:
+    return DFA_INELIGIBLE;
+  }
+}
+
+static int
+compile_node(DfaBuilder* b, Node* node, int next, int reverse)
+{
+  int set, entry;
+
+  switch (NTYPE(node)) {
+  case NT_STR:
+    return compile_string(b, node, next, reverse);
+
+  case NT_CCLASS:
+    set = cclass_set(b, NCCLASS(node));
+    return (set < 0 ? set : add_inst(b, DOP_CHAR, set, next, 0));
+
+  case NT_CTYPE:
+    set = ctype_set(b, NCTYPE(node));
+    return (set < 0 ? set : add_inst(b, DOP_CHAR, set, next, 0));
+
+  case NT_CANY:
+    set = any_set(b);
+    return (set < 0 ? set : add_inst(b, DOP_CHAR, set, next, 0));
+
+  case NT_QTFR:
+    return compile_quantifier(b, NQTFR(node), next, reverse);
+
+  case NT_ENCLOSE:
+    {
+      EncloseNode* en = NENCLOSE(node);
+
+      if (IS_NULL(en->target)) return next;
+      if (en->type == ENCLOSE_MEMORY)
+	return compile_node(b, en->target, next, reverse);
+      else if (en->type == ENCLOSE_OPTION) {
+	OnigOptionType options = b->options;
+	b->options = en->option;
+	entry = compile_node(b, en->target, next, reverse);
+	b->options = options;
+	return entry;
+      }
+      return DFA_INELIGIBLE;
+    }
+
+  case NT_ANCHOR:
+    return compile_anchor(b, NANCHOR(node), next);
+
+  case NT_LIST:
+    /* the rest of the list follows the first element, or precedes it in
+       reverse */
+    if (reverse) {
+      entry = compile_node(b, NCAR(node), next, reverse);
+      if (entry < 0 || IS_NULL(NCDR(node))) return entry;
+      return compile_node(b, NCDR(node), entry, reverse);
+    }
+    else {
+      entry = next;
+      if (IS_NOT_NULL(NCDR(node)))
+	entry = compile_node(b, NCDR(node), next, reverse);
+      return (entry < 0 ? entry : compile_node(b, NCAR(node), entry, reverse));
+    }
+
+  case NT_ALT:
+    {
+      int first = compile_node(b, NCAR(node), next, reverse);
+      if (first < 0 || IS_NULL(NCDR(node))) return first;
+      entry = compile_node(b, NCDR(node), next, reverse);
+      return (entry < 0 ? entry : add_inst(b, DOP_SPLIT, 0, first, entry));
+    }
+
+  default:
+    return DFA_INELIGIBLE;
+  }
+}
+
+typedef struct {
+  OnigCodePoint* c;
+  int n;
+  int alloc;
+} DfaCodes;
+
+/* collect the characters whose case fold is more than one character long */
+static int
+add_multi_fold(OnigCodePoint from, OnigCodePoint* to, int to_len, void* arg)
+{
+  DfaCodes* codes = (DfaCodes* )arg;
+
+  if (to_len < 2) return 0;
+  if (codes->n >= codes->alloc) {
+    int alloc = (codes->alloc == 0 ? 64 : codes->alloc * 2);
+    OnigCodePoint* c = (OnigCodePoint* )xrealloc(codes->c, sizeof(OnigCodePoint) * alloc);
+    if (IS_NULL(c)) return ONIGERR_MEMORY;
+    codes->c = c;
+    codes->alloc = alloc;
+  }
+  codes->c[codes->n++] = from;
+  return 0;
+}
+
+static int
+multi_fold_ranges(DfaBuilder* b, DfaRanges* rs)
+{
+  DfaCodes codes = { (OnigCodePoint* )NULL, 0, 0 };
+  int i, r;
+
+  r = ONIGENC_APPLY_ALL_CASE_FOLD(b->enc, b->reg->case_fold_flag,
+				  add_multi_fold, &codes);
+  if (r == 0 && codes.n > 0) {
+    qsort(codes.c, codes.n, sizeof(OnigCodePoint), compare_codes);
+    for (i = 0; i < codes.n && r == 0; i++) {
+      if (codes.c[i] <= b->max_code)
+	r = ranges_add(rs, codes.c[i], codes.c[i]);
+    }
+  }
+  if (IS_NOT_NULL(codes.c)) xfree(codes.c);
+  return r;
+}
+
+static int
+add_cuts(OnigCodePoint* cuts, int n, const DfaRanges* rs)
+{
+  int i;
+
+  for (i = 0; i < rs->n; i++) {
+    cuts[n++] = rs->r[i * 2];
+    cuts[n++] = rs->r[i * 2 + 1] + 1;
+  }
+  return n;
+}
+
+/* divide the characters into classes, and lay out the program */
+static int
+make_program(DfaBuilder* b, int fwd_start, int rev_start,
+	     const DfaRanges* word, const DfaRanges* bad)
+{
+  OnigCodePoint* cuts;
+  UChar* sigs = (UChar* )NULL;
+  UChar* interval_class = (UChar* )NULL;
+  DfaProgram* prog;
+  DfaInst* insts;
+  OnigCodePoint* bounds;
+  UChar *bound_class, *member, *class_ctx;
+  int i, j, k, n_cuts, n_intervals, n_classes, n_bounds, sig_len, size, r;
+
+  n_cuts = 4 + 2 * (word->n + bad->n);
+  for (i = 0; i < b->n_sets; i++) n_cuts += 2 * b->sets[i].n;
+  cuts = (OnigCodePoint* )xmalloc(sizeof(OnigCodePoint) * n_cuts);
+  if (IS_NULL(cuts)) return ONIGERR_MEMORY;
+
+  /* newlines are a class of their own, since assertions treat them so */
+  n_cuts = 0;
+  cuts[n_cuts++] = 0;
+  cuts[n_cuts++] = 0x0a;
+  cuts[n_cuts++] = 0x0b;
+  if (b->max_code >= SINGLE_BYTE_SIZE) cuts[n_cuts++] = SINGLE_BYTE_SIZE;
+  for (i = 0; i < b->n_sets; i++) n_cuts = add_cuts(cuts, n_cuts, &b->sets[i]);
+  n_cuts = add_cuts(cuts, n_cuts, word);
+  n_cuts = add_cuts(cuts, n_cuts, bad);
+
+  qsort(cuts, n_cuts, sizeof(OnigCodePoint), compare_codes);
+  for (i = 0, n_intervals = 0; i < n_cuts && cuts[i] <= b->max_code; i++) {
+    if (n_intervals == 0 || cuts[i] != cuts[n_intervals - 1])
+      cuts[n_intervals++] = cuts[i];
+  }
+
+  /* a class's signature is whether it's in each set, then its context */
+  sig_len = b->n_sets + 1;
+  sigs = (UChar* )xmalloc(sig_len * (DFA_MAX_CLASSES + 1));
+  interval_class = (UChar* )xmalloc(n_intervals);
+  if (IS_NULL(sigs) || IS_NULL(interval_class)) {
+    r = ONIGERR_MEMORY;
+    goto end;
+  }
+
+  n_classes = 0;
+  for (i = 0; i < n_intervals; i++) {
+    OnigCodePoint code = cuts[i];
+    UChar* sig = sigs + n_classes * sig_len;
+
+    for (j = 0; j < b->n_sets; j++)
+      sig[j] = (UChar )ranges_contain(&b->sets[j], code);
+    sig[b->n_sets] = (UChar )((code == 0x0a ? DFA_CTX_NEWLINE : 0) |
+			      (ranges_contain(word, code) ? DFA_CTX_WORD : 0) |
+			      (ranges_contain(bad, code) ? DFA_CTX_BAD : 0));
+
+    for (k = 0; k < n_classes; k++) {
+      if (memcmp(sigs + k * sig_len, sig, sig_len) == 0) break;
+    }
+    if (k == n_classes) {
+      if (n_classes >= DFA_MAX_CLASSES) {
+	r = DFA_INELIGIBLE;
+	goto end;
+      }
+      n_classes++;
+    }
+    interval_class[i] = (UChar )k;
+  }
+
+  /* intervals from 256 up are merged where they share a class */
+  n_bounds = 0;
+  for (i = 0; i < n_intervals; i++) {
+    if (cuts[i] >= SINGLE_BYTE_SIZE &&
+	(n_bounds == 0 || interval_class[i] != interval_class[i - 1]))
+      n_bounds++;
+  }
+
+  size = sizeof(DfaProgram);
+  size += sizeof(DfaInst) * b->n_insts;
+  size += sizeof(OnigCodePoint) * n_bounds;
+  size += n_bounds + b->n_sets * n_classes + n_classes;
+  size = (size + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+  prog = (DfaProgram* )xcalloc(1, size);
+  if (IS_NULL(prog)) {
+    r = ONIGERR_MEMORY;
+    goto end;
+  }
+
+  prog->size           = size;
+  prog->utf8           = (b->max_code >= SINGLE_BYTE_SIZE);
+  prog->n_insts        = b->n_insts;
+  prog->fwd_start      = fwd_start;
+  prog->rev_start      = rev_start;
+  prog->n_sets         = b->n_sets;
+  prog->n_classes      = n_classes;
+  prog->n_bounds       = n_bounds;
+  prog->last_newline   = (b->anchors & ANCHOR_SEMI_END_BUF) != 0;
+  prog->insts_at       = sizeof(DfaProgram);
+  prog->bounds_at      = prog->insts_at + sizeof(DfaInst) * b->n_insts;
+  prog->bound_class_at = prog->bounds_at + sizeof(OnigCodePoint) * n_bounds;
+  prog->member_at      = prog->bound_class_at + n_bounds;
+  prog->class_ctx_at   = prog->member_at + b->n_sets * n_classes;
+
+  if (b->anchors & ANCHOR_BEGIN_BUF)
+    prog->before_mask |= DFA_CTX_EDGE;
+  if (b->anchors & ANCHOR_BEGIN_LINE) {
+    prog->before_mask |= DFA_CTX_EDGE | DFA_CTX_NEWLINE;
+    prog->after_mask  |= DFA_CTX_EDGE;
+  }
+  if (b->anchors & ANCHOR_END_BUF)
+    prog->after_mask |= DFA_CTX_EDGE;
+  if (b->anchors & ANCHOR_SEMI_END_BUF)
+    prog->after_mask |= DFA_CTX_EDGE | DFA_CTX_LAST;
+  if (b->anchors & ANCHOR_END_LINE)
+    prog->after_mask |= DFA_CTX_EDGE | DFA_CTX_NEWLINE;
+  if (b->anchors & (ANCHOR_WORD_BOUND | ANCHOR_NOT_WORD_BOUND)) {
+    prog->before_mask |= DFA_CTX_WORD;
+    prog->after_mask  |= DFA_CTX_WORD;
+  }
+
+  insts = (DfaInst* )((UChar* )prog + prog->insts_at);
+  xmemcpy(insts, b->insts, sizeof(DfaInst) * b->n_insts);
+
+  bounds      = (OnigCodePoint* )((UChar* )prog + prog->bounds_at);
+  bound_class = (UChar* )prog + prog->bound_class_at;
+  member      = (UChar* )prog + prog->member_at;
+  class_ctx   = (UChar* )prog + prog->class_ctx_at;
+
+  for (i = 0, n_bounds = 0; i < n_intervals; i++) {
+    OnigCodePoint code, last;
+
+    if (cuts[i] < SINGLE_BYTE_SIZE) {
+      last = (i + 1 < n_intervals ? cuts[i + 1] : b->max_code + 1);
+      for (code = cuts[i]; code < last && code < SINGLE_BYTE_SIZE; code++)
+	prog->byte_class[code] = interval_class[i];
+    }
+    else if (n_bounds == 0 || interval_class[i] != interval_class[i - 1]) {
+      bounds[n_bounds] = cuts[i];
+      bound_class[n_bounds] = interval_class[i];
+      n_bounds++;
+    }
+  }
+  prog->newline_class = prog->byte_class[0x0a];
+
+  for (k = 0; k < n_classes; k++) {
+    for (j = 0; j < b->n_sets; j++)
+      member[j * n_classes + k] = sigs[k * sig_len + j];
+    class_ctx[k] = sigs[k * sig_len + b->n_sets];
+  }
+
+  b->reg->dfa     = (UChar* )prog;
+  b->reg->dfa_end = (UChar* )prog + size;
+  r = 0;
+
+ end:
+  xfree(cuts);
+  if (IS_NOT_NULL(sigs)) xfree(sigs);
+  if (IS_NOT_NULL(interval_class)) xfree(interval_class);
+  return r;
+}
+
+/* compile a DFA program from a pattern's parse tree, before it is
+   rewritten for the VM; patterns which aren't eligible are left without
+   one, so only running out of memory is an error */
+extern int
+onig_dfa_compile(regex_t* reg, Node* root)
+{
+  DfaBuilder b;
+  DfaRanges word = { (OnigCodePoint* )NULL, 0, 0 };
+  DfaRanges bad  = { (OnigCodePoint* )NULL, 0, 0 };
+  int i, r, match, fwd_start, rev_start;
+
+  if (reg->enc != ONIG_ENCODING_UTF8 && ONIGENC_MBC_MAXLEN(reg->enc) != 1)
+    return 0;
+  if ((reg->options & (ONIG_OPTION_FIND_LONGEST | ONIG_OPTION_FIND_NOT_EMPTY |
+		       ONIG_OPTION_NEWLINE_CRLF | ONIG_OPTION_NOTBOL |
+		       ONIG_OPTION_NOTEOL | ONIG_OPTION_NOTBOS |
+		       ONIG_OPTION_NOTEOS)) != 0)
+    return 0;
+
+  xmemset(&b, 0, sizeof(b));
+  b.reg      = reg;
+  b.enc      = reg->enc;
+  b.options  = reg->options;
+  b.max_code = (reg->enc == ONIG_ENCODING_UTF8 ? DFA_MAX_CODE : SINGLE_BYTE_SIZE - 1);
+
+  match = add_inst(&b, DOP_MATCH, 0, 0, 0);
+  r = fwd_start = (match < 0 ? match : compile_node(&b, root, match, 0));
+  if (r >= 0) {
+    b.options = reg->options;
+    match = add_inst(&b, DOP_MATCH, 0, 0, 0);
+    r = rev_start = (match < 0 ? match : compile_node(&b, root, match, 1));
+  }
+
+  if (r >= 0 && (b.anchors & (ANCHOR_WORD_BOUND | ANCHOR_NOT_WORD_BOUND)) != 0)
+    r = word_ranges(&b, &word, b.word_ascii, 0);
+  if (r >= 0 && b.fold)
+    r = multi_fold_ranges(&b, &bad);
+  if (r >= 0)
+    r = make_program(&b, fwd_start, rev_start, &word, &bad);
+
+  for (i = 0; i < b.n_sets; i++) ranges_free(&b.sets[i]);
+  ranges_free(&word);
+  ranges_free(&bad);
+  if (IS_NOT_NULL(b.insts)) xfree(b.insts);
+
+  return (r == ONIGERR_MEMORY ? r : 0);
+}
+
+
+/* searching */
+
+typedef struct DfaState {
+  struct DfaState*  link;     /* next state in the same hash bucket */
+  unsigned int      hash;
+  int               flags;
+  int               n;        /* number of program counters */
+  int               dead;     /* 1 if no match can follow, 2 to give up */
+  int               idle;     /* waiting for a match to start */
+  struct DfaState** next;     /* by symbol; NULL until made */
+  UChar*            matched;  /* by symbol: whether a match ends before it */
+  int*              pcs;      /* in priority order */
+} DfaState;
+
+/* where transitions on characters the DFA can't handle lead */
+static DfaState DfaGiveUp = {
+  (DfaState* )NULL, 0, 0, 0, 2, 0, (DfaState** )NULL, (UChar* )NULL, (int* )NULL
+};
+
+struct OnigDfaCacheStruct {
+  const DfaProgram* prog;     /* the program the states were made from */
+  DfaState*     table[DFA_HASH_SIZE];
+  size_t        size;         /* bytes allocated for states */
+  int           n_states;
+  int           made;         /* states made since the scan started or the cache was reset */
+  long          reset_pos;    /* how far the scan had got when the cache was last reset */
+  unsigned int  stamp;        /* marks program counters already seen in a closure */
+  unsigned int* visited;
+  unsigned int* listed;
+  int*          stack;
+  int*          list;
+};
+
+extern OnigDfaCache*
+onig_dfa_cache_new(void)
+{
+  return (OnigDfaCache* )xcalloc(1, sizeof(OnigDfaCache));
+}
+
+static void
+dfa_cache_clear(OnigDfaCache* cache)
+{
+  DfaState *s, *link;
+  int i;
+
+  for (i = 0; i < DFA_HASH_SIZE; i++) {
+    for (s = cache->table[i]; IS_NOT_NULL(s); s = link) {
+      link = s->link;
+      xfree(s);
+    }
+    cache->table[i] = (DfaState* )NULL;
+  }
+  cache->size = 0;
+  cache->n_states = 0;
+}
+
+static void
+dfa_cache_free_work(OnigDfaCache* cache)
+{
+  if (IS_NOT_NULL(cache->visited)) xfree(cache->visited);
+  if (IS_NOT_NULL(cache->listed))  xfree(cache->listed);
+  if (IS_NOT_NULL(cache->stack))   xfree(cache->stack);
+  if (IS_NOT_NULL(cache->list))    xfree(cache->list);
+  cache->visited = cache->listed = (unsigned int* )NULL;
+  cache->stack = cache->list = (int* )NULL;
+  cache->prog = (const DfaProgram* )NULL;
+}
+
+extern void
+onig_dfa_cache_free(OnigDfaCache* cache)
+{
+  if (IS_NULL(cache)) return;
+  dfa_cache_clear(cache);
+  dfa_cache_free_work(cache);
+  xfree(cache);
+}
+
+/* make a cache ready for a program, dropping states made from another */
+static int
+dfa_cache_bind(OnigDfaCache* cache, const DfaProgram* prog)
+{
+  if (cache->prog == prog) return 0;
+
+  dfa_cache_clear(cache);
+  dfa_cache_free_work(cache);
+  cache->visited = (unsigned int* )xcalloc(prog->n_insts, sizeof(unsigned int));
+  cache->listed  = (unsigned int* )xcalloc(prog->n_insts, sizeof(unsigned int));
+  cache->stack   = (int* )xmalloc(sizeof(int) * (2 * prog->n_insts + 2));
+  cache->list    = (int* )xmalloc(sizeof(int) * (prog->n_insts + 1));
+  if (IS_NULL(cache->visited) || IS_NULL(cache->listed) ||
+      IS_NULL(cache->stack) || IS_NULL(cache->list)) {
+    dfa_cache_free_work(cache);
+    return ONIGERR_MEMORY;
+  }
+  cache->stamp = 0;
+  cache->prog = prog;
+  return 0;
+}
+
+/* find or make the state with these flags and program counters; NULL
+   means the cache is full */
+static DfaState*
+dfa_intern(OnigDfaCache* cache, const DfaProgram* prog, int flags,
+	   const int* pcs, int n)
+{
+  unsigned int hash = (unsigned int )flags;
+  int i, n_syms = DFA_N_SYMS(prog);
+  size_t size;
+  DfaState* s;
+
+  for (i = 0; i < n; i++) hash = hash * 31 + (unsigned int )pcs[i];
+
+  for (s = cache->table[hash % DFA_HASH_SIZE]; IS_NOT_NULL(s); s = s->link) {
+    if (s->hash == hash && s->flags == flags && s->n == n &&
+	memcmp(s->pcs, pcs, sizeof(int) * n) == 0)
+      return s;
+  }
+
+  size = sizeof(DfaState) + sizeof(DfaState*) * n_syms + sizeof(int) * n + n_syms;
+  if (cache->size + size > DFA_CACHE_LIMIT && cache->n_states > 0)
+    return (DfaState* )NULL;
+  s = (DfaState* )xmalloc(size);
+  if (IS_NULL(s)) return (DfaState* )NULL;
+
+  s->hash    = hash;
+  s->flags   = flags;
+  s->n       = n;
+  s->dead    = (n == 0 && (flags & DFA_STATE_STARTS) == 0);
+  s->idle    = (n == 1 && pcs[0] == prog->fwd_start && (flags & DFA_STATE_STARTS) != 0);
+  s->next    = (DfaState** )(s + 1);
+  s->pcs     = (int* )(s->next + n_syms);
+  s->matched = (UChar* )(s->pcs + n);
+  for (i = 0; i < n_syms; i++) s->next[i] = (DfaState* )NULL;
+  xmemset(s->matched, 0, n_syms);
+  if (n > 0) xmemcpy(s->pcs, pcs, sizeof(int) * n);
+
+  s->link = cache->table[hash % DFA_HASH_SIZE];
+  cache->table[hash % DFA_HASH_SIZE] = s;
+  cache->size += size;
+  cache->n_states++;
+  cache->made++;
+  return s;
+}
+
+static int
+dfa_symbol_context(const DfaProgram* prog, int sym)
+{
+  if (sym == DFA_SYM_END(prog))
+    return DFA_CTX_EDGE;
+  else if (sym == DFA_SYM_LAST(prog))
+    return DFA_CTX_NEWLINE | DFA_CTX_LAST;
+  else
+    return DFA_CLASS_CTX(prog)[sym] & DFA_CTX_MASK;
+}
+
+static int
+dfa_assert(int type, int before, int after)
+{
+  switch (type) {
+  case ANCHOR_BEGIN_BUF:
+    return (before & DFA_CTX_EDGE) != 0;
+  case ANCHOR_BEGIN_LINE:
+    return (before & DFA_CTX_EDGE) != 0 ||
+	   ((before & DFA_CTX_NEWLINE) != 0 && (after & DFA_CTX_EDGE) == 0);
+  case ANCHOR_END_BUF:
+    return (after & DFA_CTX_EDGE) != 0;
+  case ANCHOR_SEMI_END_BUF:
+    return (after & (DFA_CTX_EDGE | DFA_CTX_LAST)) != 0;
+  case ANCHOR_END_LINE:
+    return (after & (DFA_CTX_EDGE | DFA_CTX_NEWLINE)) != 0;
+  case ANCHOR_WORD_BOUND:
+    return ((before & DFA_CTX_WORD) != 0) != ((after & DFA_CTX_WORD) != 0);
+  case ANCHOR_NOT_WORD_BOUND:
+    return ((before & DFA_CTX_WORD) != 0) == ((after & DFA_CTX_WORD) != 0);
+  default:
+    return 0;
+  }
+}
+
+/* make the transition from a state on a symbol, following every thread
+   through the program in priority order; going forward, a match cuts off
+   the threads below it, as the VM would never backtrack into them */
+static DfaState*
+dfa_step(OnigDfaCache* cache, const DfaProgram* prog, DfaState* s, int sym)
+{
+  const DfaInst* insts = DFA_INSTS(prog);
+  const UChar* member = DFA_MEMBER(prog);
+  int reverse = (s->flags & DFA_STATE_REVERSE) != 0;
+  int ctx, before, after, cls, flags, n, i, sp, pc, matched;
+  DfaState* next;
+
+  ctx = dfa_symbol_context(prog, sym);
+  cls = (sym == DFA_SYM_END(prog) ? -1 :
+	 (sym == DFA_SYM_LAST(prog) ? prog->newline_class : sym));
+  before = (reverse ? ctx : s->flags & DFA_CTX_MASK);
+  after  = (reverse ? s->flags & DFA_CTX_MASK : ctx);
+
+  if (++cache->stamp == 0) {
+    xmemset(cache->visited, 0, sizeof(unsigned int) * prog->n_insts);
+    xmemset(cache->listed,  0, sizeof(unsigned int) * prog->n_insts);
+    cache->stamp = 1;
+  }
+
+  n = 0;
+  matched = 0;
+  for (i = 0; i < s->n; i++) {
+    sp = 0;
+    cache->stack[sp++] = s->pcs[i];
+    while (sp > 0) {
+      const DfaInst* inst;
+
+      pc = cache->stack[--sp];
+      if (cache->visited[pc] == cache->stamp) continue;
+      cache->visited[pc] = cache->stamp;
+
+      inst = insts + pc;
+      switch (inst->op) {
+      case DOP_CHAR:
+	if (cls >= 0 && member[inst->arg * prog->n_classes + cls] != 0 &&
+	    cache->listed[inst->next] != cache->stamp) {
+	  cache->listed[inst->next] = cache->stamp;
+	  cache->list[n++] = inst->next;
+	}
+	break;
+      case DOP_SPLIT:
+	cache->stack[sp++] = inst->alt;
+	cache->stack[sp++] = inst->next;
+	break;
+      case DOP_JUMP:
+	cache->stack[sp++] = inst->next;
+	break;
+      case DOP_ASSERT:
+	if (dfa_assert(inst->arg, before, after))
+	  cache->stack[sp++] = inst->next;
+	break;
+      case DOP_MATCH:
+	matched = 1;
+	if (!reverse) sp = 0;
+	break;
+      }
+    }
+    if (matched && !reverse) break;
+  }
+
+  if (cls >= 0 && (DFA_CLASS_CTX(prog)[cls] & DFA_CTX_BAD) != 0)
+    next = &DfaGiveUp;
+  else {
+    /* until a match is found, a new one may start after each character */
+    flags = (reverse ? DFA_STATE_REVERSE | (ctx & prog->after_mask)
+		     : ctx & prog->before_mask);
+    if ((s->flags & DFA_STATE_STARTS) != 0 && !matched) {
+      flags |= DFA_STATE_STARTS;
+      if (cache->listed[prog->fwd_start] != cache->stamp)
+	cache->list[n++] = prog->fwd_start;
+    }
+    next = dfa_intern(cache, prog, flags, cache->list, n);
+    if (IS_NULL(next)) return (DfaState* )NULL;
+  }
+
+  s->next[sym] = next;
+  s->matched[sym] = (UChar )matched;
+  return next;
+}
+
+/* as dfa_step(), but emptying the cache if it's full, unless it has
+   been filling so quickly that the VM is likely to be faster */
+static DfaState*
+dfa_transition(OnigDfaCache* cache, const DfaProgram* prog, DfaState** sp,
+	       int sym, long pos)
+{
+  DfaState* s = *sp;
+  DfaState* next;
+  int flags, n;
+
+  next = dfa_step(cache, prog, s, sym);
+  if (IS_NOT_NULL(next)) return next;
+
+  if (cache->made > 0 && pos - cache->reset_pos < (long )cache->made * DFA_MIN_BYTES_PER_STATE)
+    return (DfaState* )NULL;
+
+  /* the list is free between steps, so the state can be kept there */
+  flags = s->flags;
+  n = s->n;
+  xmemcpy(cache->list, s->pcs, sizeof(int) * n);
+  dfa_cache_clear(cache);
+  cache->made = 0;
+  cache->reset_pos = pos;
+
+  s = dfa_intern(cache, prog, flags, cache->list, n);
+  if (IS_NULL(s)) return (DfaState* )NULL;
+  *sp = s;
+  return dfa_step(cache, prog, s, sym);
+}
+
+static DfaState*
+dfa_start(OnigDfaCache* cache, const DfaProgram* prog, int flags, int pc)
+{
+  DfaState* s;
+
+  cache->made = 0;
+  cache->reset_pos = 0;
+  s = dfa_intern(cache, prog, flags, &pc, 1);
+  if (IS_NULL(s)) {
+    dfa_cache_clear(cache);
+    s = dfa_intern(cache, prog, flags, &pc, 1);
+  }
+  return s;
+}
+
+/* the class of a non-ASCII character, or -1 if it isn't valid */
+static int
+dfa_decode(const DfaProgram* prog, const UChar* p, const UChar* end, int* len)
+{
+  const OnigCodePoint* bounds;
+  OnigCodePoint code, min;
+  int i, n, low, high, x;
+
+  if (!prog->utf8) {
+    *len = 1;
+    return prog->byte_class[*p];
+  }
+
+  if (*p < 0xc2)
+    return -1;
+  else if (*p < 0xe0) {
+    n = 2; code = *p & 0x1f; min = 0x80;
+  }
+  else if (*p < 0xf0) {
+    n = 3; code = *p & 0x0f; min = 0x800;
+  }
+  else if (*p < 0xf5) {
+    n = 4; code = *p & 0x07; min = 0x10000;
+  }
+  else
+    return -1;
+
+  if (end - p < n) return -1;
+  for (i = 1; i < n; i++) {
+    if ((p[i] & 0xc0) != 0x80) return -1;
+    code = (code << 6) | (p[i] & 0x3f);
+  }
+  if (code < min || code > DFA_MAX_CODE) return -1;
+
+  *len = n;
+  if (code < SINGLE_BYTE_SIZE) return prog->byte_class[code];
+
+  bounds = DFA_BOUNDS(prog);
+  for (low = 0, high = prog->n_bounds; high - low > 1; ) {
+    x = (low + high) >> 1;
+    if (bounds[x] <= code)
+      low = x;
+    else
+      high = x;
+  }
+  return DFA_BOUND_CLASS(prog)[low];
+}
+
+/* the symbol for the character at p, or -1 */
+static int
+dfa_next_symbol(const DfaProgram* prog, const UChar* p, const UChar* end,
+		int* len)
+{
+  if (*p < 0x80 || !prog->utf8) {
+    *len = 1;
+    if (*p == 0x0a && prog->last_newline && p + 1 == end)
+      return DFA_SYM_LAST(prog);
+    return prog->byte_class[*p];
+  }
+  return dfa_decode(prog, p, end, len);
+}
+
+/* the symbol for the character before p, which starts at *q, or -1 */
+static int
+dfa_prev_symbol(const DfaProgram* prog, const UChar* str, const UChar* end,
+		const UChar* p, const UChar** q)
+{
+  const UChar* s = p - 1;
+  int len, cls;
+
+  if (*s < 0x80 || !prog->utf8) {
+    *q = s;
+    if (*s == 0x0a && prog->last_newline && p == end)
+      return DFA_SYM_LAST(prog);
+    return prog->byte_class[*s];
+  }
+
+  while (s > str && p - s < 4 && (*s & 0xc0) == 0x80) s--;
+  cls = dfa_decode(prog, s, end, &len);
+  if (cls < 0 || s + len != p) return -1;
+  *q = s;
+  return cls;
+}
+
+/* the context of the character before p, masked for a forward scan */
+static int
+dfa_context_before(const DfaProgram* prog, const UChar* str,
+		   const UChar* end, const UChar* p)
+{
+  const UChar* q;
+  int sym;
+
+  if (p == str) return DFA_CTX_EDGE & prog->before_mask;
+  sym = dfa_prev_symbol(prog, str, end, p, &q);
+  if (sym < 0) return -1;
+  return dfa_symbol_context(prog, sym) & prog->before_mask;
+}
+
+/* find where the leftmost match starting at or after start ends, or
+   just whether there is one if first_match is set */
+static OnigPosition
+dfa_scan_forward(regex_t* reg, OnigDfaCache* cache, const DfaProgram* prog,
+		 const UChar* str, const UChar* end, const UChar* start,
+		 int first_match)
+{
+  const UChar *p, *q;
+  OnigPosition last = ONIG_MISMATCH;
+  DfaState *s, *next;
+  int anchored, skip, short_skips = 0, flags, sym, len;
+
+  anchored = (reg->anchor & ANCHOR_BEGIN_BUF) != 0;
+  skip = !anchored && reg->optimize != ONIG_OPTIMIZE_NONE;
+
+  flags = dfa_context_before(prog, str, end, start);
+  if (flags < 0) return DFA_GIVE_UP;
+  if (!anchored) flags |= DFA_STATE_STARTS;
+
+  s = dfa_start(cache, prog, flags, prog->fwd_start);
+  if (IS_NULL(s)) return DFA_GIVE_UP;
+
+  for (p = start; ; p += len) {
+    if (s->idle && skip) {
+      q = onig_search_candidate(reg, str, end, p);
+      if (IS_NULL(q)) break;
+      if (q - p < DFA_MIN_SKIP && ++short_skips >= DFA_MAX_SHORT_SKIPS)
+	skip = 0;
+      if (q > p) {
+	p = q;
+	flags = dfa_context_before(prog, str, end, p);
+	if (flags < 0) return DFA_GIVE_UP;
+	s = dfa_intern(cache, prog, flags | DFA_STATE_STARTS, &prog->fwd_start, 1);
+	if (IS_NULL(s)) {
+	  dfa_cache_clear(cache);
+	  s = dfa_intern(cache, prog, flags | DFA_STATE_STARTS, &prog->fwd_start, 1);
+	  if (IS_NULL(s)) return DFA_GIVE_UP;
+	}
+      }
+    }
+
+    if (p < end) {
+      sym = dfa_next_symbol(prog, p, end, &len);
+      if (sym < 0) return DFA_GIVE_UP;
+    }
+    else {
+      sym = DFA_SYM_END(prog);
+      len = 0;
+    }
+
+    next = s->next[sym];
+    if (IS_NULL(next)) {
+      next = dfa_transition(cache, prog, &s, sym, (long )(p - start));
+      if (IS_NULL(next)) return DFA_GIVE_UP;
+    }
+
+    if (s->matched[sym]) {
+      last = (OnigPosition )(p - str);
+      if (first_match) break;
+    }
+    if (len == 0 || next->dead == 1) break;
+    if (next->dead == 2) return DFA_GIVE_UP;
+    s = next;
+  }
+
+  return last;
+}
+
+/* find where the longest match ending at e starts, no earlier than start,
+   or ONIG_MISMATCH if there is none */
+static OnigPosition
+dfa_scan_reverse(OnigDfaCache* cache, const DfaProgram* prog,
+		 const UChar* str, const UChar* end, const UChar* start,
+		 const UChar* e)
+{
+  const UChar *p, *q;
+  OnigPosition best = ONIG_MISMATCH;
+  DfaState *s, *next;
+  int flags, sym, len;
+
+  if (e == end)
+    flags = DFA_CTX_EDGE;
+  else {
+    sym = dfa_next_symbol(prog, e, end, &len);
+    if (sym < 0) return DFA_GIVE_UP;
+    flags = dfa_symbol_context(prog, sym);
+  }
+  flags = (flags & prog->after_mask) | DFA_STATE_REVERSE;
+
+  s = dfa_start(cache, prog, flags, prog->rev_start);
+  if (IS_NULL(s)) return DFA_GIVE_UP;
+
+  for (p = e; ; p = q) {
+    if (p > str) {
+      sym = dfa_prev_symbol(prog, str, end, p, &q);
+      if (sym < 0) return DFA_GIVE_UP;
+    }
+    else {
+      sym = DFA_SYM_END(prog);
+      q = p;
+    }
+
+    next = s->next[sym];
+    if (IS_NULL(next)) {
+      next = dfa_transition(cache, prog, &s, sym, (long )(e - p));
+      if (IS_NULL(next)) return DFA_GIVE_UP;
+    }
+
+    if (s->matched[sym])
+      best = (OnigPosition )(p - str);
+    if (p <= start || next->dead == 1) break;
+    if (next->dead == 2) return DFA_GIVE_UP;
+    s = next;
+  }
+
+  return best;
+}
+
+/* record a match found by the DFA, using the VM for any capture groups;
+ * the VM is anchored at the match start, but may still backtrack within the
+ * match, so it remains subject to the retry limit */
+static OnigPosition
+dfa_set_region(regex_t* reg, const UChar* str, const UChar* end,
+	       OnigPosition s, OnigPosition e, OnigRegion* region,
+	       OnigMatchStack* stack)
+{
+  OnigPosition r;
+
+  if (IS_NULL(region)) return s;
+
+  if (reg->num_mem > 0) {
+    r = onig_match_with_stack(reg, str, end, str + s, region,
+			      ONIG_OPTION_NONE, stack);
+    if (r != e - s)
+      return (r < 0 && r != ONIG_MISMATCH ? r : ONIG_NO_SUPPORT_CONFIG);
+  }
+  else {
+    if (onig_region_resize(region, 1) != ONIG_NORMAL) return ONIGERR_MEMORY;
+    region->beg[0] = s;
+    region->end[0] = e;
+  }
+  return s;
+}
+
+static OnigDfaCache*
+dfa_get_cache(regex_t* reg, OnigDfaCache* cache)
+{
+  if (IS_NULL(cache)) {
+    if (IS_NULL(reg->dfa_cache))
+      reg->dfa_cache = onig_dfa_cache_new();
+    cache = reg->dfa_cache;
+  }
+  if (IS_NULL(cache) || dfa_cache_bind(cache, (const DfaProgram* )reg->dfa) != 0)
+    return (OnigDfaCache* )NULL;
+  return cache;
+}
+
+/* search as onig_search() does, for patterns with a DFA program; a NULL
+   cache means the regex's own, which must only be used by one thread.
+   Capture groups are filled in by the VM, matching at the start found,
+   with the stack given (which may be NULL, as for onig_search_with_stack).
+   ONIG_NO_SUPPORT_CONFIG means that the search should be done by the VM */
+extern OnigPosition
+onig_dfa_search(regex_t* reg, const UChar* str, const UChar* end,
+		const UChar* start, const UChar* range, OnigRegion* region,
+		OnigOptionType option, OnigDfaCache* cache, OnigMatchStack* stack)
+{
+  const DfaProgram* prog = (const DfaProgram* )reg->dfa;
+  OnigPosition s, e;
+
+  if (IS_NULL(prog) || option != ONIG_OPTION_NONE || range != end ||
+      start < str || start > end)
+    return ONIG_NO_SUPPORT_CONFIG;
+  if ((reg->anchor & ANCHOR_BEGIN_BUF) != 0 && start != str)
+    return ONIG_MISMATCH;
+
+  cache = dfa_get_cache(reg, cache);
+  if (IS_NULL(cache)) return ONIG_NO_SUPPORT_CONFIG;
+
+  e = dfa_scan_forward(reg, cache, prog, str, end, start, 0);
+  if (e < 0) return e;
+  s = dfa_scan_reverse(cache, prog, str, end, start, str + e);
+  if (s < 0) return ONIG_NO_SUPPORT_CONFIG;
+
+  return dfa_set_region(reg, str, end, s, e, region, stack);
+}
+
+/* search as onig_dfa_search() does, for patterns whose matches all end at
+   the end of the text or of a line, when the text from start has only one
+   such end: the match is the longest one that ends there, so the DFA need
+   only read backwards from the end until it dies, rather than forwards
+   through the whole text. ONIG_NO_SUPPORT_CONFIG means that another
+   search should be used */
+extern OnigPosition
+onig_dfa_search_backward(regex_t* reg, const UChar* str, const UChar* end,
+			 const UChar* start, OnigRegion* region,
+			 OnigDfaCache* cache, OnigMatchStack* stack)
+{
+  const DfaProgram* prog = (const DfaProgram* )reg->dfa;
+  const UChar* e;
+  OnigPosition s;
+
+  if (IS_NULL(prog) || start < str || start > end ||
+      (reg->anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF |
+		      ANCHOR_END_LINE)) == 0)
+    return ONIG_NO_SUPPORT_CONFIG;
+  if ((reg->anchor & ANCHOR_BEGIN_BUF) != 0 && start != str)
+    return ONIG_MISMATCH;
+
+  /* \Z and $ can also match before a newline, which the program only
+     handles as one byte */
+  e = end;
+  if ((reg->anchor & ANCHOR_END_BUF) == 0) {
+    if (IS_NEWLINE_CRLF(reg->options))
+      return ONIG_NO_SUPPORT_CONFIG;
+    if ((reg->anchor & ANCHOR_SEMI_END_BUF) != 0) {
+      if (start < end && end[-1] == 0x0a) return ONIG_NO_SUPPORT_CONFIG;
+    }
+    else if (IS_NOT_NULL(memchr(start, 0x0a, end - start)))
+      return ONIG_NO_SUPPORT_CONFIG;
+  }
+
+  cache = dfa_get_cache(reg, cache);
+  if (IS_NULL(cache)) return ONIG_NO_SUPPORT_CONFIG;
+
+  s = dfa_scan_reverse(cache, prog, str, end, start, e);
+  if (s < 0) return s;
+
+  return dfa_set_region(reg, str, end, s, (OnigPosition )(e - str), region,
+			stack);
+}
+
+/* whether there is a match from start onwards, without finding where it
+   is: the result is an offset of at least zero if so */
+extern OnigPosition
+onig_dfa_test(regex_t* reg, const UChar* str, const UChar* end,
+	      const UChar* start, OnigDfaCache* cache)
+{
+  const DfaProgram* prog = (const DfaProgram* )reg->dfa;
+
+  if (IS_NULL(prog) || start < str || start > end)
+    return ONIG_NO_SUPPORT_CONFIG;
+  if ((reg->anchor & ANCHOR_BEGIN_BUF) != 0 && start != str)
+    return ONIG_MISMATCH;
+
+  cache = dfa_get_cache(reg, cache);
+  if (IS_NULL(cache)) return ONIG_NO_SUPPORT_CONFIG;
+
+  return dfa_scan_forward(reg, cache, prog, str, end, start, 1);
+}
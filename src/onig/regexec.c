@@ -353,6 +353,45 @@ onig_region_free(OnigRegion* r, int free_self)
   }
 }
 
+extern OnigMatchStack*
+onig_match_stack_new(void)
+{
+  OnigMatchStack* s;
+
+  s = (OnigMatchStack* )xmalloc(sizeof(OnigMatchStack));
+  if (s) {
+    s->stack_p = (void* )0;
+    s->stack_n = 0;
+  }
+  return s;
+}
+
+extern void
+onig_match_stack_clear(OnigMatchStack* s)
+{
+  if (s) {
+    if (s->stack_p) xfree(s->stack_p);
+    s->stack_p = (void* )0;
+    s->stack_n = 0;
+  }
+}
+
+extern void
+onig_match_stack_free(OnigMatchStack* s)
+{
+  if (s) {
+    onig_match_stack_clear(s);
+    xfree(s);
+  }
+}
+
+/* bytes held on the heap; zero while searches fit the initial stack */
+extern size_t
+onig_match_stack_size(const OnigMatchStack* s)
+{
+  return s ? s->stack_n * sizeof(OnigStackType) : 0;
+}
+
 extern void
 onig_region_copy(OnigRegion* to, const OnigRegion* from)
 {
@@ -411,6 +450,65 @@ onig_region_copy(OnigRegion* to, const OnigRegion* from)
 #define STK_MASK_TO_VOID_TARGET    0x10ff
 #define STK_MASK_MEM_END_OR_MARK   0x8000  /* MEM_END or MEM_END_MARK */
 
+#ifdef USE_RETRY_LIMIT_IN_SEARCH
+static unsigned long RetryLimitInSearch = DEFAULT_RETRY_LIMIT_IN_SEARCH;
+static int (*SearchInterruptFunc)(void) = 0;
+
+extern unsigned long
+onig_get_retry_limit_in_search(void)
+{
+  return RetryLimitInSearch;
+}
+
+extern int
+onig_set_retry_limit_in_search(unsigned long n)
+{
+  RetryLimitInSearch = n;
+  return 0;
+}
+
+/* func is called every SEARCH_INTERRUPT_INTERVAL retries, and the search
+   fails with ONIGERR_SEARCH_INTERRUPTED if it returns non-zero */
+extern int
+onig_set_search_interrupt_func(int (*func)(void))
+{
+  SearchInterruptFunc = func;
+  return 0;
+}
+
+/* the retry count at which to act next: the limit, or the next poll */
+static unsigned long
+retry_next_check(unsigned long count)
+{
+  unsigned long next = ~0UL;
+
+  if (SearchInterruptFunc != 0)
+    next = count + SEARCH_INTERRUPT_INTERVAL;
+  if (RetryLimitInSearch != 0 && RetryLimitInSearch < next)
+    next = RetryLimitInSearch + 1;
+  return next;
+}
+
+static int
+retry_check(OnigMatchArg* msa)
+{
+  if (RetryLimitInSearch != 0 && msa->retry_count > RetryLimitInSearch)
+    return ONIGERR_RETRY_LIMIT_IN_SEARCH_OVER;
+  if (SearchInterruptFunc != 0 && (*SearchInterruptFunc)() != 0)
+    return ONIGERR_SEARCH_INTERRUPTED;
+
+  msa->retry_check = retry_next_check(msa->retry_count);
+  return 0;
+}
+
+# define RETRY_ARG_INIT(msa) do {\
+  (msa).retry_count = 0;\
+  (msa).retry_check = retry_next_check(0);\
+} while(0)
+#else
+# define RETRY_ARG_INIT(msa)
+#endif /* USE_RETRY_LIMIT_IN_SEARCH */
+
 #ifdef USE_FIND_LONGEST_SEARCH_ALL_OF_RANGE
 # define MATCH_ARG_INIT(msa, arg_option, arg_region, arg_start, arg_gpos) do {\
   (msa).stack_p  = (void* )0;\
@@ -419,6 +517,7 @@ onig_region_copy(OnigRegion* to, const OnigRegion* from)
   (msa).start    = (arg_start);\
   (msa).gpos     = (arg_gpos);\
   (msa).best_len = ONIG_MISMATCH;\
+  RETRY_ARG_INIT(msa);\
 } while(0)
 #else
 # define MATCH_ARG_INIT(msa, arg_option, arg_region, arg_start, arg_gpos) do {\
@@ -427,9 +526,31 @@ onig_region_copy(OnigRegion* to, const OnigRegion* from)
   (msa).region   = (arg_region);\
   (msa).start    = (arg_start);\
   (msa).gpos     = (arg_gpos);\
+  RETRY_ARG_INIT(msa);\
 } while(0)
 #endif
 
+/* Take over a stack left by an earlier search, if any, and give it back
+   (however it has grown) before MATCH_ARG_FREE, instead of freeing it.
+   The holder is left empty meanwhile, so that a search started from a
+   callback uses a stack of its own; if it leaves one behind, it is freed. */
+#define MATCH_STACK_ATTACH(msa, mstk) do {\
+  if (IS_NOT_NULL(mstk) && IS_NOT_NULL((mstk)->stack_p)) {\
+    (msa).stack_p = (mstk)->stack_p;\
+    (msa).stack_n = (mstk)->stack_n;\
+    (mstk)->stack_p = (void* )0;\
+  }\
+} while(0)
+
+#define MATCH_STACK_DETACH(msa, mstk) do {\
+  if (IS_NOT_NULL(mstk)) {\
+    if (IS_NOT_NULL((mstk)->stack_p)) xfree((mstk)->stack_p);\
+    (mstk)->stack_p = (msa).stack_p;\
+    (mstk)->stack_n = IS_NOT_NULL((msa).stack_p) ? (msa).stack_n : 0;\
+    (msa).stack_p = (void* )0;\
+  }\
+} while(0)
+
 #ifdef USE_COMBINATION_EXPLOSION_CHECK
 
 # define STATE_CHECK_BUFF_MALLOC_THRESHOLD_SIZE  16
@@ -462,14 +583,205 @@ onig_region_copy(OnigRegion* to, const OnigRegion* from)
 
 # define MATCH_ARG_FREE(msa) do {\
   if ((msa).stack_p) xfree((msa).stack_p);\
+  MATCH_CACHE_FREE(msa);\
   if ((msa).state_check_buff_size >= STATE_CHECK_BUFF_MALLOC_THRESHOLD_SIZE) { \
     if ((msa).state_check_buff) xfree((msa).state_check_buff);\
   }\
 } while(0)
 #else /* USE_COMBINATION_EXPLOSION_CHECK */
-# define MATCH_ARG_FREE(msa)  if ((msa).stack_p) xfree((msa).stack_p)
+# define MATCH_ARG_FREE(msa)  do {\
+  if ((msa).stack_p) xfree((msa).stack_p);\
+  MATCH_CACHE_FREE(msa);\
+} while(0)
 #endif /* USE_COMBINATION_EXPLOSION_CHECK */
 
+#ifdef USE_MATCH_CACHE
+/* Memoization of backtracking, after Ruby 3.2. If a program has no state
+   beyond its position in the code and the string, failing from a branch at
+   some position means failing from it every time, so each (branch, position)
+   pair need only be tried once in a search, which bounds the time taken by
+   the length of the string times the number of branches. The cache is set
+   up lazily, only once a search has backtracked more than that bound would
+   allow anyway, so searches that don't backtrack much never pay for it. */
+
+# define MATCH_CACHE_OFF     0   /* not requested, or not safe */
+# define MATCH_CACHE_WAIT    1   /* counting backtracks */
+# define MATCH_CACHE_ON      2   /* recording failures */
+
+# define MATCH_CACHE_INIT(msa, arg_option) do {\
+  (msa).cache_state = (IS_MATCH_CACHE(arg_option) && !IS_FIND_CONDITION(arg_option)) \
+                      ? MATCH_CACHE_WAIT : MATCH_CACHE_OFF;\
+  (msa).num_fails        = 0;\
+  (msa).fail_threshold   = 0;\
+  (msa).num_cache_points = -1;\
+  (msa).cache_points     = (UChar** )0;\
+  (msa).match_cache      = (unsigned char* )0;\
+} while(0)
+
+# define MATCH_CACHE_FREE(msa) do {\
+  if ((msa).cache_points) xfree((msa).cache_points);\
+  if ((msa).match_cache)  xfree((msa).match_cache);\
+} while(0)
+
+/* Find the branching opcodes, at which failures are recorded. Returns their
+   number, or -1 if the program uses anything whose outcome depends on more
+   than the current position (captured text, repeat counts, lookaround and
+   so on), or whose loops may not advance. */
+static int
+match_cache_points(regex_t* reg, UChar** points)
+{
+  UChar* p = reg->p;
+  UChar* end = reg->p + reg->used;
+  LengthType len, mb_len;
+  int n = 0;
+
+  while (p < end) {
+    switch (*p++) {
+    case OP_FINISH: case OP_END:
+    case OP_ANYCHAR: case OP_ANYCHAR_ML:
+    case OP_WORD: case OP_NOT_WORD: case OP_WORD_BOUND: case OP_NOT_WORD_BOUND:
+    case OP_WORD_BEGIN: case OP_WORD_END:
+    case OP_ASCII_WORD: case OP_NOT_ASCII_WORD:
+    case OP_ASCII_WORD_BOUND: case OP_NOT_ASCII_WORD_BOUND:
+    case OP_ASCII_WORD_BEGIN: case OP_ASCII_WORD_END:
+    case OP_BEGIN_BUF: case OP_END_BUF: case OP_BEGIN_LINE: case OP_END_LINE:
+    case OP_SEMI_END_BUF: case OP_BEGIN_POSITION:
+    case OP_KEEP: case OP_FAIL:
+      break;
+
+    case OP_EXACT1: p += 1; break;
+    case OP_EXACT2: case OP_EXACTMB2N1: p += 2; break;
+    case OP_EXACT3: p += 3; break;
+    case OP_EXACT4: case OP_EXACTMB2N2: p += 4; break;
+    case OP_EXACT5: p += 5; break;
+    case OP_EXACTMB2N3: p += 6; break;
+    case OP_EXACTN: case OP_EXACTN_IC:
+      GET_LENGTH_INC(len, p); p += len; break;
+    case OP_EXACTMB2N:
+      GET_LENGTH_INC(len, p); p += len * 2; break;
+    case OP_EXACTMB3N:
+      GET_LENGTH_INC(len, p); p += len * 3; break;
+    case OP_EXACTMBN:
+      GET_LENGTH_INC(mb_len, p);
+      GET_LENGTH_INC(len, p);
+      p += len * mb_len;
+      break;
+    case OP_EXACT1_IC:
+      p += enclen(reg->enc, p, end); break;
+
+    case OP_CCLASS: case OP_CCLASS_NOT:
+      p += SIZE_BITSET; break;
+    case OP_CCLASS_MIX: case OP_CCLASS_MIX_NOT:
+      p += SIZE_BITSET;
+      /* fall through */
+    case OP_CCLASS_MB: case OP_CCLASS_MB_NOT:
+      GET_LENGTH_INC(len, p); p += len; break;
+
+    case OP_MEMORY_START: case OP_MEMORY_START_PUSH:
+    case OP_MEMORY_END: case OP_MEMORY_END_PUSH:
+      p += SIZE_MEMNUM; break;
+
+    case OP_JUMP:
+      p += SIZE_RELADDR; break;
+
+    case OP_ANYCHAR_STAR: case OP_ANYCHAR_ML_STAR:
+    case OP_ANYCHAR_STAR_PEEK_NEXT: case OP_ANYCHAR_ML_STAR_PEEK_NEXT:
+    case OP_PUSH: case OP_PUSH_OR_JUMP_EXACT1: case OP_PUSH_IF_PEEK_NEXT:
+      if (points) points[n] = p - 1;
+      n++;
+      switch (p[-1]) {
+      case OP_ANYCHAR_STAR: case OP_ANYCHAR_ML_STAR: break;
+      case OP_PUSH: p += SIZE_RELADDR; break;
+      case OP_PUSH_OR_JUMP_EXACT1: case OP_PUSH_IF_PEEK_NEXT:
+	p += SIZE_RELADDR + 1; break;
+      default: p += 1; break;
+      }
+      break;
+
+    default:
+      return -1;
+    }
+  }
+
+  return n;
+}
+
+/* Called each time a waiting search passes its backtracking threshold: first
+   to allow as many backtracks as the string is long, then to analyse the
+   program, and finally, once the bound would be exceeded, to allocate the
+   cache. */
+static int
+match_cache_step(regex_t* reg, const UChar* str, const UChar* end,
+		 OnigMatchArg* msa)
+{
+  size_t len = (size_t )(end - str) + 1;
+  size_t size;
+  int n;
+
+  if (msa->fail_threshold == 0) {
+    msa->fail_threshold = len;
+    return 0;
+  }
+
+  if (msa->num_cache_points < 0) {
+    n = match_cache_points(reg, (UChar** )0);
+    if (n <= 0) {
+      msa->cache_state = MATCH_CACHE_OFF;
+      return 0;
+    }
+    msa->cache_points = (UChar** )xmalloc(sizeof(UChar*) * n);
+    CHECK_NULL_RETURN_MEMERR(msa->cache_points);
+    match_cache_points(reg, msa->cache_points);
+    msa->num_cache_points = n;
+    msa->fail_threshold = len * n;
+    if (msa->fail_threshold / n != len) msa->cache_state = MATCH_CACHE_OFF;
+    return 0;
+  }
+
+  size = (msa->fail_threshold + 7) >> 3;
+  if (size > MATCH_CACHE_MAX_SIZE) {
+    msa->cache_state = MATCH_CACHE_OFF;
+    return 0;
+  }
+  msa->match_cache = (unsigned char* )xcalloc(size, 1);
+  CHECK_NULL_RETURN_MEMERR(msa->match_cache);
+  msa->cache_state = MATCH_CACHE_ON;
+  return 0;
+}
+
+/* Record a visit to the branch at pcode with the string at offset pos.
+   Returns 1 if it had been visited already, and so is bound to fail. */
+static int
+match_cache_visit(OnigMatchArg* msa, const UChar* pcode, size_t pos)
+{
+  UChar** points = msa->cache_points;
+  int low = 0, high = msa->num_cache_points - 1, mid;
+  size_t i;
+  unsigned char bit;
+
+  while (low < high) {
+    mid = (low + high) >> 1;
+    if (points[mid] < pcode) low = mid + 1;
+    else high = mid;
+  }
+
+  i = pos * msa->num_cache_points + low;
+  bit = (unsigned char )(1 << (i & 7));
+  if (msa->match_cache[i >> 3] & bit) return 1;
+  msa->match_cache[i >> 3] |= bit;
+  return 0;
+}
+
+# define MATCH_CACHE_CHECK(pcode) do {\
+  if (msa->cache_state == MATCH_CACHE_ON &&\
+      match_cache_visit(msa, (pcode), (size_t )(s - str))) goto fail;\
+} while(0)
+#else /* USE_MATCH_CACHE */
+# define MATCH_CACHE_INIT(msa, arg_option)
+# define MATCH_CACHE_FREE(msa)
+# define MATCH_CACHE_CHECK(pcode)
+#endif /* USE_MATCH_CACHE */
+
 
 
 #define MAX_PTR_NUM 100
@@ -509,7 +821,7 @@ onig_region_copy(OnigRegion* to, const OnigRegion* from)
 } while(0)
 
 #define STACK_SAVE do{\
-  if (stk_base != stk_alloc) {\
+  if (stk_base != stk_alloc || IS_NOT_NULL(msa->stack_p)) {\
     msa->stack_p = stk_base;\
     msa->stack_n = stk_end - stk_base; /* TODO: check overflow */\
   };\
@@ -1435,7 +1747,9 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
   LengthType tlen, tlen2;
   MemNumType mem;
   RelAddrType addr;
-  OnigOptionType option = reg->options;
+  /* FIND_NOT_EMPTY may also be given per search, so that the regex
+     itself need not be modified (which would not be thread-safe) */
+  OnigOptionType option = reg->options | (msa->options & ONIG_OPTION_FIND_NOT_EMPTY);
   OnigEncoding encode = reg->enc;
   OnigCaseFoldType case_fold_flag = reg->case_fold_flag;
   UChar *s, *q, *sbegin;
@@ -2018,6 +2332,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
       NEXT;
 
     CASE(OP_CCLASS_MB)  MOP_IN(OP_CCLASS_MB);
+      DATA_ENSURE(1);
       if (! ONIGENC_IS_MBC_HEAD(encode, s, end)) goto fail;
 
     cclass_mb:
@@ -2150,6 +2465,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 
     CASE(OP_ANYCHAR_STAR)  MOP_IN(OP_ANYCHAR_STAR);
       while (DATA_ENSURE_CHECK1) {
+	MATCH_CACHE_CHECK(p - 1);
 	STACK_PUSH_ALT(p, s, sprev, pkeep);
 	n = enclen(encode, s, end);
 	DATA_ENSURE(n);
@@ -2162,6 +2478,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 
     CASE(OP_ANYCHAR_ML_STAR)  MOP_IN(OP_ANYCHAR_ML_STAR);
       while (DATA_ENSURE_CHECK1) {
+	MATCH_CACHE_CHECK(p - 1);
 	STACK_PUSH_ALT(p, s, sprev, pkeep);
 	n = enclen(encode, s, end);
 	if (n > 1) {
@@ -2179,6 +2496,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 
     CASE(OP_ANYCHAR_STAR_PEEK_NEXT)  MOP_IN(OP_ANYCHAR_STAR_PEEK_NEXT);
       while (DATA_ENSURE_CHECK1) {
+	MATCH_CACHE_CHECK(p - 1);
 	if (*p == *s) {
 	  STACK_PUSH_ALT(p + 1, s, sprev, pkeep);
 	}
@@ -2194,6 +2512,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 
     CASE(OP_ANYCHAR_ML_STAR_PEEK_NEXT)MOP_IN(OP_ANYCHAR_ML_STAR_PEEK_NEXT);
       while (DATA_ENSURE_CHECK1) {
+	MATCH_CACHE_CHECK(p - 1);
 	if (*p == *s) {
 	  STACK_PUSH_ALT(p + 1, s, sprev, pkeep);
 	}
@@ -2824,6 +3143,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
       JUMP;
 
     CASE(OP_PUSH)  MOP_IN(OP_PUSH);
+      MATCH_CACHE_CHECK(p - 1);
       GET_RELADDR_INC(addr, p);
       STACK_PUSH_ALT(p + addr, s, sprev, pkeep);
       MOP_OUT;
@@ -2870,6 +3190,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 
 #ifdef USE_OP_PUSH_OR_JUMP_EXACT
     CASE(OP_PUSH_OR_JUMP_EXACT1)  MOP_IN(OP_PUSH_OR_JUMP_EXACT1);
+      MATCH_CACHE_CHECK(p - 1);
       GET_RELADDR_INC(addr, p);
       if (*p == *s && DATA_ENSURE_CHECK1) {
 	p++;
@@ -2883,6 +3204,7 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 #endif
 
     CASE(OP_PUSH_IF_PEEK_NEXT)  MOP_IN(OP_PUSH_IF_PEEK_NEXT);
+      MATCH_CACHE_CHECK(p - 1);
       GET_RELADDR_INC(addr, p);
       if (*p == *s) {
 	p++;
@@ -3143,6 +3465,25 @@ match_at(regex_t* reg, const UChar* str, const UChar* end,
 	MOP_OUT;
       }
       MOP_IN(OP_FAIL);
+#ifdef USE_RETRY_LIMIT_IN_SEARCH
+      if (++msa->retry_count >= msa->retry_check) {
+	n = retry_check(msa);
+	if (n != 0) {
+	  best_len = n;
+	  goto finish;
+	}
+      }
+#endif
+#ifdef USE_MATCH_CACHE
+      if (msa->cache_state == MATCH_CACHE_WAIT &&
+	  ++msa->num_fails > msa->fail_threshold) {
+	n = match_cache_step(reg, str, end, msa);
+	if (n != 0) {
+	  best_len = n;
+	  goto finish;
+	}
+      }
+#endif
       STACK_POP;
       p     = stk->u.state.pcode;
       s     = stk->u.state.pstr;
@@ -3227,6 +3568,148 @@ slow_search(OnigEncoding enc, UChar* target, UChar* target_end,
   return (UChar* )NULL;
 }
 
+#ifdef USE_VECTOR_SEARCH
+/* Exact strings are found by looking for their first and last bytes, the
+   right distance apart, across a block of text at once, and then checking
+   each candidate in full. Like bm_search(), this ignores character
+   boundaries, so it is only used where an occurrence can't start within a
+   character. Each function returns the first occurrence starting before
+   end, which must leave room for the whole target before the text ends. */
+
+# ifdef USE_VECTOR_SEARCH_X86
+#  include <emmintrin.h>
+#  include <immintrin.h>
+
+static int vector_search_avx2  = 0;
+static int vector_search_ssse3 = 0;
+
+extern void
+onig_vector_search_init(void)
+{
+  __builtin_cpu_init();
+  vector_search_ssse3 = __builtin_cpu_supports("ssse3");
+#  ifndef ONIG_NO_AVX2
+  vector_search_avx2 = __builtin_cpu_supports("avx2");
+#  endif
+}
+
+static UChar*
+exact_search_sse2(const UChar* target, const UChar* target_end,
+		  const UChar* text, const UChar* end)
+{
+  const UChar* s = text;
+  ptrdiff_t tlen1 = target_end - target - 1;
+  __m128i first = _mm_set1_epi8((char )target[0]);
+  __m128i last  = _mm_set1_epi8((char )target[tlen1]);
+
+  for (; end - s >= 16; s += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i* )s);
+    __m128i bl = _mm_loadu_si128((const __m128i* )(s + tlen1));
+    unsigned int mask = (unsigned int )_mm_movemask_epi8(
+	    _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (tlen1 < 2 || memcmp(s + i + 1, target + 1, tlen1 - 1) == 0)
+	return (UChar* )(s + i);
+      mask &= mask - 1;
+    }
+  }
+
+  for (; s < end; s++) {
+    if (*s == *target && s[tlen1] == target[tlen1] &&
+	(tlen1 < 2 || memcmp(s + 1, target + 1, tlen1 - 1) == 0))
+      return (UChar* )s;
+  }
+  return (UChar* )NULL;
+}
+
+__attribute__((target("avx2")))
+static UChar*
+exact_search_avx2(const UChar* target, const UChar* target_end,
+		  const UChar* text, const UChar* end)
+{
+  const UChar* s = text;
+  ptrdiff_t tlen1 = target_end - target - 1;
+  __m256i first = _mm256_set1_epi8((char )target[0]);
+  __m256i last  = _mm256_set1_epi8((char )target[tlen1]);
+
+  for (; end - s >= 32; s += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i* )s);
+    __m256i bl = _mm256_loadu_si256((const __m256i* )(s + tlen1));
+    unsigned int mask = (unsigned int )_mm256_movemask_epi8(
+	    _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+			     _mm256_cmpeq_epi8(bl, last)));
+
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (tlen1 < 2 || memcmp(s + i + 1, target + 1, tlen1 - 1) == 0)
+	return (UChar* )(s + i);
+      mask &= mask - 1;
+    }
+  }
+
+  return exact_search_sse2(target, target_end, s, end);
+}
+
+static UChar*
+exact_search_block(const UChar* target, const UChar* target_end,
+		   const UChar* text, const UChar* end)
+{
+  if (vector_search_avx2)
+    return exact_search_avx2(target, target_end, text, end);
+  else
+    return exact_search_sse2(target, target_end, text, end);
+}
+
+# else /* USE_VECTOR_SEARCH_X86 */
+
+extern void
+onig_vector_search_init(void)
+{
+}
+
+/* memchr() is vectorised by most C libraries */
+static UChar*
+exact_search_block(const UChar* target, const UChar* target_end,
+		   const UChar* text, const UChar* end)
+{
+  const UChar* s = text;
+  ptrdiff_t tlen1 = target_end - target - 1;
+
+  while (s < end) {
+    s = (const UChar* )memchr(s, *target, end - s);
+    if (IS_NULL(s)) break;
+    if (s[tlen1] == target[tlen1] &&
+	(tlen1 < 2 || memcmp(s + 1, target + 1, tlen1 - 1) == 0))
+      return (UChar* )s;
+    s++;
+  }
+  return (UChar* )NULL;
+}
+# endif /* USE_VECTOR_SEARCH_X86 */
+
+static UChar*
+exact_search(const UChar* target, const UChar* target_end,
+	     const UChar* text, const UChar* text_end, const UChar* text_range)
+{
+  const UChar* end;
+
+  if (text_end - text < target_end - target) return (UChar* )NULL;
+  end = text_end - (target_end - target - 1);
+  if (end > text_range)
+    end = text_range;
+  if (text >= end) return (UChar* )NULL;
+
+  return exact_search_block(target, target_end, text, end);
+}
+
+/* A single-byte target in UTF-8 is an ASCII character, which can't occur
+   within a valid multibyte character */
+# define USE_EXACT_SEARCH(enc) \
+  (ONIGENC_IS_SINGLEBYTE(enc) || (enc) == ONIG_ENCODING_UTF8)
+#endif /* USE_VECTOR_SEARCH */
+
 static int
 str_lower_case_match(OnigEncoding enc, int case_fold_flag,
 		     const UChar* t, const UChar* tend,
@@ -3372,6 +3855,7 @@ bm_search_notrev(regex_t* reg, const UChar* target, const UChar* target_end,
   return (UChar* )NULL;
 }
 
+#ifndef USE_VECTOR_SEARCH
 /* Sunday's quick search */
 static UChar*
 bm_search(regex_t* reg, const UChar* target, const UChar* target_end,
@@ -3406,6 +3890,7 @@ bm_search(regex_t* reg, const UChar* target, const UChar* target_end,
 
   return (UChar* )NULL;
 }
+#endif
 
 /* Sunday's quick search applied to a multibyte string (ignore case) */
 static UChar*
@@ -3504,6 +3989,12 @@ map_search_backward(OnigEncoding enc, UChar map[],
 {
   const UChar *s = text_start;
 
+  /* no character starts at the end of the text */
+  if (s >= text_end) {
+    s = onigenc_get_prev_char_head(enc, adjust_text, text_end, text_end);
+    if (IS_NULL(s)) return (UChar* )NULL;
+  }
+
   while (s >= text) {
     if (map[*s]) return (UChar* )s;
 
@@ -3512,15 +4003,180 @@ map_search_backward(OnigEncoding enc, UChar map[],
   return (UChar* )NULL;
 }
 
+#ifdef USE_VECTOR_SEARCH_X86
+/* Bytes which may be in the char-map are found a block at a time, by
+   looking up the buckets of their low and high nibbles with a byte shuffle
+   (see set_map_nibbles()). Each byte found is then checked with the map. */
+
+__attribute__((target("ssse3")))
+static inline unsigned int
+map_block_ssse3(__m128i v, __m128i lo, __m128i hi)
+{
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i m = _mm_and_si128(
+	  _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+	  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+
+  return ~(unsigned int )_mm_movemask_epi8(
+	  _mm_cmpeq_epi8(m, _mm_setzero_si128())) & 0xffff;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int
+map_block_avx2(__m256i v, __m256i lo, __m256i hi)
+{
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i m = _mm256_and_si256(
+	  _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+	  _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+						   nibble)));
+
+  return ~(unsigned int )_mm256_movemask_epi8(
+	  _mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+}
+
+__attribute__((target("ssse3")))
+static UChar*
+map_search_ssse3(regex_t* reg, const UChar* text, const UChar* text_range)
+{
+  const UChar *s = text;
+  __m128i lo = _mm_loadu_si128((const __m128i* )reg->map_lo);
+  __m128i hi = _mm_loadu_si128((const __m128i* )reg->map_hi);
+
+  for (; text_range - s >= 16; s += 16) {
+    unsigned int mask = map_block_ssse3(_mm_loadu_si128((const __m128i* )s),
+					lo, hi);
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (reg->map[s[i]]) return (UChar* )(s + i);
+      mask &= mask - 1;
+    }
+  }
+
+  for (; s < text_range; s++) {
+    if (reg->map[*s]) return (UChar* )s;
+  }
+  return (UChar* )NULL;
+}
+
+__attribute__((target("avx2")))
+static UChar*
+map_search_avx2(regex_t* reg, const UChar* text, const UChar* text_range)
+{
+  const UChar *s = text;
+  __m256i lo = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i* )reg->map_lo));
+  __m256i hi = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i* )reg->map_hi));
+
+  for (; text_range - s >= 32; s += 32) {
+    unsigned int mask = map_block_avx2(_mm256_loadu_si256((const __m256i* )s),
+				       lo, hi);
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (reg->map[s[i]]) return (UChar* )(s + i);
+      mask &= mask - 1;
+    }
+  }
+
+  return map_search_ssse3(reg, s, text_range);
+}
+
+/* Search back from text_start, which must be before the end of the text */
+__attribute__((target("ssse3")))
+static UChar*
+map_search_backward_ssse3(regex_t* reg, const UChar* text,
+			  const UChar* text_start)
+{
+  const UChar *e = text_start + 1;
+  __m128i lo = _mm_loadu_si128((const __m128i* )reg->map_lo);
+  __m128i hi = _mm_loadu_si128((const __m128i* )reg->map_hi);
+
+  for (; e - text >= 16; e -= 16) {
+    unsigned int mask = map_block_ssse3(
+	    _mm_loadu_si128((const __m128i* )(e - 16)), lo, hi);
+    while (mask != 0) {
+      int i = 31 - __builtin_clz(mask);
+      if (reg->map[e[i - 16]]) return (UChar* )(e + i - 16);
+      mask &= ~(1U << i);
+    }
+  }
+
+  while (e > text) {
+    e--;
+    if (reg->map[*e]) return (UChar* )e;
+  }
+  return (UChar* )NULL;
+}
+
+__attribute__((target("avx2")))
+static UChar*
+map_search_backward_avx2(regex_t* reg, const UChar* text,
+			 const UChar* text_start)
+{
+  const UChar *e = text_start + 1;
+  __m256i lo = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i* )reg->map_lo));
+  __m256i hi = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i* )reg->map_hi));
+
+  for (; e - text >= 32; e -= 32) {
+    unsigned int mask = map_block_avx2(
+	    _mm256_loadu_si256((const __m256i* )(e - 32)), lo, hi);
+    while (mask != 0) {
+      int i = 31 - __builtin_clz(mask);
+      if (reg->map[e[i - 32]]) return (UChar* )(e + i - 32);
+      mask &= ~(1U << i);
+    }
+  }
+
+  if (e <= text) return (UChar* )NULL;
+  return map_search_backward_ssse3(reg, text, e - 1);
+}
+
+# define USE_MAP_SEARCH_VECTOR(reg) \
+  ((reg)->map_nibbles != 0 && vector_search_ssse3 != 0)
+
+static UChar*
+map_search_vector(regex_t* reg, const UChar* text, const UChar* text_range)
+{
+  if (vector_search_avx2)
+    return map_search_avx2(reg, text, text_range);
+  else
+    return map_search_ssse3(reg, text, text_range);
+}
+
+static UChar*
+map_search_backward_vector(regex_t* reg, const UChar* text,
+			   const UChar* text_start, const UChar* text_end)
+{
+  if (text_start >= text_end) text_start = text_end - 1;
+  if (text_start < text) return (UChar* )NULL;
+
+  if (vector_search_avx2)
+    return map_search_backward_avx2(reg, text, text_start);
+  else
+    return map_search_backward_ssse3(reg, text, text_start);
+}
+#endif /* USE_VECTOR_SEARCH_X86 */
+
 extern OnigPosition
 onig_match(regex_t* reg, const UChar* str, const UChar* end, const UChar* at, OnigRegion* region,
 	    OnigOptionType option)
+{
+  return onig_match_with_stack(reg, str, end, at, region, option, NULL);
+}
+
+extern OnigPosition
+onig_match_with_stack(regex_t* reg, const UChar* str, const UChar* end, const UChar* at,
+	    OnigRegion* region, OnigOptionType option, OnigMatchStack* mstk)
 {
   ptrdiff_t r;
   UChar *prev;
   OnigMatchArg msa;
 
   MATCH_ARG_INIT(msa, option, region, at, at);
+  MATCH_CACHE_INIT(msa, reg->options | option);
 #ifdef USE_COMBINATION_EXPLOSION_CHECK
   {
     int offset = at - str;
@@ -3535,12 +4191,14 @@ onig_match(regex_t* reg, const UChar* str, const UChar* end, const UChar* at, On
     r = 0;
 
   if (r == 0) {
+    MATCH_STACK_ATTACH(msa, mstk);
     prev = (UChar* )onigenc_get_prev_char_head(reg->enc, str, at, end);
     r = match_at(reg, str, end,
 #ifdef USE_MATCH_RANGE_MUST_BE_INSIDE_OF_SPECIFIED_RANGE
 		 end,
 #endif
 		 at, prev, &msa);
+    MATCH_STACK_DETACH(msa, mstk);
   }
 
   MATCH_ARG_FREE(msa);
@@ -3574,6 +4232,12 @@ forward_search_range(regex_t* reg, const UChar* str, const UChar* end, UChar* s,
  retry:
   switch (reg->optimize) {
   case ONIG_OPTIMIZE_EXACT:
+#ifdef USE_VECTOR_SEARCH
+    if (USE_EXACT_SEARCH(reg->enc)) {
+      p = exact_search(reg->exact, reg->exact_end, p, end, range);
+      break;
+    }
+#endif
     p = slow_search(reg->enc, reg->exact, reg->exact_end, p, end, range);
     break;
   case ONIG_OPTIMIZE_EXACT_IC:
@@ -3582,7 +4246,12 @@ forward_search_range(regex_t* reg, const UChar* str, const UChar* end, UChar* s,
     break;
 
   case ONIG_OPTIMIZE_EXACT_BM:
+#ifdef USE_VECTOR_SEARCH
+    /* bm_search() doesn't respect character boundaries either */
+    p = exact_search(reg->exact, reg->exact_end, p, end, range);
+#else
     p = bm_search(reg, reg->exact, reg->exact_end, p, end, range);
+#endif
     break;
 
   case ONIG_OPTIMIZE_EXACT_BM_NOT_REV:
@@ -3598,6 +4267,12 @@ forward_search_range(regex_t* reg, const UChar* str, const UChar* end, UChar* s,
     break;
 
   case ONIG_OPTIMIZE_MAP:
+#ifdef USE_VECTOR_SEARCH_X86
+    if (USE_MAP_SEARCH_VECTOR(reg)) {
+      p = map_search_vector(reg, p, range);
+      break;
+    }
+#endif
     p = map_search(reg->enc, reg->map, p, range, end);
     break;
   }
@@ -3686,6 +4361,80 @@ forward_search_range(regex_t* reg, const UChar* str, const UChar* end, UChar* s,
   return 0; /* fail */
 }
 
+/* the first position from s at which a match may start, as far as the
+   optimizer can tell, or NULL if none can; for engines other than the VM */
+extern const UChar*
+onig_search_candidate(regex_t* reg, const UChar* str, const UChar* end,
+		      const UChar* s)
+{
+  UChar *low, *high;
+
+  if (reg->optimize == ONIG_OPTIMIZE_NONE) return s;
+  if (! forward_search_range(reg, str, end, (UChar* )s, (UChar* )end,
+			     &low, &high, (UChar** )NULL))
+    return (const UChar* )NULL;
+
+  /* the lower bound is only worked out if the distance is bounded */
+  if (reg->dmax == ONIG_INFINITE_DISTANCE || low < s) return s;
+  return low;
+}
+
+/* the first position from start at which a match may start, when every
+   match ends at the end of the text or of a line and its length is
+   bounded, or NULL if none can; start itself if the regex isn't anchored
+   this way. Onigmo's search does the same for the end of the text. */
+extern const UChar*
+onig_search_end_start(regex_t* reg, const UChar* str, const UChar* end,
+		      const UChar* start)
+{
+  const UChar *e, *p, *s;
+  OnigDistance dmin = reg->anchor_dmin, dmax = reg->anchor_dmax;
+
+  if ((reg->anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF |
+		      ANCHOR_END_LINE)) == 0 ||
+      (reg->anchor & (ANCHOR_BEGIN_BUF | ANCHOR_BEGIN_POSITION |
+		      ANCHOR_ANYCHAR_STAR_ML)) != 0 ||
+      dmax == ONIG_INFINITE_DISTANCE || IS_NEWLINE_CRLF(reg->options) ||
+      start < str || start > end)
+    return start;
+
+  if ((OnigDistance )(end - start) < dmin) return (const UChar* )NULL;
+
+  if (reg->anchor & (ANCHOR_END_BUF | ANCHOR_SEMI_END_BUF)) {
+    /* a match ends at the end, or before a final newline for \Z */
+    e = end;
+    if ((reg->anchor & ANCHOR_END_BUF) == 0 && str < end) {
+      p = ONIGENC_STEP_BACK(reg->enc, str, end, end, 1);
+      if (IS_NOT_NULL(p) && ONIGENC_IS_MBC_NEWLINE(reg->enc, p, end))
+	e = p;
+    }
+    /* past the final newline, only the end itself is left */
+    if (start > e) return start;
+    s = ((OnigDistance )(e - start) > dmax ? e - dmax : start);
+    if (s > str && s < end)
+      s = onigenc_get_right_adjust_char_head(reg->enc, str, s, end);
+    return (s <= end - dmin ? s : (const UChar* )NULL);
+  }
+
+  /* a match ends before a newline, or at the end; newlines are found
+     bytewise, and character heads in constant time, so only single-byte
+     encodings and UTF-8 are handled */
+  if (ONIGENC_MBC_MAXLEN(reg->enc) != 1 && reg->enc != ONIG_ENCODING_UTF8)
+    return start;
+
+  for (p = start + dmin; ; p = e + 1) {
+    e = (const UChar* )memchr(p, 0x0a, end - p);
+    if (IS_NULL(e)) e = end;
+
+    /* a line may be too short to hold a match that starts at a character */
+    s = ((OnigDistance )(e - start) > dmax ? e - dmax : start);
+    if (s > str && s < end)
+      s = onigenc_get_right_adjust_char_head(reg->enc, str, s, end);
+    if (s <= e - dmin) return s;
+    if (e >= end) return (const UChar* )NULL;
+  }
+}
+
 #define BM_BACKWARD_SEARCH_LENGTH_THRESHOLD   100
 
 static int
@@ -3720,6 +4469,12 @@ backward_search_range(regex_t* reg, const UChar* str, const UChar* end,
     break;
 
   case ONIG_OPTIMIZE_MAP:
+#ifdef USE_VECTOR_SEARCH_X86
+    if (USE_MAP_SEARCH_VECTOR(reg)) {
+      p = map_search_backward_vector(reg, range, p, end);
+      break;
+    }
+#endif
     p = map_search_backward(reg->enc, reg->map, range, adjrange, p, end);
     break;
   }
@@ -3781,17 +4536,46 @@ backward_search_range(regex_t* reg, const UChar* str, const UChar* end,
 }
 
 
+static OnigPosition
+search_in_range(regex_t* reg, const UChar* str, const UChar* end,
+		const UChar* global_pos, const UChar* start, const UChar* range,
+		OnigRegion* region, OnigOptionType option, OnigMatchStack* mstk);
+
 extern OnigPosition
 onig_search(regex_t* reg, const UChar* str, const UChar* end,
 	    const UChar* start, const UChar* range, OnigRegion* region, OnigOptionType option)
 {
-  return onig_search_gpos(reg, str, end, start, start, range, region, option);
+  return search_in_range(reg, str, end, start, start, range, region, option, NULL);
+}
+
+extern OnigPosition
+onig_search_with_stack(regex_t* reg, const UChar* str, const UChar* end,
+	    const UChar* start, const UChar* range, OnigRegion* region,
+	    OnigOptionType option, OnigMatchStack* stack)
+{
+  return search_in_range(reg, str, end, start, start, range, region, option, stack);
+}
+
+extern OnigPosition
+onig_search_gpos_with_stack(regex_t* reg, const UChar* str, const UChar* end,
+	    const UChar* global_pos, const UChar* start, const UChar* range,
+	    OnigRegion* region, OnigOptionType option, OnigMatchStack* stack)
+{
+  return search_in_range(reg, str, end, global_pos, start, range, region, option, stack);
 }
 
 extern OnigPosition
 onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
 	    const UChar* global_pos,
 	    const UChar* start, const UChar* range, OnigRegion* region, OnigOptionType option)
+{
+  return search_in_range(reg, str, end, global_pos, start, range, region, option, NULL);
+}
+
+static OnigPosition
+search_in_range(regex_t* reg, const UChar* str, const UChar* end,
+		const UChar* global_pos, const UChar* start, const UChar* range,
+		OnigRegion* region, OnigOptionType option, OnigMatchStack* mstk)
 {
   ptrdiff_t r;
   UChar *s, *prev;
@@ -3799,6 +4583,9 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
 #ifdef USE_MATCH_RANGE_MUST_BE_INSIDE_OF_SPECIFIED_RANGE
   const UChar *orig_start = start;
   const UChar *orig_range = range;
+  /* a forward search may become a backward one at the end of the text
+     (see end_buf below), but its matches may still extend to the range */
+  const UChar *back_range = (orig_range > orig_start ? orig_range : orig_start);
 #endif
 
 #ifdef ONIG_DEBUG_SEARCH
@@ -3970,6 +4757,8 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
       prev = (UChar* )NULL;
 
       MATCH_ARG_INIT(msa, option, region, start, start);
+      MATCH_STACK_ATTACH(msa, mstk);
+      MATCH_CACHE_INIT(msa, reg->options | option);
 #ifdef USE_COMBINATION_EXPLOSION_CHECK
       msa.state_check_buff = (void* )0;
       msa.state_check_buff_size = 0;   /* NO NEED, for valgrind */
@@ -3986,6 +4775,8 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
 #endif
 
   MATCH_ARG_INIT(msa, option, region, start, global_pos);
+  MATCH_STACK_ATTACH(msa, mstk);
+  MATCH_CACHE_INIT(msa, reg->options | option);
 #ifdef USE_COMBINATION_EXPLOSION_CHECK
   {
     int offset = (MIN(start, range) - str);
@@ -4088,7 +4879,7 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
 
 	  while (s >= low) {
 	    prev = onigenc_get_prev_char_head(reg->enc, str, s, end);
-	    MATCH_AND_RETURN_CHECK(orig_start);
+	    MATCH_AND_RETURN_CHECK(back_range);
 	    s = prev;
 	  }
 	} while (s >= range);
@@ -4116,7 +4907,7 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
 
     do {
       prev = onigenc_get_prev_char_head(reg->enc, str, s, end);
-      MATCH_AND_RETURN_CHECK(orig_start);
+      MATCH_AND_RETURN_CHECK(back_range);
       s = prev;
     } while (s >= range);
   }
@@ -4133,11 +4924,12 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
   r = ONIG_MISMATCH;
 
  finish:
+  MATCH_STACK_DETACH(msa, mstk);
   MATCH_ARG_FREE(msa);
 
   /* If result is mismatch and no FIND_NOT_EMPTY option,
      then the region is not set in match_at(). */
-  if (IS_FIND_NOT_EMPTY(reg->options) && region) {
+  if (IS_FIND_NOT_EMPTY(reg->options | option) && region) {
     onig_region_clear(region);
   }
 
@@ -4157,6 +4949,7 @@ onig_search_gpos(regex_t* reg, const UChar* str, const UChar* end,
   return r;
 
  match:
+  MATCH_STACK_DETACH(msa, mstk);
   MATCH_ARG_FREE(msa);
   return s - str;
 }
@@ -82,8 +82,32 @@
 #define USE_QTFR_PEEK_NEXT
 #define USE_ST_LIBRARY
 
+/* look up code points in large classes with two-level bitmaps, rather than
+   by binary search over their ranges, unless disabled at build time */
+#ifndef ONIG_NO_CODE_RANGE_TABLES
+# define USE_CODE_RANGE_TABLES
+#endif
+
+/* scan for exact strings a block at a time, unless disabled at build time;
+   x86-64 processors use SSE2, or AVX2 where available at run time, and
+   others rely on memchr() */
+#ifndef ONIG_NO_VECTOR_SEARCH
+# define USE_VECTOR_SEARCH
+# if (defined(__x86_64__) || defined(_M_AMD64)) && \
+     (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#  define USE_VECTOR_SEARCH_X86
+# endif
+#endif
+
+/* build a DFA program, for ONIG_OPTION_DFA, unless disabled at build time */
+#ifndef ONIG_NO_DFA
+# define USE_DFA
+#endif
+
 #define INIT_MATCH_STACK_SIZE                     160
 #define DEFAULT_MATCH_STACK_LIMIT_SIZE              0 /* unlimited */
+#define DEFAULT_RETRY_LIMIT_IN_SEARCH               0 /* unlimited */
+#define SEARCH_INTERRUPT_INTERVAL             0x10000 /* retries */
 #define DEFAULT_PARSE_DEPTH_LIMIT                4096
 
 #define OPT_EXACT_MAXLEN   24	/* This must be smaller than ONIG_CHAR_TABLE_SIZE. */
@@ -136,6 +160,8 @@
 #define USE_VARIABLE_META_CHARS
 #define USE_FIND_LONGEST_SEARCH_ALL_OF_RANGE
 /* #define USE_COMBINATION_EXPLOSION_CHECK */     /* (X*)* */
+#define USE_MATCH_CACHE       /* memoize backtracking: ONIG_OPTION_MATCH_CACHE */
+#define USE_RETRY_LIMIT_IN_SEARCH   /* limit and interrupt backtracking */
 
 
 #ifndef xmalloc
@@ -204,6 +230,7 @@
 
 #define STATE_CHECK_STRING_THRESHOLD_LEN             7
 #define STATE_CHECK_BUFF_MAX_SIZE               0x4000
+#define MATCH_CACHE_MAX_SIZE                 0x4000000   /* bytes */
 
 #define xmemset     memset
 #define xmemcpy     memcpy
@@ -391,6 +418,7 @@ typedef unsigned int  BitStatusType;
 #define IS_EXTEND(option)         ((option) & ONIG_OPTION_EXTEND)
 #define IS_FIND_LONGEST(option)   ((option) & ONIG_OPTION_FIND_LONGEST)
 #define IS_FIND_NOT_EMPTY(option) ((option) & ONIG_OPTION_FIND_NOT_EMPTY)
+#define IS_MATCH_CACHE(option)    ((option) & ONIG_OPTION_MATCH_CACHE)
 #define IS_FIND_CONDITION(option) ((option) & \
           (ONIG_OPTION_FIND_LONGEST | ONIG_OPTION_FIND_NOT_EMPTY))
 #define IS_NOTBOL(option)         ((option) & ONIG_OPTION_NOTBOL)
@@ -702,6 +730,10 @@ typedef void* PointerType;
 
 /* code point's address must be aligned address. */
 #define GET_CODE_POINT(code,p)   code = *((OnigCodePoint* )(p))
+
+/* set on the number of code ranges in a compiled character class when a
+   bitmap table for them follows the ranges */
+#define CODE_RANGE_TABLE_FLAG    ((OnigCodePoint )1 << 31)
 #define GET_BYTE_INC(byte,p) do{\
   byte = *(p);\
   (p)++;\
@@ -813,6 +845,10 @@ typedef struct {
   unsigned int flags;
   BitSet bs;
   BBuf*  mbuf;   /* multi-byte info or NULL */
+#ifdef USE_CODE_RANGE_TABLES
+  UChar* table;      /* bitmap table for mbuf, or NULL */
+  int    table_size; /* negative until the table is first needed */
+#endif
 } CClassNode;
 
 typedef intptr_t OnigStackIndex;
@@ -862,6 +898,14 @@ typedef struct _OnigStackType {
   } u;
 } OnigStackType;
 
+/* A heap-allocated backtrack stack, handed from one search to the next so
+   that a search which outgrows the initial stack on the C stack need not
+   allocate it again. NULL stack_p means no stack is held. */
+struct OnigMatchStackStruct {
+  void*  stack_p;
+  size_t stack_n;  /* in OnigStackType units */
+};
+
 typedef struct {
   void* stack_p;
   size_t stack_n;
@@ -877,6 +921,18 @@ typedef struct {
   void* state_check_buff;
   int   state_check_buff_size;
 #endif
+#ifdef USE_MATCH_CACHE
+  int    cache_state;        /* MATCH_CACHE_OFF, _WAIT or _ON */
+  size_t num_fails;          /* backtracks so far, while waiting */
+  size_t fail_threshold;     /* backtracks before the next step */
+  int    num_cache_points;   /* -1: program not analysed yet */
+  UChar** cache_points;      /* branching opcodes, in address order */
+  unsigned char* match_cache; /* a bit per cache point and position */
+#endif
+#ifdef USE_RETRY_LIMIT_IN_SEARCH
+  unsigned long retry_count; /* backtracks so far */
+  unsigned long retry_check; /* count at which to check the limit, or poll */
+#endif
 } OnigMatchArg;
 
 
@@ -915,12 +971,21 @@ extern void onig_vsnprintf_with_pattern(UChar buf[], int bufsize, OnigEncoding e
 extern void onig_snprintf_with_pattern(UChar buf[], int bufsize, OnigEncoding enc, UChar* pat, UChar* pat_end, const UChar *fmt, ...);
 extern int  onig_bbuf_init(BBuf* buf, OnigDistance size);
 extern int  onig_compile(regex_t* reg, const UChar* pattern, const UChar* pattern_end, OnigErrorInfo* einfo);
+extern const UChar* onig_search_candidate(regex_t* reg, const UChar* str, const UChar* end, const UChar* s);
 #ifdef RUBY
 extern int  onig_compile_ruby(regex_t* reg, const UChar* pattern, const UChar* pattern_end, OnigErrorInfo* einfo, const char *sourcefile, int sourceline);
 #endif
 extern void onig_transfer(regex_t* to, regex_t* from);
 extern int  onig_is_code_in_cc(OnigEncoding enc, OnigCodePoint code, CClassNode* cc);
 extern int  onig_is_code_in_cc_len(int enclen, OnigCodePoint code, CClassNode* cc);
+#ifdef USE_VECTOR_SEARCH
+extern void onig_vector_search_init(void);
+#endif
+extern int  onig_code_range_table_new(const OnigCodePoint* ranges, UChar** table, int* size);
+extern int  onig_is_in_code_range_table(const UChar* table, OnigCodePoint code);
+#ifdef USE_CODE_RANGE_TABLES
+extern void onigenc_unicode_ctype_table_init(void);
+#endif
 
 /* strend hash */
 typedef void hash_table_type;
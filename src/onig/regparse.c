@@ -929,6 +929,19 @@ onig_name_to_backref_number(regex_t* reg, const UChar* name,
   }
 }
 
+/* Add a group name to a compiled regex, as when restoring a serialised
+   program. The regex's own syntax governs whether names may be repeated. */
+extern int
+onig_add_name(regex_t* reg, const UChar* name, const UChar* name_end,
+	      int group_number)
+{
+  ScanEnv env;
+
+  xmemset(&env, 0, sizeof(env));
+  env.syntax = reg->syntax;
+  return name_add(reg, (UChar* )name, (UChar* )name_end, group_number, &env);
+}
+
 #else /* USE_NAMED_GROUP */
 
 extern int
@@ -952,6 +965,13 @@ onig_foreach_name(regex_t* reg,
   return ONIG_NO_SUPPORT_CONFIG;
 }
 
+extern int
+onig_add_name(regex_t* reg, const UChar* name, const UChar* name_end,
+	      int group_number)
+{
+  return ONIG_NO_SUPPORT_CONFIG;
+}
+
 extern int
 onig_number_of_names(const regex_t* reg)
 {
@@ -1090,6 +1110,10 @@ onig_node_free(Node* node)
 
       if (cc->mbuf)
 	bbuf_free(cc->mbuf);
+#ifdef USE_CODE_RANGE_TABLES
+      if (cc->table)
+	xfree(cc->table);
+#endif
     }
     break;
 
@@ -1134,6 +1158,10 @@ initialize_cclass(CClassNode* cc)
   /* cc->base.flags = 0; */
   cc->flags = 0;
   cc->mbuf  = NULL;
+#ifdef USE_CODE_RANGE_TABLES
+  cc->table = (UChar* )NULL;
+  cc->table_size = -1;
+#endif
 }
 
 static Node*
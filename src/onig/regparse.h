@@ -358,6 +358,7 @@ extern void   onig_node_str_clear(Node* node);
 extern int    onig_names_free(regex_t* reg);
 extern int    onig_parse_make_tree(Node** root, const UChar* pattern, const UChar* end, regex_t* reg, ScanEnv* env);
 extern int    onig_free_shared_cclass_table(void);
+extern int    onig_dfa_compile(regex_t* reg, Node* root);
 
 #ifdef ONIG_DEBUG
 # ifdef USE_NAMED_GROUP
@@ -0,0 +1,90 @@
+#include <R.h>
+#include <Rinternals.h>
+
+#include "stats.h"
+#include "scratch.h"
+
+// Backtracking stacks larger than this are released after a search rather than kept for the next one, so that one pathological search doesn't tie up memory indefinitely
+#define SCRATCH_MAX_STACK_SIZE  (1024 * 1024)
+
+// Scratch space for searches on the main thread, which is kept for the whole session
+static scratch_t ore_main_scratch = { NULL, NULL, NULL };
+
+// Set up scratch space for a series of searches, returning FALSE if memory could not be allocated
+// Each regex's DFA states are cached in the regex itself, but that cache can only be used by one thread, so worker threads get their own
+// This function does not use the R API, so it is safe to call from worker threads
+Rboolean ore_scratch_init (scratch_t *scratch)
+{
+    scratch->region = onig_region_new();
+    scratch->stack = onig_match_stack_new();
+    scratch->dfa = onig_dfa_cache_new();
+    return (scratch->region != NULL && scratch->stack != NULL && scratch->dfa != NULL);
+}
+
+// Record the high-water mark of a scratch space's stack and free it; this may be called from worker threads
+void ore_scratch_done (scratch_t *scratch)
+{
+    ore_match_stack_used(onig_match_stack_size(scratch->stack));
+    
+    if (scratch->region != NULL)
+        onig_region_free(scratch->region, 1);
+    onig_match_stack_free(scratch->stack);
+    onig_dfa_cache_free(scratch->dfa);
+    scratch->region = NULL;
+    scratch->stack = NULL;
+    scratch->dfa = NULL;
+}
+
+// Scratch space for the main thread, allocated the first time it is needed
+// If memory can't be allocated the region may be NULL, which searches report as an error; a NULL stack just means that each search allocates its own
+// Its DFA cache is always NULL, so that searches on the main thread use each regex's own, which lasts as long as the regex
+scratch_t * ore_scratch (void)
+{
+    if (ore_main_scratch.region == NULL)
+        ore_main_scratch.region = onig_region_new();
+    if (ore_main_scratch.stack == NULL)
+        ore_main_scratch.stack = onig_match_stack_new();
+    return &ore_main_scratch;
+}
+
+// Free the main thread's scratch space; called when the package is unloaded
+void ore_scratch_clear (void)
+{
+    if (ore_main_scratch.region != NULL)
+        onig_region_free(ore_main_scratch.region, 1);
+    onig_match_stack_free(ore_main_scratch.stack);
+    ore_main_scratch.region = NULL;
+    ore_main_scratch.stack = NULL;
+}
+
+// Take the region out of a scratch space for the duration of a search, so that a nested search (from an event handler run while checking for interrupts, say) creates its own rather than overwriting it
+// The result is NULL if memory could not be allocated
+OnigRegion * ore_scratch_take_region (scratch_t *scratch)
+{
+    OnigRegion *region = scratch->region;
+    scratch->region = NULL;
+    return (region == NULL ? onig_region_new() : region);
+}
+
+// Put a region back into a scratch space after a search, keeping whichever one is already there if a nested search has replaced it
+void ore_scratch_return_region (scratch_t *scratch, OnigRegion *region)
+{
+    if (region == NULL)
+        return;
+    else if (scratch->region == NULL)
+        scratch->region = region;
+    else
+        onig_region_free(region, 1);
+}
+
+// Record the high-water mark of the main thread's stack after a search, and release the stack if it has grown too large to be worth keeping
+void ore_scratch_update (scratch_t *scratch)
+{
+    const size_t size = onig_match_stack_size(scratch->stack);
+    if (size == 0)
+        return;
+    
+    ore_match_stack_used(size);
+    if (size > SCRATCH_MAX_STACK_SIZE)
+        onig_match_stack_clear(scratch->stack);
+}
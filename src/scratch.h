@@ -0,0 +1,27 @@
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+#include <R.h>
+#include "onigmo.h"
+
+typedef struct {
+    OnigRegion      * region;
+    OnigMatchStack  * stack;
+    OnigDfaCache    * dfa;
+} scratch_t;
+
+Rboolean ore_scratch_init (scratch_t *scratch);
+
+void ore_scratch_done (scratch_t *scratch);
+
+scratch_t * ore_scratch (void);
+
+void ore_scratch_clear (void);
+
+OnigRegion * ore_scratch_take_region (scratch_t *scratch);
+
+void ore_scratch_return_region (scratch_t *scratch, OnigRegion *region);
+
+void ore_scratch_update (scratch_t *scratch);
+
+#endif
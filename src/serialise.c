@@ -0,0 +1,441 @@
+#ifdef _WIN32
+#define _CRT_RAND_S
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rinternals.h>
+
+#include "text.h"
+#include "serialise.h"
+
+// Version of the serialised layout, which must be incremented whenever it changes
+#define SERIAL_FORMAT_VERSION   7
+
+// Marker used to check that the byte order of the reading and writing platforms agree
+#define SERIAL_BYTE_ORDER       0x01020304U
+
+#define SERIAL_MAGIC            "ORE"
+
+extern OnigSyntaxType *modified_ruby_syntax;
+
+typedef struct {
+    Rboolean        writing;
+    Rboolean        ok;
+    unsigned char * data;
+    size_t          size;
+    size_t          pos;
+} stream_t;
+
+// Transfer a field of a fixed-size type, in whichever direction the stream runs
+#define STREAM_FIELD(stream, field)     ore_stream_bytes((stream), &(field), sizeof(field))
+
+#define SIP_ROTL(x,b)           (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0,v1,v2,v3)  do { \
+    v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+    v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); \
+} while (0)
+
+// Secret key with which programs are signed; it is generated once per process, and never leaves it
+static uint64_t serial_key[2];
+static int serial_key_state = 0;
+
+// Generate the signing key from the system's random number generator, if that hasn't been done already
+// Returns FALSE if no random bytes are available, in which case no program can be trusted
+static Rboolean ore_serial_key_ready (void)
+{
+    if (serial_key_state == 0)
+    {
+        serial_key_state = -1;
+#ifdef _WIN32
+        unsigned int words[4];
+        if (rand_s(&words[0]) == 0 && rand_s(&words[1]) == 0 && rand_s(&words[2]) == 0 && rand_s(&words[3]) == 0)
+        {
+            serial_key[0] = ((uint64_t) words[0] << 32) | words[1];
+            serial_key[1] = ((uint64_t) words[2] << 32) | words[3];
+            serial_key_state = 1;
+        }
+#else
+        FILE *source = fopen("/dev/urandom", "rb");
+        if (source != NULL)
+        {
+            if (fread(serial_key, sizeof(uint64_t), 2, source) == 2)
+                serial_key_state = 1;
+            fclose(source);
+        }
+#endif
+    }
+    
+    return (serial_key_state == 1);
+}
+
+// SipHash-2-4 of the data under the signing key, which can't be forged without the key
+// Onigmo trusts its bytecode completely, so a program is only used if it carries a signature made by this process
+static uint64_t ore_signature (const unsigned char *data, const size_t len)
+{
+    uint64_t v0 = serial_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = serial_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = serial_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = serial_key[1] ^ 0x7465646279746573ULL;
+    
+    // Bytes are taken in little-endian order, and the last block is padded and ends with the length
+    const size_t n_blocks = len / 8;
+    for (size_t i=0; i<=n_blocks; i++)
+    {
+        uint64_t block = 0;
+        const size_t block_len = (i < n_blocks ? 8 : len % 8);
+        for (size_t j=0; j<block_len; j++)
+            block |= (uint64_t) data[8*i+j] << (8*j);
+        if (i == n_blocks)
+            block |= (uint64_t) (len & 0xff) << 56;
+        
+        v3 ^= block;
+        SIP_ROUND(v0,v1,v2,v3);
+        SIP_ROUND(v0,v1,v2,v3);
+        v0 ^= block;
+    }
+    
+    v2 ^= 0xff;
+    for (int i=0; i<4; i++)
+        SIP_ROUND(v0,v1,v2,v3);
+    
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Write bytes to the stream, or read them from it; a read beyond the end marks the stream as bad
+static void ore_stream_bytes (stream_t *stream, void *data, const size_t len)
+{
+    if (!stream->ok)
+        return;
+    
+    if (stream->writing)
+    {
+        if (stream->pos + len > stream->size)
+        {
+            size_t new_size = 2 * stream->size;
+            while (stream->pos + len > new_size)
+                new_size *= 2;
+            stream->data = (unsigned char *) ore_realloc(stream->data, new_size, stream->pos, 1);
+            stream->size = new_size;
+        }
+        memcpy(stream->data + stream->pos, data, len);
+    }
+    else if (len > stream->size - stream->pos)
+    {
+        stream->ok = FALSE;
+        return;
+    }
+    else
+        memcpy(data, stream->data + stream->pos, len);
+    
+    stream->pos += len;
+}
+
+// Transfer a block of natively allocated memory, allocating it first when reading
+static void ore_stream_block (stream_t *stream, unsigned char **block, const size_t len)
+{
+    if (!stream->writing && stream->ok)
+    {
+        // Check the length before allocating anything, in case the program is corrupt
+        if (len > stream->size - stream->pos || (*block = (unsigned char *) malloc(len > 0 ? len : 1)) == NULL)
+        {
+            stream->ok = FALSE;
+            return;
+        }
+    }
+    
+    ore_stream_bytes(stream, *block, len);
+}
+
+// Transfer a string, preceded by its length; when reading, the result points into the stream and is not nul-terminated
+static const char * ore_stream_string (stream_t *stream, const char *string, int *len)
+{
+    *len = (string == NULL ? 0 : (int) strlen(string));
+    STREAM_FIELD(stream, *len);
+    
+    if (stream->writing)
+    {
+        ore_stream_bytes(stream, (void *) string, *len);
+        return string;
+    }
+    else if (!stream->ok || *len < 0 || (size_t) *len > stream->size - stream->pos)
+    {
+        stream->ok = FALSE;
+        return NULL;
+    }
+    else
+    {
+        const char *result = (const char *) stream->data + stream->pos;
+        stream->pos += *len;
+        return result;
+    }
+}
+
+// Transfer the compiled program and optimisation data of a regex; the same function serves for reading and writing, so the layout always agrees
+// Pointer fields are transferred as the blocks they point to, and the regex's encoding and syntax are handled separately
+static void ore_stream_regex (stream_t *stream, regex_t *regex)
+{
+    STREAM_FIELD(stream, regex->used);
+    STREAM_FIELD(stream, regex->num_mem);
+    STREAM_FIELD(stream, regex->num_repeat);
+    STREAM_FIELD(stream, regex->num_null_check);
+    STREAM_FIELD(stream, regex->num_comb_exp_check);
+    STREAM_FIELD(stream, regex->num_call);
+    STREAM_FIELD(stream, regex->capture_history);
+    STREAM_FIELD(stream, regex->bt_mem_start);
+    STREAM_FIELD(stream, regex->bt_mem_end);
+    STREAM_FIELD(stream, regex->stack_pop_level);
+    STREAM_FIELD(stream, regex->repeat_range_alloc);
+    STREAM_FIELD(stream, regex->options);
+    STREAM_FIELD(stream, regex->case_fold_flag);
+    STREAM_FIELD(stream, regex->optimize);
+    STREAM_FIELD(stream, regex->threshold_len);
+    STREAM_FIELD(stream, regex->anchor);
+    STREAM_FIELD(stream, regex->anchor_dmin);
+    STREAM_FIELD(stream, regex->anchor_dmax);
+    STREAM_FIELD(stream, regex->sub_anchor);
+    STREAM_FIELD(stream, regex->map);
+    STREAM_FIELD(stream, regex->map_lo);
+    STREAM_FIELD(stream, regex->map_hi);
+    STREAM_FIELD(stream, regex->map_nibbles);
+    STREAM_FIELD(stream, regex->dmin);
+    STREAM_FIELD(stream, regex->dmax);
+    STREAM_FIELD(stream, regex->max_scan_len);
+    
+    // The bytecode itself
+    ore_stream_block(stream, &regex->p, regex->used);
+    if (!stream->writing)
+        regex->alloc = regex->used;
+    
+    // The exact string used to find candidate matches, if any
+    int exact_len = (int) (regex->exact_end - regex->exact);
+    STREAM_FIELD(stream, exact_len);
+    if (exact_len < 0)
+        stream->ok = FALSE;
+    else if (exact_len > 0)
+    {
+        ore_stream_block(stream, &regex->exact, exact_len);
+        if (stream->ok)
+            regex->exact_end = regex->exact + exact_len;
+    }
+    
+    // The literal pattern, if it can be searched for directly
+    int fixed_len = (int) (regex->fixed_end - regex->fixed);
+    STREAM_FIELD(stream, fixed_len);
+    if (fixed_len < 0)
+        stream->ok = FALSE;
+    else if (fixed_len > 0)
+    {
+        ore_stream_block(stream, &regex->fixed, fixed_len);
+        if (stream->ok)
+            regex->fixed_end = regex->fixed + fixed_len;
+    }
+    
+    // Literals which every match contains, if any
+    int required_len = (int) (regex->required_end - regex->required);
+    STREAM_FIELD(stream, required_len);
+    if (required_len < 0)
+        stream->ok = FALSE;
+    else if (required_len > 0)
+    {
+        ore_stream_block(stream, &regex->required, required_len);
+        if (stream->ok)
+            regex->required_end = regex->required + required_len;
+    }
+    
+    // The DFA program, if any, which holds offsets rather than pointers and so can be transferred as it is
+    int dfa_len = (int) (regex->dfa_end - regex->dfa);
+    STREAM_FIELD(stream, dfa_len);
+    if (dfa_len < 0)
+        stream->ok = FALSE;
+    else if (dfa_len > 0)
+    {
+        ore_stream_block(stream, &regex->dfa, dfa_len);
+        if (stream->ok)
+            regex->dfa_end = regex->dfa + dfa_len;
+    }
+    
+    // Ranges for counted repeats, if any
+    int n_ranges = (regex->repeat_range == NULL ? 0 : regex->repeat_range_alloc);
+    STREAM_FIELD(stream, n_ranges);
+    if (n_ranges < 0 || n_ranges > regex->repeat_range_alloc)
+        stream->ok = FALSE;
+    else if (n_ranges > 0)
+        ore_stream_block(stream, (unsigned char **) &regex->repeat_range, n_ranges * sizeof(OnigRepeatRange));
+}
+
+// Write out a group name and the groups it refers to; used as a callback by ore_serialise()
+static int ore_stream_name (const UChar *name, const UChar *name_end, int n_groups, int *group_numbers, regex_t *regex, void *arg)
+{
+    stream_t *stream = (stream_t *) arg;
+    int name_len = (int) (name_end - name);
+    STREAM_FIELD(stream, name_len);
+    ore_stream_bytes(stream, (void *) name, name_len);
+    STREAM_FIELD(stream, n_groups);
+    ore_stream_bytes(stream, group_numbers, n_groups * sizeof(int));
+    return 0;
+}
+
+// Find a built-in encoding by name
+static OnigEncoding ore_find_encoding (const char *name, const int len)
+{
+    static const OnigEncoding encodings[] = {
+        ONIG_ENCODING_ASCII, ONIG_ENCODING_UTF8, ONIG_ENCODING_UTF16_BE, ONIG_ENCODING_UTF16_LE, ONIG_ENCODING_UTF32_BE, ONIG_ENCODING_UTF32_LE,
+        ONIG_ENCODING_ISO_8859_1, ONIG_ENCODING_ISO_8859_2, ONIG_ENCODING_ISO_8859_3, ONIG_ENCODING_ISO_8859_4, ONIG_ENCODING_ISO_8859_5,
+        ONIG_ENCODING_ISO_8859_6, ONIG_ENCODING_ISO_8859_7, ONIG_ENCODING_ISO_8859_8, ONIG_ENCODING_ISO_8859_9, ONIG_ENCODING_ISO_8859_10,
+        ONIG_ENCODING_ISO_8859_11, ONIG_ENCODING_ISO_8859_13, ONIG_ENCODING_ISO_8859_14, ONIG_ENCODING_ISO_8859_15, ONIG_ENCODING_ISO_8859_16,
+        ONIG_ENCODING_WINDOWS_1250, ONIG_ENCODING_WINDOWS_1251, ONIG_ENCODING_WINDOWS_1252, ONIG_ENCODING_WINDOWS_1253, ONIG_ENCODING_WINDOWS_1254,
+        ONIG_ENCODING_WINDOWS_1257, ONIG_ENCODING_BIG5, ONIG_ENCODING_CP932, ONIG_ENCODING_EUC_JP, ONIG_ENCODING_EUC_KR, ONIG_ENCODING_EUC_TW,
+        ONIG_ENCODING_GB18030, ONIG_ENCODING_KOI8_R, ONIG_ENCODING_KOI8_U, ONIG_ENCODING_SJIS
+    };
+    
+    for (size_t i=0; i<sizeof(encodings)/sizeof(OnigEncoding); i++)
+    {
+        if (strlen(encodings[i]->name) == (size_t) len && strncmp(encodings[i]->name, name, len) == 0)
+            return encodings[i];
+    }
+    
+    return NULL;
+}
+
+// Convert a compiled regex to a signed raw vector, from which it can be restored later in the same process
+// The result is NULL if the regex can't be serialised, in which case it will have to be recompiled
+SEXP ore_serialise (regex_t *regex)
+{
+    const char *syntax_name;
+    if (!ore_serial_key_ready())
+        return R_NilValue;
+    else if (regex->syntax == modified_ruby_syntax)
+        syntax_name = "ruby";
+    else if (regex->syntax == ONIG_SYNTAX_ASIS)
+        syntax_name = "fixed";
+    else
+        return R_NilValue;
+    
+    stream_t stream = { TRUE, TRUE, NULL, 256, 0 };
+    stream.data = (unsigned char *) R_alloc(stream.size, 1);
+    
+    // The header records everything that must match for the program to be usable as it is
+    // The bytecode contains padding that depends on its alignment in memory, so that must be the same too
+    int header[] = { SERIAL_FORMAT_VERSION, ONIGMO_VERSION_MAJOR, ONIGMO_VERSION_MINOR, ONIGMO_VERSION_TEENY, sizeof(int), sizeof(long), sizeof(OnigDistance), (int) ((uintptr_t) regex->p % sizeof(long)) };
+    uint32_t byte_order = SERIAL_BYTE_ORDER;
+    int len;
+    ore_stream_bytes(&stream, (void *) SERIAL_MAGIC, 4);
+    STREAM_FIELD(&stream, byte_order);
+    STREAM_FIELD(&stream, header);
+    ore_stream_string(&stream, regex->enc->name, &len);
+    ore_stream_string(&stream, syntax_name, &len);
+    
+    ore_stream_regex(&stream, regex);
+    
+    int n_names = onig_number_of_names(regex);
+    STREAM_FIELD(&stream, n_names);
+    if (n_names > 0)
+        onig_foreach_name(regex, &ore_stream_name, &stream);
+    
+    uint64_t signature = ore_signature(stream.data, stream.pos);
+    STREAM_FIELD(&stream, signature);
+    
+    SEXP result = PROTECT(NEW_RAW(stream.pos));
+    memcpy(RAW(result), stream.data, stream.pos);
+    UNPROTECT(1);
+    return result;
+}
+
+// Restore a compiled regex from a raw vector created by ore_serialise() in this process
+// The result is NULL if the program was created by another process, or has been altered since, including by corruption
+regex_t * ore_unserialise (SEXP program)
+{
+    if (TYPEOF(program) != RAWSXP || (size_t) length(program) < 4 + sizeof(uint64_t) || !ore_serial_key_ready())
+        return NULL;
+    
+    stream_t stream = { FALSE, TRUE, RAW(program), (size_t) length(program), 0 };
+    
+    // Check the signature first, so that nothing else is read from a program this process didn't create
+    uint64_t signature;
+    stream.size -= sizeof(uint64_t);
+    memcpy(&signature, stream.data + stream.size, sizeof(uint64_t));
+    if (signature != ore_signature(stream.data, stream.size))
+        return NULL;
+    
+    char magic[4];
+    uint32_t byte_order;
+    int header[8];
+    ore_stream_bytes(&stream, magic, 4);
+    STREAM_FIELD(&stream, byte_order);
+    STREAM_FIELD(&stream, header);
+    if (!stream.ok || memcmp(magic, SERIAL_MAGIC, 4) != 0 || byte_order != SERIAL_BYTE_ORDER)
+        return NULL;
+    
+    const int expected[] = { SERIAL_FORMAT_VERSION, ONIGMO_VERSION_MAJOR, ONIGMO_VERSION_MINOR, ONIGMO_VERSION_TEENY, sizeof(int), sizeof(long), sizeof(OnigDistance) };
+    if (memcmp(header, expected, sizeof(expected)) != 0)
+        return NULL;
+    
+    // The encoding is stored by name, and must be one that this build knows about
+    int encoding_len, syntax_len;
+    const char *encoding_name = ore_stream_string(&stream, NULL, &encoding_len);
+    const char *syntax_name = ore_stream_string(&stream, NULL, &syntax_len);
+    if (!stream.ok)
+        return NULL;
+    
+    OnigEncoding onig_enc = ore_find_encoding(encoding_name, encoding_len);
+    OnigSyntaxType *syntax = NULL;
+    if (syntax_len == 4 && strncmp(syntax_name, "ruby", 4) == 0)
+        syntax = modified_ruby_syntax;
+    else if (syntax_len == 5 && strncmp(syntax_name, "fixed", 5) == 0)
+        syntax = (OnigSyntaxType *) ONIG_SYNTAX_ASIS;
+    
+    if (onig_enc == NULL || syntax == NULL)
+        return NULL;
+    
+    // All pointers start out NULL, so onig_free() can be used if anything goes wrong
+    regex_t *regex = (regex_t *) calloc(1, sizeof(regex_t));
+    if (regex == NULL)
+        return NULL;
+    regex->enc = onig_enc;
+    regex->syntax = syntax;
+    
+    ore_stream_regex(&stream, regex);
+    
+    // Group names are added back one group at a time
+    int n_names = 0;
+    STREAM_FIELD(&stream, n_names);
+    for (int i=0; stream.ok && i<n_names; i++)
+    {
+        int name_len, n_groups;
+        STREAM_FIELD(&stream, name_len);
+        if (!stream.ok || name_len <= 0 || (size_t) name_len > stream.size - stream.pos)
+        {
+            stream.ok = FALSE;
+            break;
+        }
+        const UChar *name = stream.data + stream.pos;
+        stream.pos += name_len;
+        
+        STREAM_FIELD(&stream, n_groups);
+        for (int j=0; stream.ok && j<n_groups; j++)
+        {
+            int group_number;
+            STREAM_FIELD(&stream, group_number);
+            if (stream.ok && onig_add_name(regex, name, name + name_len, group_number) != 0)
+                stream.ok = FALSE;
+        }
+    }
+    
+    // Everything must have been used, and the bytecode must have the same alignment as when it was compiled
+    if (!stream.ok || stream.pos != stream.size || (int) ((uintptr_t) regex->p % sizeof(long)) != header[7])
+    {
+        onig_free(regex);
+        return NULL;
+    }
+    
+    return regex;
+}
@@ -0,0 +1,11 @@
+#ifndef _SERIALISE_H_
+#define _SERIALISE_H_
+
+#include <Rinternals.h>
+#include "onigmo.h"
+
+SEXP ore_serialise (regex_t *regex);
+
+regex_t * ore_unserialise (SEXP program);
+
+#endif
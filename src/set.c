@@ -0,0 +1,374 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rinternals.h>
+
+#include "compile.h"
+#include "text.h"
+#include "match.h"
+#include "stats.h"
+#include "fixed.h"
+#include "scratch.h"
+#include "set.h"
+
+// Initial number of automaton states allocated; the arrays grow geometrically from here
+#define SET_INITIAL_STATES  64
+
+// A compiled pattern set: the regexes themselves, plus an Aho-Corasick automaton over the literal string that each regex requires, where there is one
+// State 0 is the root, whose transitions are held in a full table; other states keep their children in a linked list
+typedef struct {
+    int                 n_patterns;
+    regex_t          ** regexes;
+    int                 n_unfiltered;
+    int               * unfiltered;
+    int               * next_patterns;
+    
+    int                 n_states;
+    int                 capacity;
+    unsigned char     * labels;
+    int               * children;
+    int               * siblings;
+    int               * failures;
+    int               * outputs;
+    int               * first_patterns;
+    int                 root[256];
+    
+    Rboolean            complete;
+} patternset_t;
+
+static void ore_set_finaliser (SEXP set_ptr)
+{
+    patternset_t *set = (patternset_t *) R_ExternalPtrAddr(set_ptr);
+    if (set != NULL)
+    {
+        for (int i=0; i<set->n_patterns; i++)
+            onig_free(set->regexes[i]);
+        free(set->regexes);
+        free(set->unfiltered);
+        free(set->next_patterns);
+        free(set->labels);
+        free(set->children);
+        free(set->siblings);
+        free(set->failures);
+        free(set->outputs);
+        free(set->first_patterns);
+        free(set);
+    }
+    R_ClearExternalPtr(set_ptr);
+}
+
+// Resize one of the automaton's arrays, leaving it untouched if that fails
+static Rboolean ore_set_resize (void **array, const size_t size)
+{
+    void *new_array = realloc(*array, size);
+    if (new_array == NULL)
+        return FALSE;
+    *array = new_array;
+    return TRUE;
+}
+
+// Add a new, unconnected state to the automaton, returning its index
+static int ore_set_add_state (patternset_t *set, const unsigned char label)
+{
+    if (set->n_states == set->capacity)
+    {
+        const int capacity = set->capacity * 2;
+        if (!ore_set_resize((void **) &set->labels, capacity * sizeof(unsigned char)) ||
+            !ore_set_resize((void **) &set->children, capacity * sizeof(int)) ||
+            !ore_set_resize((void **) &set->siblings, capacity * sizeof(int)) ||
+            !ore_set_resize((void **) &set->failures, capacity * sizeof(int)) ||
+            !ore_set_resize((void **) &set->outputs, capacity * sizeof(int)) ||
+            !ore_set_resize((void **) &set->first_patterns, capacity * sizeof(int)))
+            error("Failed to allocate memory for the pattern set");
+        set->capacity = capacity;
+    }
+    
+    const int state = set->n_states++;
+    set->labels[state] = label;
+    set->children[state] = -1;
+    set->siblings[state] = -1;
+    set->failures[state] = 0;
+    set->outputs[state] = 0;
+    set->first_patterns[state] = -1;
+    return state;
+}
+
+// Find the child of a state with the specified label, or -1 if there isn't one
+static int ore_set_child (const patternset_t *set, const int state, const unsigned char label)
+{
+    if (state == 0)
+        return set->root[label] == 0 ? -1 : set->root[label];
+    
+    int child = set->children[state];
+    while (child >= 0 && set->labels[child] != label)
+        child = set->siblings[child];
+    return child;
+}
+
+// Add a pattern's literal to the trie underlying the automaton
+static void ore_set_add_literal (patternset_t *set, const unsigned char *literal, const size_t length, const int pattern)
+{
+    int state = 0;
+    for (size_t i=0; i<length; i++)
+    {
+        int child = ore_set_child(set, state, literal[i]);
+        if (child < 0)
+        {
+            child = ore_set_add_state(set, literal[i]);
+            if (state == 0)
+                set->root[literal[i]] = child;
+            else
+            {
+                set->siblings[child] = set->children[state];
+                set->children[state] = child;
+            }
+        }
+        state = child;
+    }
+    
+    set->next_patterns[pattern] = set->first_patterns[state];
+    set->first_patterns[state] = pattern;
+}
+
+// Work out failure links breadth-first, along with output links to the nearest state on the failure chain at which a literal ends
+static void ore_set_link (patternset_t *set)
+{
+    int *queue = (int *) R_alloc(set->n_states, sizeof(int));
+    int head = 0, tail = 0;
+    
+    for (int c=0; c<256; c++)
+    {
+        if (set->root[c] != 0)
+            queue[tail++] = set->root[c];
+    }
+    
+    while (head < tail)
+    {
+        const int state = queue[head++];
+        for (int child = set->children[state]; child >= 0; child = set->siblings[child])
+        {
+            const unsigned char label = set->labels[child];
+            int failure = set->failures[state];
+            while (failure != 0 && ore_set_child(set, failure, label) < 0)
+                failure = set->failures[failure];
+            
+            const int target = ore_set_child(set, failure, label);
+            set->failures[child] = (target < 0 ? 0 : target);
+            set->outputs[child] = (set->first_patterns[set->failures[child]] >= 0 ? set->failures[child] : set->outputs[set->failures[child]]);
+            queue[tail++] = child;
+        }
+    }
+}
+
+// Compile every pattern and build the automaton, storing the result in the specified pointer
+// The pointer owns the partial set from the start, so that nothing leaks if compilation fails
+static patternset_t * ore_set_compile (SEXP patterns_, SEXP set_ptr, const char *options, const char *encoding_name, const char *syntax_name)
+{
+    const int n_patterns = length(patterns_);
+    encoding_t *encoding = ore_build_encoding(encoding_name, STRING_ELT(patterns_, 0));
+    
+    patternset_t *set = (patternset_t *) calloc(1, sizeof(patternset_t));
+    if (set == NULL)
+        error("Failed to allocate memory for the pattern set");
+    R_SetExternalPtrAddr(set_ptr, set);
+    R_RegisterCFinalizerEx(set_ptr, &ore_set_finaliser, FALSE);
+    ore_keep_source(set_ptr, patterns_);
+    
+    set->regexes = (regex_t **) calloc(n_patterns, sizeof(regex_t *));
+    set->unfiltered = (int *) malloc(n_patterns * sizeof(int));
+    set->next_patterns = (int *) malloc(n_patterns * sizeof(int));
+    set->labels = (unsigned char *) malloc(SET_INITIAL_STATES * sizeof(unsigned char));
+    set->children = (int *) malloc(SET_INITIAL_STATES * sizeof(int));
+    set->siblings = (int *) malloc(SET_INITIAL_STATES * sizeof(int));
+    set->failures = (int *) malloc(SET_INITIAL_STATES * sizeof(int));
+    set->outputs = (int *) malloc(SET_INITIAL_STATES * sizeof(int));
+    set->first_patterns = (int *) malloc(SET_INITIAL_STATES * sizeof(int));
+    if (set->regexes == NULL || set->unfiltered == NULL || set->next_patterns == NULL || set->labels == NULL || set->children == NULL || set->siblings == NULL || set->failures == NULL || set->outputs == NULL || set->first_patterns == NULL)
+        error("Failed to allocate memory for the pattern set");
+    set->capacity = SET_INITIAL_STATES;
+    ore_set_add_state(set, 0);
+    
+    for (int i=0; i<n_patterns; i++)
+    {
+        if (STRING_ELT(patterns_, i) == NA_STRING)
+            error("Pattern %d is missing", i+1);
+        
+        set->regexes[i] = ore_compile(CHAR(STRING_ELT(patterns_,i)), options, encoding, syntax_name);
+        set->n_patterns = i + 1;
+        
+        // Patterns without a required literal are always candidates
+        const UChar *literal_start, *literal_end;
+        if (onig_get_exact_literal(set->regexes[i], &literal_start, &literal_end))
+            ore_set_add_literal(set, literal_start, (size_t) (literal_end - literal_start), i);
+        else
+            set->unfiltered[set->n_unfiltered++] = i;
+    }
+    
+    ore_set_link(set);
+    set->complete = TRUE;
+    return set;
+}
+
+// Build an "oreset" object from a vector of patterns
+SEXP ore_set_build (SEXP patterns_, SEXP options_, SEXP encoding_name_, SEXP syntax_name_)
+{
+    if (length(patterns_) == 0)
+        error("No patterns have been given");
+    if (!isString(patterns_))
+        error("Patterns should be character strings");
+    
+    const char *options = CHAR(STRING_ELT(options_, 0));
+    const char *encoding_name = CHAR(STRING_ELT(encoding_name_, 0));
+    const char *syntax_name = CHAR(STRING_ELT(syntax_name_, 0));
+    
+    SEXP result = PROTECT(duplicate(patterns_));
+    SEXP set_ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+    ore_set_compile(result, set_ptr, options, encoding_name, syntax_name);
+    
+    setAttrib(result, install(".compiled"), set_ptr);
+    setAttrib(result, install("options"), PROTECT(ScalarString(STRING_ELT(options_, 0))));
+    setAttrib(result, install("syntax"), PROTECT(ScalarString(STRING_ELT(syntax_name_, 0))));
+    setAttrib(result, install("encoding"), PROTECT(ScalarString(STRING_ELT(encoding_name_, 0))));
+    setAttrib(result, R_ClassSymbol, mkString("oreset"));
+    
+    UNPROTECT(5);
+    return result;
+}
+
+// Obtain an attribute of a set as a C string, or the specified default if it's missing
+static const char * ore_set_attrib (SEXP set_, const char *name, const char *default_value)
+{
+    SEXP value = getAttrib(set_, install(name));
+    if (isString(value) && length(value) > 0 && STRING_ELT(value,0) != NA_STRING)
+        return CHAR(STRING_ELT(value, 0));
+    else
+        return default_value;
+}
+
+// Retrieve the compiled form of a set, recompiling it if the pointer has been lost (e.g. by serialisation)
+static patternset_t * ore_set_retrieve (SEXP set_)
+{
+    SEXP set_ptr = getAttrib(set_, install(".compiled"));
+    if (!inherits(set_, "oreset") || !isString(set_) || length(set_) == 0 || TYPEOF(set_ptr) != EXTPTRSXP)
+        error("The specified pattern set is not valid");
+    
+    patternset_t *set = (patternset_t *) R_ExternalPtrAddr(set_ptr);
+    if (set == NULL)
+    {
+        set = ore_set_compile(set_, set_ptr, ore_set_attrib(set_, "options", ""), ore_set_attrib(set_, "encoding", "auto"), ore_set_attrib(set_, "syntax", "ruby"));
+        ore_counters.programs_recompiled++;
+    }
+    
+    if (!set->complete || set->n_patterns != length(set_))
+        error("The specified pattern set is not valid");
+    
+    // The automaton and regexes were built for the original patterns, and would silently give their indices if the set were modified
+    if (ore_source_changed(set_ptr, set_))
+        error("The specified pattern set has been modified since it was built, and should be rebuilt with ore_set()");
+    
+    return set;
+}
+
+static int ore_set_compare (const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+// Find the patterns in a set that match each element of a character vector, returning a list of their indices
+// The automaton is run over each element once to find the patterns whose literals are present, and only those (plus any without a literal) are passed to Onigmo
+SEXP ore_set_match_all (SEXP set_, SEXP text_)
+{
+    patternset_t *set = ore_set_retrieve(set_);
+    PROTECT(text_ = AS_CHARACTER(text_));
+    const int n_patterns = set->n_patterns;
+    
+    // Each candidate is recorded once per element, using the element number as a stamp
+    int *stamps = (int *) R_alloc(n_patterns, sizeof(int));
+    int *candidates = (int *) R_alloc(n_patterns, sizeof(int));
+    int *matched = (int *) R_alloc(n_patterns, sizeof(int));
+    for (int j=0; j<n_patterns; j++)
+        stamps[j] = -1;
+    
+    const int text_len = length(text_);
+    SEXP results = PROTECT(NEW_LIST(text_len));
+    
+    ore_search_limits();
+    scratch_t *scratch = ore_scratch();
+    for (int i=0; i<text_len; i++)
+    {
+        ore_poll_interrupt((size_t) i, R_NilValue);
+        
+        const SEXP element = STRING_ELT(text_, i);
+        if (element == NA_STRING)
+        {
+            SET_ELEMENT(results, i, ScalarInteger(NA_INTEGER));
+            continue;
+        }
+        else if (!ore_consistent_encodings(ore_r_to_onig_enc(getCharCE(element)), set->regexes[0]->enc))
+        {
+            warning("Encoding of text element %d does not match the regex", i+1);
+            SET_ELEMENT(results, i, NEW_INTEGER(0));
+            continue;
+        }
+        
+        const UChar *string = (const UChar *) CHAR(element);
+        const UChar *end_ptr = string + LENGTH(element);
+        
+        int n_candidates = 0;
+        int state = 0;
+        for (const UChar *ptr = string; ptr < end_ptr; ptr++)
+        {
+            int next = 0;
+            while (state != 0 && (next = ore_set_child(set, state, *ptr)) < 0)
+                state = set->failures[state];
+            state = (state == 0 ? set->root[*ptr] : next);
+            
+            // Every literal ending here is marked, including those that are suffixes of the current path
+            for (int output = (set->first_patterns[state] >= 0 ? state : set->outputs[state]); output != 0; output = set->outputs[output])
+            {
+                for (int j = set->first_patterns[output]; j >= 0; j = set->next_patterns[j])
+                {
+                    if (stamps[j] != i)
+                    {
+                        stamps[j] = i;
+                        candidates[n_candidates++] = j;
+                    }
+                }
+            }
+        }
+        
+        ore_counters.prefilter_skips += n_patterns - set->n_unfiltered - n_candidates;
+        for (int j=0; j<set->n_unfiltered; j++)
+            candidates[n_candidates++] = set->unfiltered[j];
+        qsort(candidates, n_candidates, sizeof(int), &ore_set_compare);
+        
+        // Only a yes-or-no answer is needed, so there's no region or match data
+        int n_matched = 0;
+        for (int k=0; k<n_candidates; k++)
+        {
+            regex_t *regex = set->regexes[candidates[k]];
+            if (!ore_required_present(regex, string, end_ptr))
+                continue;
+            
+            const OnigPosition return_value = ore_search_once(regex, string, end_ptr, string, NULL, scratch, ore_string_ascii(element));
+            ore_scratch_update(scratch);
+            if (return_value >= 0)
+                matched[n_matched++] = candidates[k] + 1;
+            else if (return_value != ONIG_MISMATCH)
+                ore_search_error(return_value);
+        }
+        
+        SEXP indices = PROTECT(NEW_INTEGER(n_matched));
+        if (n_matched > 0)
+            memcpy(INTEGER(indices), matched, n_matched * sizeof(int));
+        SET_ELEMENT(results, i, indices);
+        UNPROTECT(1);
+    }
+    
+    setAttrib(results, R_NamesSymbol, getAttrib(text_, R_NamesSymbol));
+    
+    UNPROTECT(2);
+    return results;
+}
@@ -0,0 +1,8 @@
+#ifndef _SET_H_
+#define _SET_H_
+
+SEXP ore_set_build (SEXP patterns_, SEXP options_, SEXP encoding_name_, SEXP syntax_name_);
+
+SEXP ore_set_match_all (SEXP set_, SEXP text_);
+
+#endif
@@ -1,5 +1,3 @@
-#include <string.h>
-
 #include <R.h>
 #include <Rdefines.h>
 #include <Rinternals.h>
@@ -7,6 +5,7 @@
 #include "compile.h"
 #include "text.h"
 #include "match.h"
+#include "stats.h"
 #include "split.h"
 
 // Split the strings provided at matches to the regex
@@ -16,8 +15,13 @@ SEXP ore_split (SEXP regex_, SEXP text_, SEXP start_, SEXP simplify_)
         error("The specified regex object is not valid");
     
     // Convert R objects to C types
-    text_t *text = ore_text(text_);
+    text_t *text = ore_text(text_, FALSE);
     regex_t *regex = ore_retrieve(regex_, text->encoding);
+    
+    // The regex, and each element's match data while the pieces are created, are held by an owner
+    SEXP owner = PROTECT(ore_owner(regex, regex_, 1));
+    rawmatch_t **raw_matches = ore_owner_matches(owner);
+    
     const Rboolean simplify = asLogical(simplify_) == TRUE;
     int *start = INTEGER(start_);
     
@@ -27,15 +31,20 @@ SEXP ore_split (SEXP regex_, SEXP text_, SEXP start_, SEXP simplify_)
     // Check for sensible input
     if (start_len < 1)
     {
-        ore_free(regex, regex_);
+        ore_owner_release(owner);
         error("The vector of starting positions is empty");
     }
     
+    ore_memory_reset_peak();
+    ore_search_limits();
+    
     SEXP results = PROTECT(NEW_LIST(text->length));
     
     // Step through each string to be searched
     for (int i=0; i<text->length; i++)
     {
+        ore_poll_interrupt((size_t) i, owner);
+        
         text_element_t *text_element = ore_text_element(text, i, FALSE, NULL);
         if (text_element == NULL)
         {
@@ -50,7 +59,7 @@ SEXP ore_split (SEXP regex_, SEXP text_, SEXP start_, SEXP simplify_)
         }
         
         // Do the match
-        rawmatch_t *raw_match = ore_search(regex, text_element->start, text_element->end, TRUE, (size_t) start[i % start_len] - 1);
+        rawmatch_t *raw_match = raw_matches[0] = ore_search(regex, text_element->start, text_element->end, text_element->ascii, TRUE, (size_t) start[i % start_len] - 1);
         
         // If there's no match the return value is the original string
         if (raw_match == NULL)
@@ -60,45 +69,34 @@ SEXP ore_split (SEXP regex_, SEXP text_, SEXP start_, SEXP simplify_)
             // Create a vector long enough to hold the pieces
             SEXP result = PROTECT(NEW_CHARACTER(raw_match->n_matches + 1));
             
-            char *fragment;
+            // Each piece is created directly from the text, without an intermediate copy
             ptrdiff_t offset = 0;
-            size_t current_length;
             for (int j=0; j<raw_match->n_matches; j++)
             {
                 const size_t loc = j * raw_match->n_regions;
-                
-                // Work out the length of the piece and allocate memory for it
-                current_length = raw_match->byte_offsets[loc] - offset;
-                fragment = R_alloc(current_length+1, 1);
-                
-                // Copy text in, and insert the string into the return value
-                if (current_length > 0)
-                    strncpy(fragment, text_element->start+offset, current_length);
-                *(fragment + current_length) = '\0';
-                SET_STRING_ELT(result, j, ore_string_to_rchar(fragment, text_element->encoding));
+                const size_t current_length = raw_match->byte_offsets[loc] - offset;
+                SET_STRING_ELT(result, j, ore_fragment_to_rchar(text_element->start+offset, current_length, text_element->encoding));
                 offset += current_length + raw_match->byte_lengths[loc];
             }
             
             // Likewise for the last piece
-            current_length = strlen(text_element->start) - offset;
-            fragment = R_alloc(current_length+1, 1);
-            if (current_length > 0)
-                strncpy(fragment, text_element->start+offset, current_length);
-            *(fragment + current_length) = '\0';
-            SET_STRING_ELT(result, raw_match->n_matches, ore_string_to_rchar(fragment, text_element->encoding));
+            SET_STRING_ELT(result, raw_match->n_matches, ore_fragment_to_rchar(text_element->start+offset, (size_t) (text_element->end - text_element->start) - offset, text_element->encoding));
             
             SET_ELEMENT(results, i, result);
             UNPROTECT(1);
+            
+            ore_rawmatch_free(raw_match);
+            raw_matches[0] = NULL;
         }
     }
     
     if (text->source == VECTOR_SOURCE)
         setAttrib(results, R_NamesSymbol, getAttrib(text->object,R_NamesSymbol));
     
-    ore_free(regex, regex_);
+    ore_owner_release(owner);
     ore_text_done(text);
     
-    UNPROTECT(1);
+    UNPROTECT(2);
     
     // Return just the first (and only) element of the full list, if requested
     if (simplify && text->length == 1)
@@ -0,0 +1,147 @@
+#include <string.h>
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rinternals.h>
+
+#include "cache.h"
+#include "stats.h"
+
+// Process-wide instrumentation counters, updated by the other parts of the package
+counters_t ore_counters;
+
+// Record native memory allocated for match data; this may be called from worker threads
+void ore_memory_allocated (const size_t bytes)
+{
+#ifdef _OPENMP
+    #pragma omp critical(ore_memory)
+#endif
+    {
+        ore_counters.match_memory += (double) bytes;
+        if (ore_counters.match_memory > ore_counters.peak_match_memory)
+            ore_counters.peak_match_memory = ore_counters.match_memory;
+    }
+}
+
+// Record native memory for match data being freed; this may be called from worker threads
+void ore_memory_freed (const size_t bytes)
+{
+#ifdef _OPENMP
+    #pragma omp critical(ore_memory)
+#endif
+    ore_counters.match_memory -= (double) bytes;
+}
+
+// Start tracking peak memory use afresh; called at the start of each search
+void ore_memory_reset_peak (void)
+{
+    ore_counters.peak_match_memory = ore_counters.match_memory;
+}
+
+// Record a search skipped because the text lacks a literal that any match would contain; this may be called from worker threads
+void ore_prefilter_skipped (void)
+{
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    ore_counters.prefilter_skips++;
+}
+
+// Record the size of a backtracking stack kept for reuse between searches, if it is the largest so far; this may be called from worker threads
+void ore_match_stack_used (const size_t bytes)
+{
+#ifdef _OPENMP
+    #pragma omp critical(ore_memory)
+#endif
+    {
+        if ((double) bytes > ore_counters.peak_match_stack)
+            ore_counters.peak_match_stack = (double) bytes;
+    }
+}
+
+// Record a search attempted with a regex's DFA, and whether it had to be repeated with backtracking; this may be called from worker threads
+void ore_dfa_searched (const Rboolean fallback)
+{
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    ore_counters.dfa_searches++;
+    
+    if (fallback)
+    {
+#ifdef _OPENMP
+        #pragma omp atomic
+#endif
+        ore_counters.dfa_fallbacks++;
+    }
+}
+
+// Record a search of an end-anchored regex made backwards from the end of the text with its DFA; this may be called from worker threads
+void ore_reverse_searched (void)
+{
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    ore_counters.reverse_searches++;
+}
+
+// Record a search of an end-anchored regex started near the end of the text or a line, because its matches are bounded in length; this may be called from worker threads
+void ore_end_anchor_skipped (void)
+{
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    ore_counters.end_anchor_skips++;
+}
+
+// Report the current counter values as a named list, optionally resetting them afterwards
+SEXP ore_stats (SEXP reset_)
+{
+    const Rboolean reset = asLogical(reset_) == TRUE;
+    
+    SEXP result = PROTECT(NEW_LIST(14));
+    SEXP names = PROTECT(NEW_CHARACTER(14));
+    
+    SET_STRING_ELT(names, 0, mkChar("cacheSize"));
+    SET_STRING_ELT(names, 1, mkChar("cacheCapacity"));
+    SET_STRING_ELT(names, 2, mkChar("cacheHits"));
+    SET_STRING_ELT(names, 3, mkChar("cacheMisses"));
+    SET_STRING_ELT(names, 4, mkChar("cacheEvictions"));
+    SET_STRING_ELT(names, 5, mkChar("programsRestored"));
+    SET_STRING_ELT(names, 6, mkChar("programsRecompiled"));
+    SET_STRING_ELT(names, 7, mkChar("prefilterSkips"));
+    SET_STRING_ELT(names, 8, mkChar("peakMatchMemory"));
+    SET_STRING_ELT(names, 9, mkChar("peakMatchStack"));
+    SET_STRING_ELT(names, 10, mkChar("dfaSearches"));
+    SET_STRING_ELT(names, 11, mkChar("dfaFallbacks"));
+    SET_STRING_ELT(names, 12, mkChar("reverseSearches"));
+    SET_STRING_ELT(names, 13, mkChar("endAnchorSkips"));
+    
+    SET_ELEMENT(result, 0, ScalarInteger(ore_cache_size()));
+    SET_ELEMENT(result, 1, ScalarInteger(ore_cache_capacity()));
+    SET_ELEMENT(result, 2, ScalarReal(ore_counters.cache_hits));
+    SET_ELEMENT(result, 3, ScalarReal(ore_counters.cache_misses));
+    SET_ELEMENT(result, 4, ScalarReal(ore_counters.cache_evictions));
+    SET_ELEMENT(result, 5, ScalarReal(ore_counters.programs_restored));
+    SET_ELEMENT(result, 6, ScalarReal(ore_counters.programs_recompiled));
+    SET_ELEMENT(result, 7, ScalarReal(ore_counters.prefilter_skips));
+    SET_ELEMENT(result, 8, ScalarReal(ore_counters.peak_match_memory));
+    SET_ELEMENT(result, 9, ScalarReal(ore_counters.peak_match_stack));
+    SET_ELEMENT(result, 10, ScalarReal(ore_counters.dfa_searches));
+    SET_ELEMENT(result, 11, ScalarReal(ore_counters.dfa_fallbacks));
+    SET_ELEMENT(result, 12, ScalarReal(ore_counters.reverse_searches));
+    SET_ELEMENT(result, 13, ScalarReal(ore_counters.end_anchor_skips));
+    
+    setAttrib(result, R_NamesSymbol, names);
+    
+    // Memory still in use can't be reset, since it will be freed later
+    if (reset)
+    {
+        const double match_memory = ore_counters.match_memory;
+        memset(&ore_counters, 0, sizeof(counters_t));
+        ore_counters.match_memory = ore_counters.peak_match_memory = match_memory;
+    }
+    
+    UNPROTECT(2);
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+typedef struct {
+    double  cache_hits;
+    double  cache_misses;
+    double  cache_evictions;
+    double  programs_restored;
+    double  programs_recompiled;
+    double  prefilter_skips;
+    double  match_memory;
+    double  peak_match_memory;
+    double  peak_match_stack;
+    double  dfa_searches;
+    double  dfa_fallbacks;
+    double  reverse_searches;
+    double  end_anchor_skips;
+} counters_t;
+
+extern counters_t ore_counters;
+
+void ore_memory_allocated (const size_t bytes);
+
+void ore_memory_freed (const size_t bytes);
+
+void ore_memory_reset_peak (void);
+
+void ore_prefilter_skipped (void);
+
+void ore_match_stack_used (const size_t bytes);
+
+void ore_dfa_searched (const Rboolean fallback);
+
+void ore_reverse_searched (void);
+
+void ore_end_anchor_skipped (void);
+
+SEXP ore_stats (SEXP reset_);
+
+#endif
@@ -7,6 +7,7 @@
 #include "compile.h"
 #include "text.h"
 #include "match.h"
+#include "stats.h"
 #include "subst.h"
 
 regex_t *group_number_regex;
@@ -19,37 +20,76 @@ typedef struct {
     int   * group_numbers;
 } backref_info_t;
 
+// A rule in a switch set; rules without a regex match unconditionally
+typedef struct {
+    regex_t         * regex;
+    backref_info_t  * backref_info;
+    const char      * literal;
+    size_t            literal_len;
+} switch_rule_t;
+
+typedef struct {
+    int               n_rules;
+    switch_rule_t   * rules;
+    Rboolean          complete;
+} switchset_t;
+
 // Replace substrings at the specified (byte) offsets with the literal replacements given
-static char * ore_substitute (const char *text, const int n_matches, const int *offsets, const int *lengths, const char **replacements)
+// Neither the text nor the replacements need be nul-terminated, but the result is, and its length is returned through the last argument
+static char * ore_substitute (const char *text, const size_t text_len, const int n_matches, const int *offsets, const int *lengths, const char **replacements, const int *rep_lengths, size_t *result_len)
 {
-    // Work out the length of each replacement string, and of the final text
-    int *rep_lengths = (int *) R_alloc(n_matches, sizeof(int));
-    size_t orig_len = strlen(text);
-    size_t string_len = orig_len;
+    // Work out the length of the final text
+    size_t string_len = text_len;
     for (int i=0; i<n_matches; i++)
-    {
-        rep_lengths[i] = strlen(replacements[i]);
         string_len += rep_lengths[i] - lengths[i];
-    }
     
     // Work through the string, drawing from the original and the replacements in turn
-    int start = 0;
+    size_t start = 0;
     char *result = R_alloc(string_len+1, 1);
     char *result_ptr = result;
     for (int i=0; i<n_matches; i++)
     {
-        strncpy(result_ptr, text+start, offsets[i]-start);
+        memcpy(result_ptr, text+start, offsets[i]-start);
         result_ptr += offsets[i] - start;
-        strncpy(result_ptr, replacements[i], rep_lengths[i]);
+        memcpy(result_ptr, replacements[i], rep_lengths[i]);
         result_ptr += rep_lengths[i];
         start = offsets[i] + lengths[i];
     }
     
     // Add any text after the last match
-    if (start < orig_len)
-        strncpy(result_ptr, text+start, orig_len-start);
+    if (start < text_len)
+        memcpy(result_ptr, text+start, text_len-start);
     *(result + string_len) = '\0';
     
+    if (result_len != NULL)
+        *result_len = string_len;
+    return result;
+}
+
+// Fill in the back-references in a replacement template, using the text matched by groups in the specified match
+// Group text is taken directly from the source, and groups that did not take part in the match are treated as empty
+static const char * ore_expand_backrefs (SEXP template, const backref_info_t *info, const char *text, const rawmatch_t *match, const int index, int *length)
+{
+    const char **backref_replacements = (const char **) R_alloc(info->n, sizeof(char *));
+    int *backref_lengths = (int *) R_alloc(info->n, sizeof(int));
+    for (int k=0; k<info->n; k++)
+    {
+        const size_t loc = (size_t) index * match->n_regions + info->group_numbers[k];
+        if (match->byte_offsets[loc] < 0)
+        {
+            backref_replacements[k] = "";
+            backref_lengths[k] = 0;
+        }
+        else
+        {
+            backref_replacements[k] = text + match->byte_offsets[loc];
+            backref_lengths[k] = match->byte_lengths[loc];
+        }
+    }
+    
+    size_t result_len;
+    const char *result = ore_substitute(CHAR(template), (size_t) LENGTH(template), info->n, info->offsets, info->lengths, backref_replacements, backref_lengths, &result_len);
+    *length = (int) result_len;
     return result;
 }
 
@@ -57,8 +97,8 @@ static char * ore_substitute (const char *text, const int n_matches, const int *
 static backref_info_t * ore_find_backrefs (const char *replacement, regex_t *regex)
 {
     // Match against global regexes for each type of back-reference
-    rawmatch_t *group_number_match = ore_search(group_number_regex, replacement, NULL, TRUE, 0);
-    rawmatch_t *group_name_match = ore_search(group_name_regex, replacement, NULL, TRUE, 0);
+    rawmatch_t *group_number_match = ore_search(group_number_regex, replacement, NULL, FALSE, TRUE, 0);
+    rawmatch_t *group_name_match = ore_search(group_name_regex, replacement, NULL, FALSE, TRUE, 0);
     
     // If there is no back-reference, return
     if (group_number_match == NULL && group_name_match == NULL)
@@ -88,7 +128,7 @@ static backref_info_t * ore_find_backrefs (const char *replacement, regex_t *reg
                 const size_t loc = i * group_number_match->n_regions;
                 info->offsets[l] = group_number_match->byte_offsets[loc];
                 info->lengths[l] = group_number_match->byte_lengths[loc];
-                info->group_numbers[l] = (int) strtol(group_number_match->matches[loc+1], NULL, 10);
+                info->group_numbers[l] = (int) strtol(replacement + group_number_match->byte_offsets[loc+1], NULL, 10);
                 
                 // Find the next number match, if there is one
                 i++;
@@ -100,9 +140,9 @@ static backref_info_t * ore_find_backrefs (const char *replacement, regex_t *reg
                 info->offsets[l] = group_name_match->byte_offsets[loc];
                 info->lengths[l] = group_name_match->byte_lengths[loc];
                 
-                const char *name = group_name_match->matches[loc+1];
+                const char *name = replacement + group_name_match->byte_offsets[loc+1];
                 int *numbers;
-                const int n_matched = onig_name_to_group_numbers(regex, (const UChar *) name, (const UChar *) name + strlen(name), &numbers);
+                const int n_matched = onig_name_to_group_numbers(regex, (const UChar *) name, (const UChar *) name + group_name_match->byte_lengths[loc+1], &numbers);
                 
                 // If it's not found, store the error code
                 if (n_matched == ONIGERR_UNDEFINED_NAME_REFERENCE)
@@ -116,6 +156,9 @@ static backref_info_t * ore_find_backrefs (const char *replacement, regex_t *reg
             }
         }
         
+        ore_rawmatch_free(group_number_match);
+        ore_rawmatch_free(group_name_match);
+        
         return info;
     }
 }
@@ -127,8 +170,13 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
         error("The specified regex object is not valid");
     
     // Convert R objects to C types
-    text_t *text = ore_text(text_);
+    text_t *text = ore_text(text_, FALSE);
     regex_t *regex = ore_retrieve(regex_, text->encoding);
+    
+    // The regex, and each element's match data until the replacements have been worked out, are held by an owner
+    SEXP owner = PROTECT(ore_owner(regex, regex_, 1));
+    rawmatch_t **raw_matches = ore_owner_matches(owner);
+    
     const int n_groups = onig_number_of_captures(regex);
     SEXP group_names = getAttrib(regex_, install("groupNames"));
     const Rboolean all = asLogical(all_) == TRUE;
@@ -137,7 +185,7 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
     const int start_len = length(start_);
     if (start_len < 1)
     {
-        ore_free(regex, regex_);
+        ore_owner_release(owner);
         error("The vector of starting positions is empty");
     }
     
@@ -151,7 +199,7 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
         replacement_len = length(replacement_);
         if (replacement_len < 1)
         {
-            ore_free(regex, regex_);
+            ore_owner_release(owner);
             error("No replacement has been given");
         }
         
@@ -165,12 +213,12 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
                 {
                     if (backref_info[j]->group_numbers[k] > n_groups)
                     {
-                        ore_free(regex, regex_);
+                        ore_owner_release(owner);
                         error("Replacement %d references a group number (%d) that isn't captured", j+1, backref_info[j]->group_numbers[k]);
                     }
                     else if (backref_info[j]->group_numbers[k] == ONIGERR_UNDEFINED_NAME_REFERENCE)
                     {
-                        ore_free(regex, regex_);
+                        ore_owner_release(owner);
                         error("Replacement %d references an undefined group name", j+1);
                     }
                 }
@@ -178,11 +226,16 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
         }
     }
     
+    ore_memory_reset_peak();
+    ore_search_limits();
+    
     SEXP results = PROTECT(NEW_CHARACTER(text->length));
     
     // Step through each string to be searched
     for (int i=0; i<text->length; i++)
     {
+        ore_poll_interrupt((size_t) i, owner);
+        
         text_element_t *text_element = ore_text_element(text, i, FALSE, NULL);
         if (text_element == NULL)
         {
@@ -197,33 +250,48 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
         }
         
         // Do the match
-        rawmatch_t *raw_match = ore_search(regex, text_element->start, text_element->end, all, (size_t) start[i % start_len] - 1);
+        rawmatch_t *raw_match = raw_matches[0] = ore_search(regex, text_element->start, text_element->end, text_element->ascii, all, (size_t) start[i % start_len] - 1);
         
         // If there's no match the return value is the original string
         if (raw_match == NULL)
             SET_STRING_ELT(results, i, ore_text_element_to_rchar(text_element));
         else
         {
-            const char **replacements = (const char **) R_alloc(raw_match->n_matches, sizeof(char *));
+            const int n_matches = raw_match->n_matches;
+            const char **replacements = (const char **) R_alloc(n_matches, sizeof(char *));
+            int *rep_lengths = (int *) R_alloc(n_matches, sizeof(int));
+            
+            // Since offsets and lengths are not contiguous if there are groups, we need to create new vectors that are
+            int *offsets = (int *) R_alloc(n_matches, sizeof(int));
+            int *lengths = (int *) R_alloc(n_matches, sizeof(int));
+            for (int j=0; j<n_matches; j++)
+            {
+                offsets[j] = raw_match->byte_offsets[j*raw_match->n_regions];
+                lengths[j] = raw_match->byte_lengths[j*raw_match->n_regions];
+            }
             
             // If the replacement is a function, construct a call to the function and run it
             if (isFunction(replacement_))
             {
                 // Create an R character vector containing the matches
-                SEXP matches = PROTECT(NEW_CHARACTER(raw_match->n_matches));
-                ore_char_vector(matches, (const char **) raw_match->matches, raw_match->n_regions, raw_match->n_matches, text_element->encoding);
+                SEXP matches = PROTECT(NEW_CHARACTER(n_matches));
+                ore_char_vector(matches, text_element->start, raw_match->byte_offsets, raw_match->byte_lengths, raw_match->n_regions, n_matches, text_element->encoding);
                 
                 // If there are groups, extract them and put them in an attribute
                 if (raw_match->n_regions > 1)
                 {
-                    SEXP group_matches = PROTECT(allocMatrix(STRSXP, raw_match->n_matches, raw_match->n_regions-1));
-                    ore_char_matrix(group_matches, (const char **) raw_match->matches, raw_match->n_regions, raw_match->n_matches, -1, group_names, text_element->encoding);
+                    SEXP group_matches = PROTECT(allocMatrix(STRSXP, n_matches, raw_match->n_regions-1));
+                    ore_char_matrix(group_matches, text_element->start, raw_match->byte_offsets, raw_match->byte_lengths, raw_match->n_regions, n_matches, -1, group_names, text_element->encoding);
                     setAttrib(matches, install("groups"), group_matches);
                     UNPROTECT(1);
                 }
                 
                 setAttrib(matches, R_ClassSymbol, mkString("orearg"));
                 
+                // Everything needed from the match data is now in R vectors, so it is freed before control passes back to R, which may not return here
+                ore_rawmatch_free(raw_match);
+                raw_matches[0] = NULL;
+                
                 // This is arcane R API territory: we create a LANGSXP (an evaluable pairlist), and append the "..." pairlist, then evaluate the result and coerce to a character vector
                 SEXP call = PROTECT(listAppend(lang2(replacement_, matches), function_args));
                 SEXP result = PROTECT(eval(call, environment));
@@ -231,12 +299,19 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
                 const int result_len = length(char_result);
                 
                 // Extract the replacements as C strings, from the R character vector of results
-                for (int j=0; j<raw_match->n_matches; j++)
+                for (int j=0; j<n_matches; j++)
                 {
                     if (result_len == 0)
+                    {
                         replacements[j] = &nul;
+                        rep_lengths[j] = 0;
+                    }
                     else
-                        replacements[j] = (const char *) CHAR(STRING_ELT(char_result, j % result_len));
+                    {
+                        SEXP element = STRING_ELT(char_result, j % result_len);
+                        replacements[j] = CHAR(element);
+                        rep_lengths[j] = LENGTH(element);
+                    }
                 }
                 
                 UNPROTECT(4);
@@ -244,49 +319,39 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
             else
             {
                 // If the replacement is a string, then we may need to do another level of substitutions, if there are back-references
-                for (int j=0; j<raw_match->n_matches; j++)
+                for (int j=0; j<n_matches; j++)
                 {
                     // This subindex determines which replacement element is used for this match
                     const int jj = j % replacement_len;
-                    const char *replacement_template = CHAR(STRING_ELT(replacement_, jj));
+                    SEXP replacement_template = STRING_ELT(replacement_, jj);
                     if (backref_info[jj] != NULL)
-                    {
-                        const char **backref_replacements = (const char **) R_alloc(backref_info[jj]->n, sizeof(char *));
-                        for (int k=0; k<backref_info[jj]->n; k++)
-                            backref_replacements[k] = raw_match->matches[j*raw_match->n_regions + backref_info[jj]->group_numbers[k]];
-                        replacements[j] = ore_substitute(replacement_template, backref_info[jj]->n, backref_info[jj]->offsets, backref_info[jj]->lengths, backref_replacements);
-                    }
+                        replacements[j] = ore_expand_backrefs(replacement_template, backref_info[jj], text_element->start, raw_match, j, &rep_lengths[j]);
                     else
                     {
-                        // If not, the replacements are just the literal replacement string, so we reuse its pointer
-                        for (int j=0; j<raw_match->n_matches; j++)
-                            replacements[j] = replacement_template;
+                        // If not, the replacement is just the literal replacement string, so we reuse its pointer
+                        replacements[j] = CHAR(replacement_template);
+                        rep_lengths[j] = LENGTH(replacement_template);
                     }
                 }
-            }
-            
-            // Since offsets and lengths are not contiguous if there are groups, we need to create new vectors that are
-            int *offsets = (int *) R_alloc(raw_match->n_matches, sizeof(int));
-            int *lengths = (int *) R_alloc(raw_match->n_matches, sizeof(int));
-            for (int j=0; j<raw_match->n_matches; j++)
-            {
-                offsets[j] = raw_match->byte_offsets[j*raw_match->n_regions];
-                lengths[j] = raw_match->byte_lengths[j*raw_match->n_regions];
+                
+                ore_rawmatch_free(raw_match);
+                raw_matches[0] = NULL;
             }
             
             // Do the main substitution, and insert the result
-            char *result = ore_substitute(text_element->start, raw_match->n_matches, offsets, lengths, replacements);
-            SET_STRING_ELT(results, i, ore_string_to_rchar(result, text_element->encoding));
+            size_t result_len;
+            const char *result = ore_substitute(text_element->start, (size_t) (text_element->end - text_element->start), n_matches, offsets, lengths, replacements, rep_lengths, &result_len);
+            SET_STRING_ELT(results, i, ore_fragment_to_rchar(result, result_len, text_element->encoding));
         }
     }
     
     if (text->source == VECTOR_SOURCE)
         setAttrib(results, R_NamesSymbol, getAttrib(text->object,R_NamesSymbol));
     
-    ore_free(regex, regex_);
+    ore_owner_release(owner);
     ore_text_done(text);
     
-    UNPROTECT(1);
+    UNPROTECT(2);
     return results;
 }
 
@@ -297,8 +362,13 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
         error("The specified regex object is not valid");
     
     // Convert R objects to C types
-    text_t *text = ore_text(text_);
+    text_t *text = ore_text(text_, FALSE);
     regex_t *regex = ore_retrieve(regex_, text->encoding);
+    
+    // The regex, and each element's match data until the replacements have been worked out, are held by an owner
+    SEXP owner = PROTECT(ore_owner(regex, regex_, 1));
+    rawmatch_t **raw_matches = ore_owner_matches(owner);
+    
     const int n_groups = onig_number_of_captures(regex);
     SEXP group_names = getAttrib(regex_, install("groupNames"));
     const Rboolean all = asLogical(all_) == TRUE;
@@ -308,7 +378,7 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
     const int start_len = length(start_);
     if (start_len < 1)
     {
-        ore_free(regex, regex_);
+        ore_owner_release(owner);
         error("The vector of starting positions is empty");
     }
     
@@ -322,7 +392,7 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
         base_replacement_len = length(replacement_);
         if (base_replacement_len < 1)
         {
-            ore_free(regex, regex_);
+            ore_owner_release(owner);
             error("No replacement has been given");
         }
         
@@ -336,12 +406,12 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
                 {
                     if (backref_info[j]->group_numbers[k] > n_groups)
                     {
-                        ore_free(regex, regex_);
+                        ore_owner_release(owner);
                         error("Replacement %d references a group number (%d) that isn't captured", j+1, backref_info[j]->group_numbers[k]);
                     }
                     else if (backref_info[j]->group_numbers[k] == ONIGERR_UNDEFINED_NAME_REFERENCE)
                     {
-                        ore_free(regex, regex_);
+                        ore_owner_release(owner);
                         error("Replacement %d references an undefined group name", j+1);
                     }
                 }
@@ -349,11 +419,16 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
         }
     }
     
+    ore_memory_reset_peak();
+    ore_search_limits();
+    
     SEXP results = PROTECT(NEW_LIST(text->length));
     
     // Step through each string to be searched
     for (int i=0; i<text->length; i++)
     {
+        ore_poll_interrupt((size_t) i, owner);
+        
         text_element_t *text_element = ore_text_element(text, i, FALSE, NULL);
         if (text_element == NULL)
         {
@@ -368,35 +443,59 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
         }
         
         // Do the match
-        rawmatch_t *raw_match = ore_search(regex, text_element->start, text_element->end, all, (size_t) start[i % start_len] - 1);
+        rawmatch_t *raw_match = raw_matches[0] = ore_search(regex, text_element->start, text_element->end, text_element->ascii, all, (size_t) start[i % start_len] - 1);
         
         int replacement_len = base_replacement_len;
         
-        // A 2D array of strings to hold literal replacements for each match
+        // 2D arrays to hold literal replacements for each match, and their lengths
         const char ***replacements = NULL;
+        int **rep_lengths = NULL;
+        
+        // Offsets and lengths of the matches, kept separately because the raw match is freed before substitution
+        int n_matches = 0;
+        int *offsets = NULL, *lengths = NULL;
         
         // If there are matches, process the replacements
         if (raw_match != NULL)
         {
+            n_matches = raw_match->n_matches;
+            offsets = (int *) R_alloc(n_matches, sizeof(int));
+            lengths = (int *) R_alloc(n_matches, sizeof(int));
+            for (int l=0; l<n_matches; l++)
+            {
+                offsets[l] = raw_match->byte_offsets[l*raw_match->n_regions];
+                lengths[l] = raw_match->byte_lengths[l*raw_match->n_regions];
+            }
+            
             if (isFunction(replacement_))
             {
-                SEXP parts = PROTECT(NEW_LIST(raw_match->n_matches));
-                for (int l=0; l<raw_match->n_matches; l++)
+                // Arguments for every call are created first, so that the match data can be freed before control passes back to R, which may not return here
+                SEXP args = PROTECT(NEW_LIST(n_matches));
+                for (int l=0; l<n_matches; l++)
                 {
                     SEXP match = PROTECT(NEW_CHARACTER(1));
-                    ore_char_vector(match, (const char **) &raw_match->matches[l], raw_match->n_regions, 1, text_element->encoding);
+                    ore_char_vector(match, text_element->start, &raw_match->byte_offsets[l*raw_match->n_regions], &raw_match->byte_lengths[l*raw_match->n_regions], raw_match->n_regions, 1, text_element->encoding);
                     
                     if (raw_match->n_regions > 1)
                     {
                         SEXP group_matches = PROTECT(allocMatrix(STRSXP, 1, raw_match->n_regions-1));
-                        ore_char_matrix(group_matches, (const char **) raw_match->matches, raw_match->n_regions, raw_match->n_matches, l, group_names, text_element->encoding);
+                        ore_char_matrix(group_matches, text_element->start, raw_match->byte_offsets, raw_match->byte_lengths, raw_match->n_regions, n_matches, l, group_names, text_element->encoding);
                         setAttrib(match, install("groups"), group_matches);
                         UNPROTECT(1);
                     }
                     
                     setAttrib(match, R_ClassSymbol, mkString("orearg"));
-                    
-                    SEXP call = PROTECT(listAppend(lang2(replacement_, match), function_args));
+                    SET_ELEMENT(args, l, match);
+                    UNPROTECT(1);
+                }
+                
+                ore_rawmatch_free(raw_match);
+                raw_matches[0] = NULL;
+                
+                SEXP parts = PROTECT(NEW_LIST(n_matches));
+                for (int l=0; l<n_matches; l++)
+                {
+                    SEXP call = PROTECT(listAppend(lang2(replacement_, VECTOR_ELT(args, l)), function_args));
                     SEXP result = PROTECT(eval(call, environment));
                     SEXP char_result = PROTECT(coerceVector(result, STRSXP));
                     
@@ -405,43 +504,55 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
                         replacement_len = result_len;
                     
                     SET_ELEMENT(parts, l, char_result);
-                    UNPROTECT(4);
+                    UNPROTECT(3);
                 }
                 
                 replacements = (const char ***) R_alloc(replacement_len, sizeof(char **));
+                rep_lengths = (int **) R_alloc(replacement_len, sizeof(int *));
                 for (int j=0; j<replacement_len; j++)
                 {
-                    replacements[j] = (const char **) R_alloc(raw_match->n_matches, sizeof(char *));
-                    for (int l=0; l<raw_match->n_matches; l++)
+                    replacements[j] = (const char **) R_alloc(n_matches, sizeof(char *));
+                    rep_lengths[j] = (int *) R_alloc(n_matches, sizeof(int));
+                    for (int l=0; l<n_matches; l++)
                     {
                         SEXP element = VECTOR_ELT(parts, l);
                         if (length(element) == 0)
+                        {
                             replacements[j][l] = &nul;
+                            rep_lengths[j][l] = 0;
+                        }
                         else
-                            replacements[j][l] = CHAR(STRING_ELT(element, j % length(element)));
+                        {
+                            SEXP part = STRING_ELT(element, j % length(element));
+                            replacements[j][l] = CHAR(part);
+                            rep_lengths[j][l] = LENGTH(part);
+                        }
                     }
                 }
             }
             else
             {
                 replacements = (const char ***) R_alloc(replacement_len, sizeof(char **));
+                rep_lengths = (int **) R_alloc(replacement_len, sizeof(int *));
                 for (int j=0; j<replacement_len; j++)
                 {
-                    replacements[j] = (const char **) R_alloc(raw_match->n_matches, sizeof(char *));
-                    for (int l=0; l<raw_match->n_matches; l++)
+                    replacements[j] = (const char **) R_alloc(n_matches, sizeof(char *));
+                    rep_lengths[j] = (int *) R_alloc(n_matches, sizeof(int));
+                    for (int l=0; l<n_matches; l++)
                     {
-                        const char *replacement_template = CHAR(STRING_ELT(replacement_, j));
+                        SEXP replacement_template = STRING_ELT(replacement_, j);
                         if (backref_info[j] != NULL)
+                            replacements[j][l] = ore_expand_backrefs(replacement_template, backref_info[j], text_element->start, raw_match, l, &rep_lengths[j][l]);
+                        else
                         {
-                            const char **backref_replacements = (const char **) R_alloc(backref_info[j]->n, sizeof(char *));
-                            for (int k=0; k<backref_info[j]->n; k++)
-                                backref_replacements[k] = raw_match->matches[l*raw_match->n_regions + backref_info[j]->group_numbers[k]];
-                            replacements[j][l] = ore_substitute(replacement_template, backref_info[j]->n, backref_info[j]->offsets, backref_info[j]->lengths, backref_replacements);
+                            replacements[j][l] = CHAR(replacement_template);
+                            rep_lengths[j][l] = LENGTH(replacement_template);
                         }
-                        else
-                            replacements[j][l] = replacement_template;
                     }
                 }
+                
+                ore_rawmatch_free(raw_match);
+                raw_matches[0] = NULL;
             }
         }
         
@@ -453,32 +564,25 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
                 SET_STRING_ELT(result, j, ore_text_element_to_rchar(text_element));
             else
             {
-                int *offsets = (int *) R_alloc(raw_match->n_matches, sizeof(int));
-                int *lengths = (int *) R_alloc(raw_match->n_matches, sizeof(int));
-                for (int l=0; l<raw_match->n_matches; l++)
-                {
-                    offsets[l] = raw_match->byte_offsets[l*raw_match->n_regions];
-                    lengths[l] = raw_match->byte_lengths[l*raw_match->n_regions];
-                }
-                
                 // Do the main substitution, and insert the result
-                char *result_str = ore_substitute(text_element->start, raw_match->n_matches, offsets, lengths, replacements[j]);
-                SET_STRING_ELT(result, j, ore_string_to_rchar(result_str, text_element->encoding));
+                size_t result_str_len;
+                const char *result_str = ore_substitute(text_element->start, (size_t) (text_element->end - text_element->start), n_matches, offsets, lengths, replacements[j], rep_lengths[j], &result_str_len);
+                SET_STRING_ELT(result, j, ore_fragment_to_rchar(result_str, result_str_len, text_element->encoding));
             }
         }
         
         SET_ELEMENT(results, i, result);
         
-        UNPROTECT(raw_match != NULL && isFunction(replacement_) ? 2 : 1);
+        UNPROTECT(n_matches > 0 && isFunction(replacement_) ? 3 : 1);
     }
     
     if (text->source == VECTOR_SOURCE)
         setAttrib(results, R_NamesSymbol, getAttrib(text->object,R_NamesSymbol));
     
-    ore_free(regex, regex_);
+    ore_owner_release(owner);
     ore_text_done(text);
     
-    UNPROTECT(1);
+    UNPROTECT(2);
     
     // Return just the first (and only) element of the full list, if requested
     if (simplify && text->length == 1)
@@ -487,114 +591,234 @@ SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEX
         return results;
 }
 
-SEXP ore_switch_all (SEXP text_, SEXP mappings_, SEXP options_, SEXP encoding_name_)
+// Copy back-reference information into unmanaged memory, so that it can outlive the current .Call()
+static backref_info_t * ore_persist_backrefs (const backref_info_t *info)
+{
+    if (info == NULL)
+        return NULL;
+    
+    // The struct and its three arrays are allocated as one block
+    backref_info_t *copy = (backref_info_t *) malloc(sizeof(backref_info_t) + 3 * (size_t) info->n * sizeof(int));
+    if (copy == NULL)
+        error("Failed to allocate memory for back-reference information");
+    
+    copy->n = info->n;
+    copy->offsets = (int *) (copy + 1);
+    copy->lengths = copy->offsets + info->n;
+    copy->group_numbers = copy->lengths + info->n;
+    memcpy(copy->offsets, info->offsets, info->n * sizeof(int));
+    memcpy(copy->lengths, info->lengths, info->n * sizeof(int));
+    memcpy(copy->group_numbers, info->group_numbers, info->n * sizeof(int));
+    
+    return copy;
+}
+
+static void ore_switchset_finaliser (SEXP set_ptr)
+{
+    switchset_t *set = (switchset_t *) R_ExternalPtrAddr(set_ptr);
+    if (set != NULL)
+    {
+        for (int j=0; j<set->n_rules; j++)
+        {
+            onig_free(set->rules[j].regex);
+            free(set->rules[j].backref_info);
+        }
+        free(set->rules);
+        free(set);
+    }
+    R_ClearExternalPtr(set_ptr);
+}
+
+// Compile all rules of a switch set, storing the result in the specified pointer
+// The pointer owns the partial set from the start, so that nothing leaks if compilation fails
+static switchset_t * ore_switchset_compile (SEXP mappings_, SEXP set_ptr, const char *options, const char *encoding_name)
+{
+    const int n_rules = length(mappings_);
+    SEXP patterns = getAttrib(mappings_, R_NamesSymbol);
+    
+    encoding_t *encoding = ore_build_encoding(encoding_name, STRING_ELT(isNull(patterns) ? mappings_ : patterns, 0));
+    
+    switchset_t *set = (switchset_t *) calloc(1, sizeof(switchset_t));
+    if (set != NULL)
+        set->rules = (switch_rule_t *) calloc(n_rules, sizeof(switch_rule_t));
+    if (set == NULL || set->rules == NULL)
+    {
+        free(set);
+        error("Failed to allocate memory for the switch set");
+    }
+    
+    R_SetExternalPtrAddr(set_ptr, set);
+    R_RegisterCFinalizerEx(set_ptr, &ore_switchset_finaliser, FALSE);
+    ore_keep_source(set_ptr, mappings_);
+    
+    for (int j=0; j<n_rules; j++)
+    {
+        switch_rule_t *rule = &set->rules[j];
+        SEXP mapping = STRING_ELT(mappings_, j);
+        
+        // Rules without a pattern match unconditionally, and so need no compilation
+        set->n_rules = j + 1;
+        if (isNull(patterns) || *CHAR(STRING_ELT(patterns, j)) == '\0')
+            continue;
+        
+        rule->regex = ore_compile(CHAR(STRING_ELT(patterns,j)), options, encoding, "ruby");
+        
+        // Any literal that every match must contain is used to rule out strings without running the matcher
+        const UChar *literal_start, *literal_end;
+        if (onig_get_exact_literal(rule->regex, &literal_start, &literal_end))
+        {
+            rule->literal = (const char *) literal_start;
+            rule->literal_len = (size_t) (literal_end - literal_start);
+        }
+        
+        if (mapping == NA_STRING)
+            continue;
+        
+        const int n_groups = onig_number_of_captures(rule->regex);
+        backref_info_t *backref_info = ore_find_backrefs(CHAR(mapping), rule->regex);
+        if (backref_info != NULL)
+        {
+            for (int k=0; k<backref_info->n; k++)
+            {
+                if (backref_info->group_numbers[k] > n_groups)
+                    error("Template %d references a group number (%d) that isn't captured", j+1, backref_info->group_numbers[k]);
+                else if (backref_info->group_numbers[k] == ONIGERR_UNDEFINED_NAME_REFERENCE)
+                    error("Template %d references an undefined group name", j+1);
+            }
+            rule->backref_info = ore_persist_backrefs(backref_info);
+        }
+    }
+    
+    set->complete = TRUE;
+    return set;
+}
+
+// Build an "oreswitchset" object, whose rules are compiled once and can then be applied to any number of texts
+SEXP ore_switchset_build (SEXP mappings_, SEXP options_, SEXP encoding_name_)
 {
     if (length(mappings_) == 0)
         error("No mappings have been given");
     if (!isString(mappings_))
         error("Mappings should be character strings");
     
-    text_t *text = ore_text(text_);
-    SEXP patterns = PROTECT(getAttrib(mappings_, R_NamesSymbol));
     const char *options = CHAR(STRING_ELT(options_, 0));
     const char *encoding_name = CHAR(STRING_ELT(encoding_name_, 0));
     
-    encoding_t *encoding;
-    if (ore_strnicmp(encoding_name, "auto", 4) == 0)
+    SEXP result = PROTECT(duplicate(mappings_));
+    SEXP set_ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+    ore_switchset_compile(result, set_ptr, options, encoding_name);
+    
+    setAttrib(result, install(".compiled"), set_ptr);
+    setAttrib(result, install("options"), PROTECT(ScalarString(STRING_ELT(options_, 0))));
+    setAttrib(result, install("encoding"), PROTECT(ScalarString(STRING_ELT(encoding_name_, 0))));
+    setAttrib(result, R_ClassSymbol, mkString("oreswitchset"));
+    
+    UNPROTECT(4);
+    return result;
+}
+
+// Retrieve the compiled rules of a switch set, recompiling them if the pointer has been lost (e.g. by serialisation)
+static switchset_t * ore_switchset_retrieve (SEXP switchset_)
+{
+    SEXP set_ptr = getAttrib(switchset_, install(".compiled"));
+    if (!inherits(switchset_, "oreswitchset") || !isString(switchset_) || length(switchset_) == 0 || TYPEOF(set_ptr) != EXTPTRSXP)
+        error("The specified switch set is not valid");
+    
+    switchset_t *set = (switchset_t *) R_ExternalPtrAddr(set_ptr);
+    if (set == NULL)
     {
-        cetype_t r_enc = getCharCE(STRING_ELT(patterns, 0));
-        encoding = ore_encoding(NULL, NULL, &r_enc);
+        SEXP options_ = getAttrib(switchset_, install("options"));
+        SEXP encoding_name_ = getAttrib(switchset_, install("encoding"));
+        const char *options = (isString(options_) && length(options_) > 0) ? CHAR(STRING_ELT(options_, 0)) : "";
+        const char *encoding_name = (isString(encoding_name_) && length(encoding_name_) > 0) ? CHAR(STRING_ELT(encoding_name_, 0)) : "auto";
+        set = ore_switchset_compile(switchset_, set_ptr, options, encoding_name);
+        ore_counters.programs_recompiled++;
     }
-    else
-        encoding = ore_encoding(encoding_name, NULL, NULL);
     
-    Rboolean *done = (Rboolean *) R_alloc(text->length, sizeof(Rboolean));
-    for (int i=0; i<text->length; i++)
-        done[i] = FALSE;
+    if (!set->complete || set->n_rules != length(switchset_))
+        error("The specified switch set is not valid");
+    
+    // The compiled rules and their templates no longer correspond if the set's elements or names have been modified
+    if (ore_source_changed(set_ptr, switchset_))
+        error("The specified switch set has been modified since it was built, and should be rebuilt with ore_switchset()");
+    
+    return set;
+}
+
+// Apply a switch set to each element of the text, trying the rules in priority order so that each element is visited only once
+SEXP ore_switch_all (SEXP text_, SEXP switchset_)
+{
+    switchset_t *set = ore_switchset_retrieve(switchset_);
+    text_t *text = ore_text(text_, FALSE);
+    
+    ore_memory_reset_peak();
+    ore_search_limits();
+    
+    // The current rule's match data is held by the owner until its mapping has been expanded
+    SEXP owner = PROTECT(ore_owner(NULL, R_NilValue, 1));
+    rawmatch_t **raw_matches = ore_owner_matches(owner);
     
     SEXP results = PROTECT(NEW_CHARACTER(text->length));
     for (int i=0; i<text->length; i++)
-        SET_STRING_ELT(results, i, NA_STRING);
-    
-    for (int j=0; j<length(mappings_); j++)
     {
-        // Compile the regex
-        regex_t *regex = NULL;
-        backref_info_t *backref_info = NULL;
-        SEXP mapping = STRING_ELT(mappings_, j);
-        if (!isNull(patterns) && *CHAR(STRING_ELT(patterns, j)) != '\0')
+        ore_poll_interrupt((size_t) i, owner);
+        
+        SET_STRING_ELT(results, i, NA_STRING);
+        
+        text_element_t *text_element = ore_text_element(text, i, FALSE, NULL);
+        for (int j=0; j<set->n_rules; j++)
         {
-            regex = ore_compile(CHAR(STRING_ELT(patterns,j)), options, encoding, "ruby");
+            const switch_rule_t *rule = &set->rules[j];
+            SEXP mapping = STRING_ELT(switchset_, j);
             
-            const int n_groups = onig_number_of_captures(regex);
-            backref_info = ore_find_backrefs(CHAR(mapping), regex);
-            if (backref_info != NULL)
+            // Unconditional rules apply even to missing elements
+            if (rule->regex == NULL)
             {
-                for (int k=0; k<backref_info->n; k++)
-                {
-                    if (backref_info->group_numbers[k] > n_groups)
-                    {
-                        ore_free(regex, NULL);
-                        error("Template %d references a group number (%d) that isn't captured", j+1, backref_info->group_numbers[k]);
-                    }
-                    else if (backref_info->group_numbers[k] == ONIGERR_UNDEFINED_NAME_REFERENCE)
-                    {
-                        ore_free(regex, NULL);
-                        error("Template %d references an undefined group name", j+1);
-                    }
-                }
+                SET_STRING_ELT(results, i, mapping);
+                break;
             }
-        }
-        
-        for (int i=0; i<text->length; i++)
-        {
-            if (done[i])
+            else if (text_element == NULL || !ore_consistent_encodings(text_element->encoding->onig_enc, rule->regex->enc))
+                continue;
+            
+            // If the rule's required literal is absent, it can't match
+            if (rule->literal != NULL && ore_memmem(text_element->start, (size_t) (text_element->end - text_element->start), rule->literal, rule->literal_len) == NULL)
+            {
+                ore_counters.prefilter_skips++;
+                continue;
+            }
+            
+            rawmatch_t *raw_match = raw_matches[0] = ore_search(rule->regex, text_element->start, text_element->end, text_element->ascii, FALSE, 0);
+            if (raw_match == NULL)
                 continue;
-            else if (regex == NULL)
+            else if (mapping == NA_STRING)
             {
-                SET_STRING_ELT(results, i, mapping);
-                done[i] = TRUE;
+                ore_rawmatch_free(raw_match);
+                raw_matches[0] = NULL;
+                break;
             }
-            else
+            
+            const char *result;
+            int result_len;
+            if (rule->backref_info == NULL)
             {
-                text_element_t *text_element = ore_text_element(text, i, FALSE, NULL);
-                if (text_element == NULL || !ore_consistent_encodings(text_element->encoding->onig_enc, regex->enc))
-                    continue;
-                
-                // Do the match
-                rawmatch_t *raw_match = ore_search(regex, text_element->start, text_element->end, FALSE, 0);
-                
-                if (raw_match == NULL)
-                    continue;
-                else if (mapping == NA_STRING)
-                {
-                    SET_STRING_ELT(results, i, NA_STRING);
-                    done[i] = TRUE;
-                    continue;
-                }
-                
-                const char *result;
-                if (backref_info == NULL)
-                    result = CHAR(mapping);
-                else
-                {
-                    const char **backref_replacements = (const char **) R_alloc(backref_info->n, sizeof(char *));
-                    for (int k=0; k<backref_info->n; k++)
-                        backref_replacements[k] = raw_match->matches[backref_info->group_numbers[k]];
-                    result = ore_substitute(CHAR(mapping), backref_info->n, backref_info->offsets, backref_info->lengths, backref_replacements);
-                }
-                
-                SET_STRING_ELT(results, i, ore_string_to_rchar(result, text_element->encoding));
-                done[i] = TRUE;
+                result = CHAR(mapping);
+                result_len = LENGTH(mapping);
             }
+            else
+                result = ore_expand_backrefs(mapping, rule->backref_info, text_element->start, raw_match, 0, &result_len);
+            
+            ore_rawmatch_free(raw_match);
+            raw_matches[0] = NULL;
+            
+            SET_STRING_ELT(results, i, ore_fragment_to_rchar(result, result_len, text_element->encoding));
+            break;
         }
-        
-        ore_free(regex, NULL);
     }
     
     if (text->source == VECTOR_SOURCE)
         setAttrib(results, R_NamesSymbol, getAttrib(text->object,R_NamesSymbol));
     
+    ore_owner_release(owner);
     ore_text_done(text);
     
     UNPROTECT(2);
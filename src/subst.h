@@ -5,6 +5,8 @@ SEXP ore_substitute_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_,
 
 SEXP ore_replace_all (SEXP regex_, SEXP replacement_, SEXP text_, SEXP all_, SEXP start_, SEXP simplify_, SEXP environment, SEXP function_args);
 
-SEXP ore_switch_all (SEXP text_, SEXP mappings_, SEXP options_, SEXP encoding_name_);
+SEXP ore_switchset_build (SEXP mappings_, SEXP options_, SEXP encoding_name_);
+
+SEXP ore_switch_all (SEXP text_, SEXP switchset_);
 
 #endif
@@ -1,4 +1,6 @@
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <R.h>
 #include <Rversion.h>
@@ -13,9 +15,31 @@
 #define USING_CONNECTIONS
 #endif
 
+// Regular files are mapped into memory where possible, rather than read, unless the platform doesn't support it
+#if !defined(DISABLE_MMAP) && !defined(_WIN32)
+#define USING_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 // Initial buffer size when reading from a file; scales exponentially
 #define FILE_BUFFER_SIZE    1024
 
+// Number of encoding conversion handles kept open for reuse
+#define ICONV_CACHE_SIZE    8
+
+typedef struct {
+    char            from[ORE_ENCODING_NAME_MAX_LEN];
+    char            to[ORE_ENCODING_NAME_MAX_LEN];
+    void          * handle;
+    Rboolean        used;
+} iconv_entry_t;
+
+// Conversion handles are cached, because opening them is relatively expensive; when the cache is full, entries are replaced in turn
+static iconv_entry_t iconv_cache[ICONV_CACHE_SIZE];
+static int iconv_cache_next = 0;
+
 // Not strictly part of the API, but useful for case-insensitive string comparison
 extern int onigenc_with_ascii_strnicmp (OnigEncoding enc, const UChar *p, const UChar *end, const UChar *sascii, int n);
 
@@ -24,6 +48,29 @@ int ore_strnicmp (const char *str1, const char *str2, size_t num)
     return onigenc_with_ascii_strnicmp(ONIG_ENCODING_ASCII, (const UChar *) str1, (const UChar *) str1 + num, (const UChar *) str2, num);
 }
 
+// Find the first occurrence of a byte sequence within a buffer, like the nonstandard memmem()
+const char * ore_memmem (const char *haystack, const size_t haystack_len, const char *needle, const size_t needle_len)
+{
+    if (needle_len == 0)
+        return haystack;
+    else if (needle_len > haystack_len)
+        return NULL;
+    
+    const char *last = haystack + (haystack_len - needle_len);
+    const char *ptr = haystack;
+    while (ptr <= last)
+    {
+        ptr = (const char *) memchr(ptr, needle[0], (size_t) (last - ptr) + 1);
+        if (ptr == NULL)
+            return NULL;
+        else if (memcmp(ptr + 1, needle + 1, needle_len - 1) == 0)
+            return ptr;
+        ptr++;
+    }
+    
+    return NULL;
+}
+
 // Extend a vector to hold more values
 // NB: This function is less efficient than standard C realloc(), because it always results in a copy, but using R_alloc simplifies things. The R API function S_realloc() is closely related, but seems to exist only "for compatibility with older versions of S", and zeroes out the extra memory, which is unnecessary here.
 char * ore_realloc (const void *ptr, const size_t new_len, const size_t old_len, const int element_size)
@@ -133,6 +180,17 @@ static OnigEncoding ore_name_to_onig_enc (const char *enc)
     }
 }
 
+// Convert an R encoding to its Oniguruma equivalent, but R asserts very few encodings
+OnigEncoding ore_r_to_onig_enc (const cetype_t r_enc)
+{
+    switch (r_enc)
+    {
+        case CE_UTF8:   return ONIG_ENCODING_UTF8;
+        case CE_LATIN1: return ONIG_ENCODING_ISO_8859_1;
+        default:        return ONIG_ENCODING_ASCII;
+    }
+}
+
 // Create a consistent encoding structure from an existing type, propagating as closely as possible
 encoding_t * ore_encoding (const char *name, OnigEncoding onig_enc, cetype_t *r_enc)
 {
@@ -154,16 +212,11 @@ encoding_t * ore_encoding (const char *name, OnigEncoding onig_enc, cetype_t *r_
             final_r_enc = CE_NATIVE;
     }
     
-    // Propagate back from the R encoding if necessary, but R asserts very few encodings
+    // Propagate back from the R encoding if necessary
     if (onig_enc == NULL && r_enc != NULL)
     {
         final_r_enc = *r_enc;
-        switch (*r_enc)
-        {
-            case CE_UTF8:   onig_enc = ONIG_ENCODING_UTF8;                  break;
-            case CE_LATIN1: onig_enc = ONIG_ENCODING_ISO_8859_1;            break;
-            default:        onig_enc = ONIG_ENCODING_ASCII;                 break;
-        }
+        onig_enc = ore_r_to_onig_enc(*r_enc);
     }
     
     // Create, populate and return the encoding structure
@@ -181,6 +234,24 @@ encoding_t * ore_encoding (const char *name, OnigEncoding onig_enc, cetype_t *r_
     return encoding;
 }
 
+// Check whether an R string is pure ASCII, in which case byte and character offsets are the same
+// R's own record of this is only available through the API from R 4.5.0, so before that the bytes are checked directly
+Rboolean ore_string_ascii (SEXP string)
+{
+#if defined(R_VERSION) && R_VERSION >= R_Version(4,5,0)
+    return (charIsASCII(string) != 0);
+#else
+    const char *ptr = CHAR(string);
+    const int len = LENGTH(string);
+    for (int i=0; i<len; i++)
+    {
+        if ((unsigned char) ptr[i] > 0x7f)
+            return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
 // Check whether the two specified encodings are consistent with one another
 Rboolean ore_consistent_encodings (OnigEncoding first, OnigEncoding second)
 {
@@ -188,25 +259,53 @@ Rboolean ore_consistent_encodings (OnigEncoding first, OnigEncoding second)
     return (first == second || first == ONIG_ENCODING_ASCII || second == ONIG_ENCODING_ASCII);
 }
 
-// Obtain a handle for converting to an encoding R understands
+// Check whether an encoding name refers to the encoding R uses for the specified type, in which case no conversion is needed
+static Rboolean ore_is_r_encoding (const char *name, const cetype_t r_enc)
+{
+    if (r_enc == CE_UTF8)
+        return (strlen(name) == 5 && ore_strnicmp(name, "UTF-8", 5) == 0) || (strlen(name) == 4 && ore_strnicmp(name, "UTF8", 4) == 0);
+    else if (r_enc == CE_LATIN1)
+        return (strlen(name) == 6 && ore_strnicmp(name, "latin1", 6) == 0) || (strlen(name) == 10 && ore_strnicmp(name, "ISO-8859-1", 10) == 0) || (strlen(name) == 9 && ore_strnicmp(name, "ISO8859-1", 9) == 0);
+    else
+        return FALSE;
+}
+
+// Obtain a handle for converting to an encoding R understands, or NULL if no conversion is needed
+// Handles are cached, and must not be closed by the caller
 void * ore_iconv_handle (encoding_t *encoding)
 {
-    void *iconv_handle = NULL;
+    // Text taken from R strings (which have no encoding name) is already in an encoding that R understands
+    if (encoding == NULL || *encoding->name == '\0' || ore_strnicmp(encoding->name, "native.enc", 10) == 0 || ore_is_r_encoding(encoding->name, encoding->r_enc))
+        return NULL;
+    
+    const char *target;
+    if (encoding->r_enc == CE_NATIVE)
+        target = "";
+    else if (encoding->r_enc == CE_LATIN1)
+        target = "latin1";
+    else
+        target = "UTF-8";
     
-    if (encoding != NULL && ore_strnicmp(encoding->name, "native.enc", 10) != 0)
+    for (int i=0; i<ICONV_CACHE_SIZE; i++)
     {
-        char target[ORE_ENCODING_NAME_MAX_LEN];
-        if (encoding->r_enc == CE_NATIVE)
-            target[0] = '\0';
-        else if (encoding->r_enc == CE_LATIN1)
-            strcpy(target, "latin1");
-        else
-            strcpy(target, "UTF-8");
-        
-        iconv_handle = Riconv_open(target, encoding->name);
+        if (iconv_cache[i].used && strcmp(iconv_cache[i].from, encoding->name) == 0 && strcmp(iconv_cache[i].to, target) == 0)
+            return iconv_cache[i].handle;
     }
     
-    return iconv_handle;
+    iconv_entry_t *entry = &iconv_cache[iconv_cache_next];
+    iconv_cache_next = (iconv_cache_next + 1) % ICONV_CACHE_SIZE;
+    if (entry->used && entry->handle != NULL)
+        Riconv_close(entry->handle);
+    
+    // If the conversion isn't available, the text is used as it is, as though no conversion were needed
+    entry->handle = Riconv_open(target, encoding->name);
+    if (entry->handle == (void *) -1)
+        entry->handle = NULL;
+    strcpy(entry->from, encoding->name);
+    strcpy(entry->to, target);
+    entry->used = TRUE;
+    
+    return entry->handle;
 }
 
 // Wrapper around Riconv, to convert between encodings
@@ -215,22 +314,44 @@ const char * ore_iconv (void *iconv_handle, const char *old)
     if (iconv_handle != NULL)
     {
         size_t old_size = strlen(old);
-        size_t new_size = old_size * 6;
-        char *buffer = R_alloc(new_size+1, 1);
-        char *buffer_start = buffer;
-        Riconv(iconv_handle, &old, &old_size, &buffer, &new_size);
-        *buffer = '\0';
-        return buffer_start;
+        
+        // Start with a buffer the size of the input, which is often enough, and grow it if necessary
+        size_t buffer_size = (old_size < 16 ? 16 : old_size);
+        char *buffer = R_alloc(buffer_size+1, 1);
+        char *ptr = buffer;
+        size_t remaining = buffer_size;
+        
+        // Reset any shift state left over from the last use of the handle
+        Riconv(iconv_handle, NULL, NULL, NULL, NULL);
+        
+        while (Riconv(iconv_handle, &old, &old_size, &ptr, &remaining) == (size_t) -1 && errno == E2BIG)
+        {
+            // NB: Any pointer arithmetic must happen before the buffer is reallocated
+            const size_t used = (size_t) (ptr - buffer);
+            buffer = ore_realloc(buffer, 2*buffer_size + 1, used, 1);
+            buffer_size *= 2;
+            ptr = buffer + used;
+            remaining = buffer_size - used;
+        }
+        
+        *ptr = '\0';
+        return buffer;
     }
     else
         return old;
 }
 
-// Close the specified handle
-void ore_iconv_done (void *iconv_handle)
+// Close all cached handles; called when the package is unloaded
+void ore_iconv_clear (void)
 {
-    if (iconv_handle != NULL)
-        Riconv_close(iconv_handle);
+    for (int i=0; i<ICONV_CACHE_SIZE; i++)
+    {
+        if (iconv_cache[i].used && iconv_cache[i].handle != NULL)
+            Riconv_close(iconv_cache[i].handle);
+        iconv_cache[i].used = FALSE;
+        iconv_cache[i].handle = NULL;
+    }
+    iconv_cache_next = 0;
 }
 
 // Helper functions to read a chunk of data from a file or connection
@@ -250,12 +371,38 @@ static size_t ore_read_connection (void *handle, void *buffer, size_t bytes)
 }
 #endif
 
+#ifdef USING_MMAP
+// Map the whole of an open file into memory, if it is a regular, nonempty file whose offsets will fit in an int; otherwise the file will be read as usual
+static void ore_map_file (text_t *text)
+{
+    struct stat info;
+    const int fd = fileno((FILE *) text->handle);
+    if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 || info.st_size > INT_MAX)
+        return;
+    
+    void *map = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+    
+    // The search runs from start to end, so tell the OS to read ahead
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t) info.st_size, MADV_SEQUENTIAL);
+#endif
+    
+    text->map = (char *) map;
+    text->map_size = (size_t) info.st_size;
+}
+#endif
+
 // Create a text object from an R object: a file path, connection or literal character vector
-text_t * ore_text (SEXP text_)
+// If map is TRUE, regular files may be mapped into memory rather than read; their text is then not nul-terminated
+text_t * ore_text (SEXP text_, const Rboolean map)
 {
     text_t *text = (text_t *) R_alloc(1, sizeof(text_t));
     text->object = text_;
     text->length = 1;
+    text->map = NULL;
+    text->map_size = 0;
     
     if (inherits(text_, "orefile"))
     {
@@ -265,6 +412,10 @@ text_t * ore_text (SEXP text_)
         text->handle = fopen(CHAR(STRING_ELT(text_,0)), "rb");
         if (text->handle == NULL)
             error("Could not open file %s", CHAR(STRING_ELT(text_,0)));
+#ifdef USING_MMAP
+        if (map)
+            ore_map_file(text);
+#endif
     }
 #ifdef USING_CONNECTIONS
     else if (inherits(text_, "connection"))
@@ -307,6 +458,7 @@ text_element_t * ore_text_element (text_t *text, const size_t index, const Rbool
         return NULL;
     
     text_element_t *element = (text_element_t *) R_alloc(1, sizeof(text_element_t));
+    element->ascii = FALSE;
     element->incomplete = FALSE;
     
     if (text->source == VECTOR_SOURCE)
@@ -319,6 +471,16 @@ text_element_t * ore_text_element (text_t *text, const size_t index, const Rbool
         element->start = string;
         element->end = string + strlen(string);
         element->encoding = ore_encoding(NULL, NULL, &encoding);
+        
+        // Byte and character offsets are the same in pure ASCII strings
+        element->ascii = ore_string_ascii(str_element);
+    }
+    else if (text->map != NULL)
+    {
+        // Mapped files are used in place, and are always complete
+        element->start = text->map;
+        element->end = text->map + text->map_size;
+        element->encoding = text->encoding;
     }
     else
     {
@@ -351,10 +513,9 @@ text_element_t * ore_text_element (text_t *text, const size_t index, const Rbool
             const Rboolean done = bytes_read < buffer_size;
             if (done)
             {
-                // Append a nul so that string functions will not continue beyond EOF
+                // Append a nul so that string functions will not continue beyond EOF, but leave it outside the text, which then matches a mapped file
                 // There will always be space since the number of bytes read is strictly less than the buffer size
                 *ptr = '\0';
-                ptr++;
                 break;
             }
             else if (incremental)
@@ -382,24 +543,46 @@ text_element_t * ore_text_element (text_t *text, const size_t index, const Rbool
 // Convert a text element to a CHARSXP (single string)
 SEXP ore_text_element_to_rchar (text_element_t *element)
 {
-    return ore_string_to_rchar(element->start, element->encoding);
+    // Text read from a file is followed by a nul, but mapped text is not, so neither is relied on
+    return ore_fragment_to_rchar(element->start, (size_t) (element->end - element->start), element->encoding);
 }
 
 // Convert a C string to a CHARSXP, changing encoding if necessary
 SEXP ore_string_to_rchar (const char *string, encoding_t *encoding)
 {
+    return ore_fragment_to_rchar(string, strlen(string), encoding);
+}
+
+// Convert a fragment of text, which need not be nul-terminated, to a CHARSXP
+// When no change of encoding is needed, the CHARSXP is created directly from the source buffer, so the text is copied only once
+SEXP ore_fragment_to_rchar (const char *start, size_t length, encoding_t *encoding)
+{
+    // As with C strings, the fragment ends at any embedded nul
+    const char *nul = (const char *) memchr(start, '\0', length);
+    if (nul != NULL)
+        length = (size_t) (nul - start);
+    
     void *iconv_handle = ore_iconv_handle(encoding);
-    SEXP result = PROTECT(mkCharCE(ore_iconv(iconv_handle, string), encoding->r_enc));
-    ore_iconv_done(iconv_handle);
+    if (iconv_handle == NULL)
+        return mkCharLenCE(start, (int) length, encoding->r_enc);
     
-    UNPROTECT(1);
-    return result;
+    // Riconv needs a nul-terminated string
+    char *string = R_alloc(length + 1, 1);
+    memcpy(string, start, length);
+    string[length] = '\0';
+    return mkCharCE(ore_iconv(iconv_handle, string), encoding->r_enc);
 }
 
 // Tidy up a text object, where needed
 void ore_text_done (text_t *text)
 {
-    // R handles closing connections, but plain files need to be closed manually
+    // R handles closing connections, but plain files need to be closed (and unmapped) manually
     if (text != NULL && text->source == FILE_SOURCE)
+    {
+#ifdef USING_MMAP
+        if (text->map != NULL)
+            munmap(text->map, text->map_size);
+#endif
         fclose((FILE *) text->handle);
+    }
 }
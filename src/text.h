@@ -24,30 +24,39 @@ typedef struct {
     source_t        source;
     void          * handle;
     encoding_t    * encoding;
+    char          * map;
+    size_t          map_size;
 } text_t;
 
 typedef struct {
     const char    * start;
     const char    * end;
     encoding_t    * encoding;
+    Rboolean        ascii;
     Rboolean        incomplete;
 } text_element_t;
 
 int ore_strnicmp (const char *str1, const char *str2, size_t num);
 
+const char * ore_memmem (const char *haystack, const size_t haystack_len, const char *needle, const size_t needle_len);
+
 char * ore_realloc (const void *ptr, const size_t new_len, const size_t old_len, const int element_size);
 
+OnigEncoding ore_r_to_onig_enc (const cetype_t r_enc);
+
 encoding_t * ore_encoding (const char *name, OnigEncoding onig_enc, cetype_t *r_enc);
 
+Rboolean ore_string_ascii (SEXP string);
+
 Rboolean ore_consistent_encodings (OnigEncoding first, OnigEncoding second);
 
 void * ore_iconv_handle (encoding_t *encoding);
 
 const char * ore_iconv (void *iconv_handle, const char *old);
 
-void ore_iconv_done (void *iconv_handle);
+void ore_iconv_clear (void);
 
-text_t * ore_text (SEXP text_);
+text_t * ore_text (SEXP text_, const Rboolean map);
 
 text_element_t * ore_text_element (text_t *text, const size_t index, const Rboolean incremental, text_element_t *previous);
 
@@ -55,6 +64,8 @@ SEXP ore_text_element_to_rchar (text_element_t *element);
 
 SEXP ore_string_to_rchar (const char *string, encoding_t *encoding);
 
+SEXP ore_fragment_to_rchar (const char *start, size_t length, encoding_t *encoding);
+
 void ore_text_done (text_t *text);
 
 #endif
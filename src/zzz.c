@@ -6,11 +6,16 @@
 #include <R_ext/Rdynload.h>
 
 #include "onigmo.h"
+#include "cache.h"
 #include "compile.h"
 #include "escape.h"
+#include "lazy.h"
 #include "match.h"
 #include "print.h"
+#include "scratch.h"
+#include "set.h"
 #include "split.h"
+#include "stats.h"
 #include "subst.h"
 #include "zzz.h"
 
@@ -57,6 +62,10 @@ SEXP ore_init (void)
 // R wrapper function for onig_end(); called when the package is unloaded
 SEXP ore_done (void)
 {
+    ore_cache_clear();
+    ore_iconv_clear();
+    ore_scratch_clear();
+    
     onig_free(group_number_regex);
     onig_free(group_name_regex);
     free(modified_ruby_syntax);
@@ -69,12 +78,18 @@ SEXP ore_done (void)
 static R_CallMethodDef callMethods[] = {
     { "ore_build",          (DL_FUNC) &ore_build,           4 },
     { "ore_escape",         (DL_FUNC) &ore_escape,          1 },
-    { "ore_search_all",     (DL_FUNC) &ore_search_all,      6 },
+    { "ore_search_all",     (DL_FUNC) &ore_search_all,      8 },
+    { "ore_ismatch_all",    (DL_FUNC) &ore_ismatch_all,     4 },
+    { "ore_count_all",      (DL_FUNC) &ore_count_all,       4 },
     { "ore_print_match",    (DL_FUNC) &ore_print_match,     5 },
     { "ore_split",          (DL_FUNC) &ore_split,           4 },
     { "ore_substitute_all", (DL_FUNC) &ore_substitute_all,  7 },
     { "ore_replace_all",    (DL_FUNC) &ore_replace_all,     8 },
-    { "ore_switch_all",     (DL_FUNC) &ore_switch_all,      4 },
+    { "ore_switchset_build",(DL_FUNC) &ore_switchset_build, 3 },
+    { "ore_set_build",      (DL_FUNC) &ore_set_build,       4 },
+    { "ore_set_match_all",  (DL_FUNC) &ore_set_match_all,   2 },
+    { "ore_switch_all",     (DL_FUNC) &ore_switch_all,      2 },
+    { "ore_stats",          (DL_FUNC) &ore_stats,           1 },
     { "ore_init",           (DL_FUNC) &ore_init,            0 },
     { "ore_done",           (DL_FUNC) &ore_done,            0 },
     { NULL, NULL, 0 }
@@ -85,4 +100,5 @@ void R_init_ore (DllInfo *info)
    R_registerRoutines(info, NULL, callMethods, NULL, NULL);
    R_useDynamicSymbols(info, FALSE);
    R_forceSymbols(info, TRUE);
+   ore_lazy_init(info);
 }
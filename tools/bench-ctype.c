@@ -0,0 +1,193 @@
+/* Throughput of Onigmo searches for Unicode character types and properties,
+   finding every match in each line of a multilingual and a CJK text. The
+   multilingual text is the package's "glass" dataset, whose path is given as
+   the first argument, if any; the CJK text is generated. Built and run by
+   "bench.sh ctype", which links it against versions of Onigmo built with and
+   without bitmap tables for code ranges. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "onigmo.h"
+
+#define TEXT_LEN        (8 * 1024 * 1024)
+#define LINE_LEN        80
+#define MIN_SECONDS     0.5
+
+// The Ruby syntax, with \w, \d and so on matching any Unicode character of their type, as in the package
+static OnigSyntaxType syntax;
+
+static double now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static size_t put_utf8 (unsigned char *s, const unsigned int code)
+{
+    if (code < 0x80)
+    {
+        s[0] = (unsigned char) code;
+        return 1;
+    }
+    else if (code < 0x800)
+    {
+        s[0] = (unsigned char) (0xc0 | (code >> 6));
+        s[1] = (unsigned char) (0x80 | (code & 0x3f));
+        return 2;
+    }
+    else
+    {
+        s[0] = (unsigned char) (0xe0 | (code >> 12));
+        s[1] = (unsigned char) (0x80 | ((code >> 6) & 0x3f));
+        s[2] = (unsigned char) (0x80 | (code & 0x3f));
+        return 3;
+    }
+}
+
+// Fill the buffer with lines of pseudorandom CJK text: mostly Han ideographs, with kana, Hangul, ideographic punctuation and spaces, and some ASCII digits and letters
+static size_t fill_cjk (unsigned char *text, const size_t len)
+{
+    unsigned int state = 12345;
+    size_t i = 0, line_start = 0;
+    while (i + 4 < len)
+    {
+        state = state * 1103515245 + 12345;
+        const unsigned int r = (state >> 8) & 0xffffff;
+        unsigned int code;
+        switch (r % 16)
+        {
+            case 0: case 1: case 2:     code = 0x3041 + r / 16 % 86; break;
+            case 3:                     code = 0x30a1 + r / 16 % 90; break;
+            case 4: case 5:             code = 0xac00 + r / 16 % 11172; break;
+            case 6:                     code = (r / 16 % 2) ? 0x3001 : 0x3002; break;
+            case 7:                     code = (r / 16 % 4) ? 0x3000 : ' '; break;
+            case 8:                     code = (r / 16 % 2) ? '0' + r / 32 % 10 : 'a' + r / 32 % 26; break;
+            default:                    code = 0x4e00 + r / 16 % 20902; break;
+        }
+        i += put_utf8(text + i, code);
+        if (i - line_start >= LINE_LEN)
+        {
+            text[i++] = '\n';
+            line_start = i;
+        }
+    }
+    return i;
+}
+
+// Fill the buffer with copies of a file's contents
+static size_t fill_file (unsigned char *text, const size_t len, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+    const size_t file_len = fread(text, 1, len, file);
+    fclose(file);
+    if (file_len == 0)
+        return 0;
+    
+    size_t i = file_len;
+    while (i + file_len <= len)
+    {
+        memcpy(text + i, text, file_len);
+        i += file_len;
+    }
+    return i;
+}
+
+// Patterns that test most characters of each line against a class, so that lookups dominate the time taken
+static const char *patterns[] = {
+    "^[\\w\\s]*$",
+    "^[[:alpha:][:punct:]\\s]*$",
+    "\\w+\\d",
+    "\\b\\d",
+    "\\p{Han}{8}",
+    "[\\p{Han}\\p{Hangul}]+\\d",
+    "\\p{Hiragana}{4}",
+    "[\\p{Cyrillic}\\p{Greek}]+"
+};
+
+// Find every match in each line of the text, as a search of a character vector would
+static void run (const char *label, const unsigned char *text, const size_t len)
+{
+    for (size_t k=0; k<sizeof(patterns)/sizeof(patterns[0]); k++)
+    {
+        const char *pattern = patterns[k];
+        regex_t *regex;
+        OnigErrorInfo einfo;
+        if (onig_new(&regex, (const UChar *) pattern, (const UChar *) pattern + strlen(pattern), ONIG_OPTION_NONE, ONIG_ENCODING_UTF8, &syntax, &einfo) != ONIG_NORMAL)
+        {
+            fprintf(stderr, "Failed to compile \"%s\"\n", pattern);
+            exit(1);
+        }
+        OnigRegion *region = onig_region_new();
+        
+        int reps = 0;
+        long matches = 0;
+        const double start = now();
+        double elapsed;
+        do
+        {
+            matches = 0;
+            const unsigned char *line = text;
+            while (line < text + len)
+            {
+                const unsigned char *end = memchr(line, '\n', (size_t) (text + len - line));
+                if (end == NULL)
+                    end = text + len;
+                
+                const unsigned char *ptr = line;
+                while (onig_search(regex, line, end, ptr, end, region, ONIG_OPTION_NONE) >= 0)
+                {
+                    matches++;
+                    ptr = line + region->end[0];
+                    // Step over a zero-length match, character by character
+                    if (region->end[0] == region->beg[0])
+                    {
+                        if (ptr >= end)
+                            break;
+                        ptr += onigenc_mbclen_approximate(ptr, end, ONIG_ENCODING_UTF8);
+                    }
+                }
+                line = end + 1;
+            }
+            reps++;
+            elapsed = now() - start;
+        }
+        while (elapsed < MIN_SECONDS);
+        
+        printf("%-6s %-28s %9ld matches %8.1f MB/s\n", label, pattern, matches, (double) len * reps / elapsed / 1e6);
+        onig_region_free(region, 1);
+        onig_free(regex);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned char *text = (unsigned char *) malloc(TEXT_LEN);
+    if (text == NULL)
+        return 1;
+    
+    onig_init();
+    onig_copy_syntax(&syntax, ONIG_SYNTAX_RUBY);
+    ONIG_OPTION_OFF(syntax.options, ONIG_OPTION_ASCII_RANGE);
+    
+    if (argc > 1)
+    {
+        const size_t len = fill_file(text, TEXT_LEN, argv[1]);
+        if (len == 0)
+        {
+            fprintf(stderr, "Failed to read \"%s\"\n", argv[1]);
+            return 1;
+        }
+        run("glass", text, len);
+    }
+    run("CJK", text, fill_cjk(text, TEXT_LEN));
+    
+    free(text);
+    onig_end();
+    return 0;
+}
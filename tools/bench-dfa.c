@@ -0,0 +1,159 @@
+/* Throughput of Onigmo searches for regexes that a DFA can match, finding
+   every match in each line of a generated English-like text, as the package
+   does: the DFA is tried first, and the backtracking matcher is used if it
+   gives up. Built and run by "bench.sh dfa", which links it against versions
+   of Onigmo built with and without DFA programs. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "onigmo.h"
+
+#define TEXT_LEN        (8 * 1024 * 1024)
+#define LINE_LEN        72
+#define MIN_SECONDS     0.5
+
+// The Ruby syntax, with \w, \d and so on matching any Unicode character of their type, as in the package
+static OnigSyntaxType syntax;
+
+static double now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Fill the buffer with lines of pseudorandom words, drawn mostly from a short list of common ones, with some numbers, e-mail addresses and blank lines
+static size_t fill_text (unsigned char *text, const size_t len)
+{
+    static const char *words[] = { "the", "and", "of", "to", "in", "that", "was", "his", "with", "for", "had", "you", "not", "be", "her", "which", "have", "said", "being", "morning", "nothing", "colour", "color", "caf\xc3\xa9", "na\xc3\xafve" };
+    const size_t n_words = sizeof(words) / sizeof(words[0]);
+    unsigned int state = 12345;
+    size_t i = 0, line_start = 0;
+    while (i + 32 < len)
+    {
+        state = state * 1103515245 + 12345;
+        const unsigned int r = (state >> 8) & 0xffffff;
+        if (r % 64 == 0)
+            i += (size_t) sprintf((char *) text + i, "%u", r / 64 % 10000);
+        else if (r % 64 == 1)
+            i += (size_t) sprintf((char *) text + i, "%s@%s.com", words[r / 64 % n_words], words[r / 4096 % n_words]);
+        else
+        {
+            const size_t word_len = strlen(words[r / 64 % n_words]);
+            memcpy(text + i, words[r / 64 % n_words], word_len);
+            i += word_len;
+        }
+        
+        if (i - line_start >= LINE_LEN)
+        {
+            text[i++] = '\n';
+            if (r % 8 == 0)
+                text[i++] = '\n';
+            line_start = i;
+        }
+        else
+            text[i++] = ' ';
+    }
+    return i;
+}
+
+// Patterns which the backtracking matcher tries at most positions of each line, but which have no back-references or look-around
+static const char *patterns[] = {
+    "\\b\\w{4}\\b",
+    "\\w+ing\\b",
+    "\\d{2,}",
+    "^\\s*$",
+    "(\\w+)@(\\w+)\\.com",
+    "the|and|of",
+    "colou?r",
+    "(?i)MORNING",
+    "[a-z]+ [a-z]+ing",
+    "(a|e)+d$"
+};
+
+// Find every match in each line of the text, as a search of a character vector would
+static void run (const unsigned char *text, const size_t len)
+{
+    OnigDfaCache *cache = onig_dfa_cache_new();
+    OnigMatchStack *stack = onig_match_stack_new();
+    for (size_t k=0; k<sizeof(patterns)/sizeof(patterns[0]); k++)
+    {
+        const char *pattern = patterns[k];
+        regex_t *regex;
+        OnigErrorInfo einfo;
+        if (onig_new(&regex, (const UChar *) pattern, (const UChar *) pattern + strlen(pattern), ONIG_OPTION_DFA, ONIG_ENCODING_UTF8, &syntax, &einfo) != ONIG_NORMAL)
+        {
+            fprintf(stderr, "Failed to compile \"%s\"\n", pattern);
+            exit(1);
+        }
+        OnigRegion *region = onig_region_new();
+        
+        int reps = 0;
+        long matches = 0;
+        const double start = now();
+        double elapsed;
+        do
+        {
+            matches = 0;
+            const unsigned char *line = text;
+            while (line < text + len)
+            {
+                const unsigned char *end = memchr(line, '\n', (size_t) (text + len - line));
+                if (end == NULL)
+                    end = text + len;
+                
+                const unsigned char *ptr = line;
+                while (1)
+                {
+                    OnigPosition result = ONIG_NO_SUPPORT_CONFIG;
+                    if (regex->dfa != NULL)
+                        result = onig_dfa_search(regex, line, end, ptr, end, region, ONIG_OPTION_NONE, cache, stack);
+                    if (result == ONIG_NO_SUPPORT_CONFIG)
+                        result = onig_search_with_stack(regex, line, end, ptr, end, region, ONIG_OPTION_NONE, stack);
+                    if (result < 0)
+                        break;
+                    
+                    matches++;
+                    ptr = line + region->end[0];
+                    // Step over a zero-length match, character by character
+                    if (region->end[0] == region->beg[0])
+                    {
+                        if (ptr >= end)
+                            break;
+                        ptr += onigenc_mbclen_approximate(ptr, end, ONIG_ENCODING_UTF8);
+                    }
+                }
+                line = end + 1;
+            }
+            reps++;
+            elapsed = now() - start;
+        }
+        while (elapsed < MIN_SECONDS);
+        
+        printf("%-24s %9ld matches %8.1f MB/s%s\n", pattern, matches, (double) len * reps / elapsed / 1e6, regex->dfa == NULL ? "" : " (DFA)");
+        onig_region_free(region, 1);
+        onig_free(regex);
+    }
+    onig_match_stack_free(stack);
+    onig_dfa_cache_free(cache);
+}
+
+int main (void)
+{
+    unsigned char *text = (unsigned char *) malloc(TEXT_LEN);
+    if (text == NULL)
+        return 1;
+    
+    onig_init();
+    onig_copy_syntax(&syntax, ONIG_SYNTAX_RUBY);
+    ONIG_OPTION_OFF(syntax.options, ONIG_OPTION_ASCII_RANGE);
+    
+    run(text, fill_text(text, TEXT_LEN));
+    
+    free(text);
+    onig_end();
+    return 0;
+}
@@ -0,0 +1,131 @@
+/* Throughput of Onigmo searches for patterns whose matches begin with an exact
+   string or a character class, over large ASCII and UTF-8 texts in which they
+   only match at the end. Built and run by "bench.sh search", which links it
+   against versions of Onigmo built with and without vectorised scanning. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "onigmo.h"
+
+#define TEXT_LEN        (32 * 1024 * 1024)
+#define MIN_SECONDS     0.5
+
+static double now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Fill the buffer with pseudorandom lowercase words, with some two-byte characters if requested
+static void fill_text (unsigned char *text, const size_t len, const int multibyte)
+{
+    unsigned int state = 12345;
+    size_t i = 0;
+    while (i < len)
+    {
+        state = state * 1103515245 + 12345;
+        const unsigned int r = (state >> 16) & 0x7fff;
+        if (r % 7 == 0)
+            text[i++] = '-';
+        else if (multibyte && r % 11 == 0 && i + 1 < len)
+        {
+            text[i++] = 0xc3;
+            text[i++] = (unsigned char) (0xa0 + r % 32);
+        }
+        else
+            text[i++] = (unsigned char) ('a' + r % 26);
+    }
+}
+
+typedef struct {
+    const char *pattern;
+    const char *planted;
+} bench_t;
+
+// Needles don't occur in the random text, but most begin and end with common letters
+static const bench_t exact_benches[] = {
+    { "Q", "Q" },
+    { "eQ", "eQ" },
+    { "eQXt", "eQXt" },
+    { "eQUIVALt", "eQUIVALt" },
+    { "eQUIVALENTLYDRAt", "eQUIVALENTLYDRAt" },
+    { "eQUIVALENTLYDRAWNFROMTHESAMESETt", "eQUIVALENTLYDRAWNFROMTHESAMESETt" }
+};
+
+// Patterns led by character classes, none of which match the random text
+static const bench_t class_benches[] = {
+    { "[0-9]+", "7" },
+    { "\\s", " " },
+    { "[A-Z_][A-Za-z_]*", "Q" },
+    { "(?:FOO|BAR|BAZ)", "BAZ" },
+    { "[!?.,;:][ ]", "; " }
+};
+
+static void run (const char *label, unsigned char *text, const size_t len, const OnigEncoding enc, const bench_t *benches, const size_t n_benches)
+{
+    for (size_t k=0; k<n_benches; k++)
+    {
+        const char *pattern = benches[k].pattern;
+        const size_t planted_len = strlen(benches[k].planted);
+        regex_t *regex;
+        OnigErrorInfo einfo;
+        if (onig_new(&regex, (const UChar *) pattern, (const UChar *) pattern + strlen(pattern), ONIG_OPTION_NONE, enc, ONIG_SYNTAX_RUBY, &einfo) != ONIG_NORMAL)
+        {
+            fprintf(stderr, "Failed to compile \"%s\"\n", pattern);
+            exit(1);
+        }
+        
+        // Plant a match at the end, so that the whole text is scanned
+        unsigned char original[64];
+        memcpy(original, text + len - planted_len, planted_len);
+        memcpy(text + len - planted_len, benches[k].planted, planted_len);
+        
+        int reps = 0;
+        OnigPosition pos = ONIG_MISMATCH;
+        const double start = now();
+        double elapsed;
+        do
+        {
+            pos = onig_search(regex, text, text + len, text, text + len, NULL, ONIG_OPTION_NONE);
+            reps++;
+            elapsed = now() - start;
+        }
+        while (elapsed < MIN_SECONDS);
+        
+        if (pos != (OnigPosition) (len - planted_len))
+        {
+            fprintf(stderr, "Unexpected match position for \"%s\"\n", pattern);
+            exit(1);
+        }
+        printf("%-6s %-34s %6.2f GB/s\n", label, pattern, (double) len * reps / elapsed / 1e9);
+        memcpy(text + len - planted_len, original, planted_len);
+        onig_free(regex);
+    }
+}
+
+int main (void)
+{
+    unsigned char *text = (unsigned char *) malloc(TEXT_LEN);
+    if (text == NULL)
+        return 1;
+    
+    onig_init();
+    
+    const size_t n_exact = sizeof(exact_benches) / sizeof(exact_benches[0]);
+    const size_t n_class = sizeof(class_benches) / sizeof(class_benches[0]);
+    
+    fill_text(text, TEXT_LEN, 0);
+    run("ASCII", text, TEXT_LEN, ONIG_ENCODING_ASCII, exact_benches, n_exact);
+    run("ASCII", text, TEXT_LEN, ONIG_ENCODING_ASCII, class_benches, n_class);
+    fill_text(text, TEXT_LEN, 1);
+    run("UTF-8", text, TEXT_LEN, ONIG_ENCODING_UTF8, exact_benches, n_exact);
+    run("UTF-8", text, TEXT_LEN, ONIG_ENCODING_UTF8, class_benches, n_class);
+    
+    free(text);
+    onig_end();
+    return 0;
+}
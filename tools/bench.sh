@@ -0,0 +1,74 @@
+#!/bin/sh
+
+# Compare the throughput of the bundled Onigmo built with and without one of
+# its optimisations. The first argument names the benchmark:
+#
+#   search  regexes led by exact strings and character classes, with and
+#           without vectorised scanning (see bench-search.c)
+#   ctype   Unicode character types and properties, with and without bitmap
+#           tables for code ranges (see bench-ctype.c)
+#   dfa     regexes without back-references or look-around, with and without
+#           DFA programs (see bench-dfa.c)
+#
+# Run "./configure" first, so that Onigmo's config.h exists, then run this
+# script from the package root. The ctype benchmark searches the "glass"
+# dataset if R is available to extract it. The C compiler and flags can be set
+# with CC and CFLAGS.
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+onig="$root/src/onig"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-O2"}
+
+case $1 in
+    search)
+        flag=-DONIG_NO_VECTOR_SEARCH
+        feature="vectorised scanning" ;;
+    ctype)
+        flag=-DONIG_NO_CODE_RANGE_TABLES
+        feature="code range tables" ;;
+    dfa)
+        flag=-DONIG_NO_DFA
+        feature="DFA programs" ;;
+    *)
+        echo "Usage: $0 search|ctype|dfa" >&2
+        exit 1 ;;
+esac
+
+if [ ! -f "$onig/config.h" ]; then
+    echo "Onigmo's config.h is missing; run ./configure first" >&2
+    exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+build () {
+    name=$1
+    shift
+    for file in "$onig"/*.c "$onig"/enc/*.c; do
+        case $file in
+            */regposix.c|*/reggnu.c|*/regposerr.c) continue ;;
+        esac
+        $CC $CFLAGS "$@" -I"$onig" -I"$onig/enc" -I"$onig/enc/unicode" -w -c "$file" -o "$work/$name-$(basename "$file" .c).o"
+    done
+    $CC $CFLAGS -I"$onig" "$root/tools/bench-$bench.c" "$work/$name"-*.o -o "$work/$name"
+}
+
+bench=$1
+build without $flag
+build with
+
+set --
+if [ "$bench" = ctype ] && command -v Rscript >/dev/null 2>&1; then
+    Rscript -e "load('$root/data/glass.rda'); writeLines(glass, '$work/glass.txt', useBytes=TRUE)"
+    set -- "$work/glass.txt"
+fi
+
+echo "Without $feature:"
+"$work/without" "$@"
+echo
+echo "With $feature:"
+"$work/with" "$@"